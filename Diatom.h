@@ -7,6 +7,17 @@
 //  - Bool
 //  - Empty
 //  - Table (other Diatom objects)
+//  - Array (numbers, packed contiguously, or other Diatom objects)
+//
+// Table keys are interned: see DiatomKey, below.
+//
+// Diatoms are allocator-aware: a Diatom constructed with a
+// std::pmr::memory_resource allocates its string and table entries from
+// it, and children added to a table use the table's resource.
+// See DiatomArena, below, to keep a whole document in one buffer.
+//
+// Copies share tables and arrays until one of them is modified: see
+// Sharing, below.
 //
 // -- MIT Licensed: http://opensource.org/licenses/MIT/
 // -- BH 2012
@@ -16,104 +27,1116 @@
 #define __Diatom_h
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <algorithm>
+#include <memory_resource>
+#include <functional>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <type_traits>
+#include <memory>
+#include <utility>
+
+
+// Defined by DiatomSerialization.h, which parses tables lazily
+struct DiatomLazyDocument;
+
+
+// DiatomKey
+//  - a handle to an interned table key. Each distinct key string is stored
+//    once, for the life of the program, along with its hash, so comparing
+//    keys is a pointer compare and hashing them is free.
+//
+//    Making a DiatomKey from a string looks it up in a global table, so for
+//    hot paths make the key once and reuse it:
+//
+//      static const DiatomKey hp("hp");
+//      unit[hp].number_value;
+//
+// -----------------------------
+
+struct DiatomKey {
+  struct Interned {
+    std::string name;
+    size_t hash;
+  };
+
+  const Interned *k;
+
+  DiatomKey() : k(empty()) { }
+  explicit DiatomKey(std::string_view s) : k(intern(s)) { }
+
+  std::string_view str() const { return k->name; }
+  size_t hash() const { return k->hash; }
+  operator std::string_view() const { return k->name; }
+
+  bool operator==(const DiatomKey &other) const { return k == other.k; }
+  bool operator!=(const DiatomKey &other) const { return k != other.k; }
+  friend bool operator==(const DiatomKey &key, std::string_view s) { return key.str() == s; }
+  friend bool operator!=(const DiatomKey &key, std::string_view s) { return key.str() != s; }
+
+  struct Hash {
+    size_t operator()(const DiatomKey &key) const { return key.hash(); }
+  };
+
+  static size_t hash(std::string_view s) {
+    return std::hash<std::string_view>()(s);
+  }
+
+
+  // The intern table
+  //  - entries are never freed, and the table itself is never destroyed,
+  //    so keys stay valid during static destruction. The table grows with
+  //    each distinct name, for the life of the program: text whose names
+  //    are unbounded, such as ids used as keys, grows it without limit.
+  //    interned_count() reports its size.
+  //  - each thread looks names up in its own cache first, so that threads
+  //    parsing in parallel take the table's lock only for names they have
+  //    not seen recently
+  // -----------------------------
+
+  struct InternTable {
+    std::shared_mutex mutex;
+    std::unordered_map<std::string_view, const Interned*> keys;
+  };
+
+  static InternTable& intern_table() {
+    static InternTable *table = new InternTable;
+    return *table;
+  }
+
+  static const size_t thread_cache_size = 1024;
+
+  static const Interned* intern(std::string_view s) {
+    size_t h = hash(s);
+    static thread_local const Interned *thread_cache[thread_cache_size];
+    const Interned *&cached = thread_cache[h & (thread_cache_size - 1)];
+    if (cached && cached->hash == h && cached->name == s) {
+      return cached;
+    }
+    cached = intern_shared(s, h);
+    return cached;
+  }
+
+  static const Interned* intern_shared(std::string_view s, size_t h) {
+    InternTable &table = intern_table();
+    {
+      std::shared_lock<std::shared_mutex> lock(table.mutex);
+      auto it = table.keys.find(s);
+      if (it != table.keys.end()) {
+        return it->second;
+      }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(table.mutex);
+    auto it = table.keys.find(s);
+    if (it != table.keys.end()) {
+      return it->second;
+    }
+    Interned *interned = new Interned{ std::string(s), h };
+    table.keys.emplace(interned->name, interned);
+    return interned;
+  }
+
+  // The number of names interned so far
+  static size_t interned_count() {
+    InternTable &table = intern_table();
+    std::shared_lock<std::shared_mutex> lock(table.mutex);
+    return table.keys.size();
+  }
+
+  static const Interned* empty() {
+    static const Interned *e = intern(std::string_view());
+    return e;
+  }
+};
+
+
+// DiatomString
+//  - a Diatom's string value. Strings of up to inline_capacity characters
+//    are stored inline. Longer ones are stored in a block allocated from the
+//    diatom's memory resource, which the diatom releases.
+// -----------------------------
+
+struct DiatomString {
+  struct Block {
+    size_t size;
+    char* chars() { return (char*) (this + 1); }
+  };
+  static const size_t inline_capacity = 15;
+  static const unsigned char out_of_line = 0xff;
+
+  alignas(Block*) char bytes[16];   // bytes[15] is the inline length, or out_of_line
+
+  bool is_inline() const { return (unsigned char) bytes[15] != out_of_line; }
+  Block* block() const {
+    Block *b;
+    memcpy(&b, bytes, sizeof(b));
+    return b;
+  }
+
+  const char* data() const { return is_inline() ? bytes : block()->chars(); }
+  size_t size() const { return is_inline() ? (unsigned char) bytes[15] : block()->size; }
+  size_t length() const { return size(); }
+  bool empty() const { return size() == 0; }
+
+  std::string_view view() const { return std::string_view(data(), size()); }
+  operator std::string_view() const { return view(); }
+
+  friend bool operator==(const DiatomString &a, std::string_view b) { return a.view() == b; }
+  friend bool operator!=(const DiatomString &a, std::string_view b) { return a.view() != b; }
+
+  void init(std::string_view s, std::pmr::memory_resource *resource) {
+    if (s.size() <= inline_capacity) {
+      s.copy(bytes, s.size());
+      bytes[15] = (char) s.size();
+      return;
+    }
+    Block *b = (Block*) resource->allocate(sizeof(Block) + s.size(), alignof(Block));
+    b->size = s.size();
+    s.copy(b->chars(), s.size());
+    memcpy(bytes, &b, sizeof(b));
+    bytes[15] = (char) out_of_line;
+  }
+
+  void release(std::pmr::memory_resource *resource) {
+    if (!is_inline()) {
+      Block *b = block();
+      resource->deallocate(b, sizeof(Block) + b->size, alignof(Block));
+    }
+  }
+};
 
 
 struct Diatom {
+  typedef std::pmr::polymorphic_allocator<char> allocator_type;
+
   struct Type {
-    enum T { Number, Bool, String, Table, Empty };
+    enum T : unsigned char { Number, Bool, String, Table, Empty, Array };
   };
 
   template <class T>
   struct __TableEntry {
-    std::string name;
+    typedef std::pmr::polymorphic_allocator<char> allocator_type;
+
+    DiatomKey name;
     T item;
+
+    __TableEntry(DiatomKey _name, T &&_item, const allocator_type &a = {}) :
+      name(_name), item(std::move(_item), a) { }
+    __TableEntry(const __TableEntry &e, const allocator_type &a = {}) :
+      name(e.name), item(e.item, a) { }
+    __TableEntry(__TableEntry &&e) noexcept = default;
+    __TableEntry(__TableEntry &&e, const allocator_type &a) :
+      name(e.name), item(std::move(e.item), a) { }
+    __TableEntry& operator=(const __TableEntry &) = default;
+    __TableEntry& operator=(__TableEntry &&) = default;
   };
   typedef __TableEntry<Diatom> TableEntry;
-  typedef std::vector<TableEntry> TableEntryVector;
+  typedef std::pmr::vector<TableEntry> TableEntryVector;
+
+  // Tables keep their entries in insertion order. Once a table grows past
+  // table_index_threshold entries, lookups go through a hash index of entry
+  // positions. The index is kept up to date as entries are added and
+  // removed, so it is complete before the table is shared, and is never
+  // changed while shared.
+  // Lookups take a std::string_view or a DiatomKey: with a DiatomKey, the
+  // hash is precomputed and names are compared by pointer.
+  static const size_t table_index_threshold = 16;
+
+  struct TableIndex {
+    struct Slot {
+      uint32_t pos;    // Entry position + 1, or 0 if unused
+      uint32_t hash;   // Low bits of the entry key's hash
+    };
+    Slot *slots = NULL;
+    size_t n_slots = 0;        // A power of two
+    size_t n_indexed = 0;
+    std::pmr::memory_resource *resource = NULL;
+
+    TableIndex() { }
+    TableIndex(const TableIndex &) { }
+    TableIndex(TableIndex &&t) noexcept { take(t); }
+    TableIndex& operator=(const TableIndex &) { reset(); return *this; }
+    TableIndex& operator=(TableIndex &&t) noexcept {
+      if (this != &t) {
+        reset();
+        take(t);
+      }
+      return *this;
+    }
+    ~TableIndex() { reset(); }
+
+    void take(TableIndex &t) {
+      slots = t.slots;
+      n_slots = t.n_slots;
+      n_indexed = t.n_indexed;
+      resource = t.resource;
+      t.slots = NULL;
+      t.n_slots = t.n_indexed = 0;
+    }
+
+    void reset() {
+      if (slots) {
+        resource->deallocate(slots, n_slots * sizeof(Slot), alignof(Slot));
+      }
+      slots = NULL;
+      n_slots = n_indexed = 0;
+    }
+  };
+
+  // Text kept by diatom__serialize_cached: a table's own lines, and the
+  // offsets in them at which the text of each of its table entries goes.
+  // The table marks it dirty when it may have changed, and the fingerprint
+  // of the entries the text was written from catches changes made through
+  // held references, which the table does not see.
+  struct TextCache {
+    struct Split {
+      size_t offset;
+      size_t pos;   // Position of the table entry
+    };
+    std::pmr::string text;
+    std::pmr::vector<Split> splits;
+    size_t indentation = 0;
+    uint64_t fingerprint = 0;
+    bool dirty = true;
+
+    TextCache(const allocator_type &a) : text(a), splits(a) { }
+  };
+
+  // A table's entries and index, allocated from its memory resource when
+  // first needed, and shared by copies of the table until one is modified.
+  // A table is referenced once a call has handed out something through
+  // which its entries could be changed, and is then copied, not shared.
+  // A lazily parsed table holds its unparsed text, and the function to
+  // parse it into entries on first access. The document it was parsed from
+  // is kept after, and records the errors found in building its tables.
+  typedef void (*LazyParse)(Diatom &d, std::string_view text, const std::shared_ptr<DiatomLazyDocument> &document);
+
+  struct Table {
+    TableEntryVector entries;
+    TableIndex index;
+    std::string_view lazy_text;
+    std::atomic<LazyParse> lazy_parse{ NULL };
+    bool lazy_building = false;
+    std::shared_ptr<DiatomLazyDocument> lazy_document;
+    TextCache *text_cache = NULL;
+    bool referenced = false;
+    std::atomic<uint32_t> n_refs{ 1 };
+
+    Table(const allocator_type &a) : entries(a) { }
+    ~Table() {
+      if (text_cache) {
+        text_cache->~TextCache();
+        entries.get_allocator().resource()->deallocate(text_cache, sizeof(TextCache), alignof(TextCache));
+      }
+    }
+  };
+
+  // An array's items, allocated from its memory resource when first needed,
+  // and shared by copies like a table's entries. While every item is a
+  // number the array is packed, holding its items as contiguous doubles in
+  // numbers. Otherwise they are held in items.
+  struct Array {
+    std::pmr::vector<double> numbers;
+    std::pmr::vector<Diatom> items;
+    bool packed = true;
+    bool referenced = false;
+    std::atomic<uint32_t> n_refs{ 1 };
+
+    Array(const allocator_type &a) : numbers(a), items(a) { }
+  };
 
 
   // Properties
+  //  - a Diatom holds its value, type and memory resource in 32 bytes.
+  //    Long strings, table entries and array items are stored out of line.
   // -----------------------------
 
-  Type::T type;
   union {
-    double number_value;
-    bool   bool_value;
+    double       number_value;
+    bool         bool_value;
+    DiatomString string_value;
+    Table       *table_data;
+    Array       *array_data;
   };
-  std::string      string_value;
-  TableEntryVector table_entries;
+  Type::T type;
+  std::pmr::memory_resource *resource;
 
-  bool is_empty()  { return type == Type::Empty;  }
-  bool is_number() { return type == Type::Number; }
-  bool is_bool()   { return type == Type::Bool;   }
-  bool is_string() { return type == Type::String; }
-  bool is_table()  { return type == Type::Table;  }
+  bool is_empty()  const { return type == Type::Empty;  }
+  bool is_number() const { return type == Type::Number; }
+  bool is_bool()   const { return type == Type::Bool;   }
+  bool is_string() const { return type == Type::String; }
+  bool is_table()  const { return type == Type::Table;  }
+  bool is_array()  const { return type == Type::Array;  }
 
 
   // Constructors
+  //  - each takes an optional allocator. Copies are made with the default
+  //    memory resource unless one is given, as for std::pmr containers.
+  // -----------------------------
+
+  Diatom() : table_data(NULL), type(Type::Table), resource(std::pmr::get_default_resource()) { };
+  explicit Diatom(const allocator_type &a) :
+    table_data(NULL), type(Type::Table), resource(a.resource()) { }
+
+  Diatom(double x, const allocator_type &a = {}) :
+    number_value(x), type(Type::Number), resource(a.resource()) { }
+  Diatom(bool x, const allocator_type &a = {}) :
+    bool_value(x), type(Type::Bool), resource(a.resource()) { }
+  Diatom(std::string_view s, const allocator_type &a = {}) :
+    type(Type::String), resource(a.resource())
+  {
+    string_value.init(s, resource);
+  }
+  Diatom(const char *s, const allocator_type &a = {}) : Diatom(std::string_view(s), a) { }
+  Diatom(const std::string &s, const allocator_type &a = {}) : Diatom(std::string_view(s), a) { }
+  Diatom(Type::T t, const allocator_type &a = {}) :
+    number_value(0), type(t), resource(a.resource())
+  {
+    if (t == Type::String)     { string_value.init(std::string_view(), resource); }
+    else if (t == Type::Table) { table_data = NULL; }
+    else if (t == Type::Array) { array_data = NULL; }
+  }
+
+  Diatom(const Diatom &d, const allocator_type &a) : type(Type::Empty), resource(a.resource()) {
+    copy_from(d);
+  }
+  Diatom(Diatom &&d, const allocator_type &a) : type(Type::Empty), resource(a.resource()) {
+    if (*resource == *d.resource) { take(d); }
+    else                          { copy_from(d); }
+  }
+  Diatom(const Diatom &d) : Diatom(d, allocator_type()) { }
+  Diatom(Diatom &&d) noexcept : type(Type::Empty), resource(d.resource) {
+    take(d);
+  }
+
+  // Assignment keeps this diatom's memory resource
+  Diatom& operator=(const Diatom &d) {
+    if (this != &d) {
+      Diatom copy(d, get_allocator());
+      release();
+      take(copy);
+    }
+    return *this;
+  }
+  Diatom& operator=(Diatom &&d) {
+    if (this != &d) {
+      Diatom moved(std::move(d), get_allocator());
+      release();
+      take(moved);
+    }
+    return *this;
+  }
+
+  ~Diatom() {
+    release();
+  }
+
+  allocator_type get_allocator() const {
+    return allocator_type(resource);
+  }
+
+
+  // Storage
   // -----------------------------
 
-  Diatom()                     : type(Type::Table) { };
-  Diatom(double x)             : type(Type::Number), number_value(x) { }
-  Diatom(bool x)               : type(Type::Bool),   bool_value(x)   { }
-  Diatom(const char *s)        : type(Type::String), string_value(s) { }
-  Diatom(const std::string &s) : type(Type::String), string_value(s) { }
-  Diatom(Type::T t) : type(t) { }
+  // Takes d's value, which must use the same memory resource, leaving d Empty
+  void take(Diatom &d) {
+    type = d.type;
+    if (type == Type::Number)      { number_value = d.number_value; }
+    else if (type == Type::Bool)   { bool_value = d.bool_value; }
+    else if (type == Type::String) { string_value = d.string_value; }
+    else if (type == Type::Table)  { table_data = d.table_data; }
+    else if (type == Type::Array)  { array_data = d.array_data; }
+    d.type = Type::Empty;
+  }
+
+  // Copies d's value, which may use a different memory resource, into this
+  // Empty diatom
+  void copy_from(const Diatom &d) {
+    type = d.type;
+    if (type == Type::Number)      { number_value = d.number_value; }
+    else if (type == Type::Bool)   { bool_value = d.bool_value; }
+    else if (type == Type::String) { string_value.init(d.string_value, resource); }
+    else if (type == Type::Table) {
+      table_data = NULL;
+      LazyParse parse = d.table_data ? d.table_data->lazy_parse.load(std::memory_order_acquire) : NULL;
+      if (parse) {
+        make_lazy_table(d.table_data->lazy_text, parse, d.table_data->lazy_document);
+      }
+      else if (d.table_data && *resource == *d.resource && !d.table_data->referenced) {
+        table_data = d.table_data;
+        table_data->n_refs.fetch_add(1, std::memory_order_relaxed);
+      }
+      else if (d.table_data && d.table_data->entries.size() > 0) {
+        copy_table(*d.table_data);
+      }
+    }
+    else if (type == Type::Array) {
+      array_data = NULL;
+      if (d.array_data && *resource == *d.resource && !d.array_data->referenced) {
+        array_data = d.array_data;
+        array_data->n_refs.fetch_add(1, std::memory_order_relaxed);
+      }
+      else if (d.array_data) {
+        copy_array(*d.array_data);
+      }
+    }
+  }
+
+  // Frees this diatom's value, leaving it Empty
+  void release() {
+    if (type == Type::String) {
+      string_value.release(resource);
+    }
+    else if (type == Type::Table && table_data) {
+      release_table(table_data);
+    }
+    else if (type == Type::Array && array_data) {
+      release_array(array_data);
+    }
+    type = Type::Empty;
+  }
+
+  void release_array(Array *a) {
+    if (a->n_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      a->~Array();
+      resource->deallocate(a, sizeof(Array), alignof(Array));
+    }
+  }
+
+  void release_table(Table *t) {
+    if (t->n_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      t->~Table();
+      resource->deallocate(t, sizeof(Table), alignof(Table));
+    }
+  }
+
+  Table* make_table() {
+    void *p = resource->allocate(sizeof(Table), alignof(Table));
+    table_data = new (p) Table(get_allocator());
+    return table_data;
+  }
+
+  // Gives this table its own copy of t's entries, and its own index
+  void copy_table(const Table &t) {
+    TableEntryVector &entries = make_table()->entries;
+    table_data->lazy_document = t.lazy_document;
+    entries.reserve(t.entries.size());
+    for (const TableEntry &entry : t.entries) {
+      entries.emplace_back(entry);
+    }
+    if (entries.size() >= table_index_threshold) {
+      build_index();
+    }
+  }
+
+  // Building a lazy table does not change its value, so a const diatom's
+  // table may be built when read
+  const Table* table() const {
+    return const_cast<Diatom*>(this)->table();
+  }
+
+  // The table's entries, or NULL if it has none or is not a table
+  Table* table() {
+    if (type != Type::Table) {
+      return NULL;
+    }
+    if (is_lazy()) {
+      materialize();
+    }
+    return table_data;
+  }
+
+  // A table's entries, in order. Entries may be moved, renamed, added and
+  // removed through the vector, so its index is dropped, until operator[],
+  // set or find rebuilds it. Call table_entries() again to edit the entries
+  // after any of those. Diatoms that are not tables are left as they are,
+  // and have no entries: anything added to the vector returned for them is
+  // discarded by the next call. make_table_type() makes one a table.
+  TableEntryVector& table_entries() {
+    if (type != Type::Table) {
+      thread_local TableEntryVector none;
+      none.clear();
+      return none;
+    }
+    TableEntryVector &entries = own_entries();
+    table_data->index.reset();
+    return entries;
+  }
+
+  // A table's entries, in order, for reading only. Diatoms that are not
+  // tables have none.
+  const TableEntryVector& table_entries() const {
+    static const TableEntryVector none;
+    const Table *t = table();
+    return t ? t->entries : none;
+  }
+
+  // Makes this diatom an empty table if it is not a table
+  void make_table_type() {
+    if (type != Type::Table) {
+      release();
+      type = Type::Table;
+      table_data = NULL;
+    }
+  }
+
+  // The table's entries, making this diatom an empty table first if it is
+  // not a table, as operator[] does, and keeping its index up to date for
+  // calls that add to them
+  TableEntryVector& own_entries() {
+    make_table_type();
+    will_modify();
+    Table *t = table();
+    if (!t) {
+      t = make_table();
+      t->referenced = true;
+    }
+    return t->entries;
+  }
+
+
+  // Lazy tables
+  //  - a lazily parsed table is parsed from its text by the first call that
+  //    needs its entries. The text must outlive the table until then.
+  //  - reading a table can build it, and copies share the tables above a
+  //    lazy one, so tables are built holding lazy_mutex(). A table is
+  //    marked built once its entries are complete, and is read without
+  //    locking after. The thread building a table may use it while it is
+  //    being built.
+  // -----------------------------
+
+  static std::recursive_mutex& lazy_mutex() {
+    static std::recursive_mutex m;
+    return m;
+  }
+
+  void make_lazy_table(std::string_view text, LazyParse parse, const std::shared_ptr<DiatomLazyDocument> &document) {
+    release();
+    type = Type::Table;
+    make_table();
+    table_data->lazy_text = text;
+    table_data->lazy_parse = parse;
+    table_data->lazy_document = document;
+  }
+
+  bool is_lazy() const {
+    return type == Type::Table && table_data && table_data->lazy_parse.load(std::memory_order_acquire);
+  }
+
+  // Parses this table's entries, if it is lazy
+  void materialize() {
+    if (!is_lazy()) {
+      return;
+    }
+    std::lock_guard<std::recursive_mutex> lock(lazy_mutex());
+    Table *t = table_data;
+    LazyParse parse = t->lazy_parse.load(std::memory_order_relaxed);
+    if (!parse || t->lazy_building) {
+      return;
+    }
+    t->lazy_building = true;
+    parse(*this, t->lazy_text, t->lazy_document);
+    forget_references();
+    t->lazy_building = false;
+    t->lazy_parse.store(NULL, std::memory_order_release);
+  }
+
+  // Sharing
+  //  - copying a table with the same memory resource shares its entries,
+  //    so copying is O(1). Calls that return something through which a
+  //    table's entries could be changed first call will_modify(), which
+  //    gives the table its own copy of its entries if they are shared, and
+  //    marks its cached text dirty. Those calls are operator[], set,
+  //    emplace, find, remove_child, table_entries, each, recurse, and
+  //    DiatomPath::find. table(), has(), and the const find, each and
+  //    recurse do not, and are for reading only.
+  //
+  //    The copy made by will_modify() holds copies of the entries, which
+  //    share their own tables in turn. So modifying a value below a shared
+  //    table copies only the tables on the path to it.
+  //
+  //    will_modify() also marks the table referenced: a reference it
+  //    handed out may still be held, and writing through it must not
+  //    change a copy. So copies of a referenced table copy its entries
+  //    instead of sharing them, and those entries' referenced tables in
+  //    turn. forget_references() clears the marks, once no references are
+  //    held, so that later copies share again. Builders clear them on
+  //    the tables they build.
+  //
+  //    Arrays are shared in the same way, and copied by the calls that
+  //    could modify their items: array_numbers, array_items and push_back.
+  //
+  //    Reference counts are atomic, and shared tables are not changed by
+  //    lookups, so copies may be used on different threads. Only
+  //    diatom__serialize_cached writes to shared tables, updating their
+  //    text caches, so it should not run on two copies at once.
+  // -----------------------------
+
+  void will_modify() {
+    if (type == Type::Array) {
+      if (array_data && array_data->n_refs.load(std::memory_order_acquire) > 1) {
+        Array *shared = array_data;
+        copy_array(*shared);
+        release_array(shared);
+      }
+      if (array_data) {
+        array_data->referenced = true;
+      }
+      return;
+    }
+    if (type != Type::Table || !table_data) {
+      return;
+    }
+    if (table_data->n_refs.load(std::memory_order_acquire) > 1) {
+      Table *shared = table_data;
+      copy_table(*shared);
+      release_table(shared);
+    }
+    else if (table_data->text_cache) {
+      table_data->text_cache->dirty = true;
+    }
+    table_data->referenced = true;
+  }
+
+  // Clears the referenced marks at and below this diatom, so that copies
+  // share its tables and arrays again. No reference into them handed out
+  // before may be written through after. Tables below one that is not
+  // referenced are not referenced either, so only marked tables are visited.
+  void forget_references() {
+    if (type == Type::Table && table_data && table_data->referenced) {
+      table_data->referenced = false;
+      for (TableEntry &entry : table_data->entries) {
+        entry.item.forget_references();
+      }
+    }
+    else if (type == Type::Array && array_data && array_data->referenced) {
+      array_data->referenced = false;
+      for (Diatom &item : array_data->items) {
+        item.forget_references();
+      }
+    }
+  }
+
+  bool is_shared() {
+    if (type == Type::Array) {
+      return array_data && array_data->n_refs.load(std::memory_order_acquire) > 1;
+    }
+    return type == Type::Table && table_data && table_data->n_refs.load(std::memory_order_acquire) > 1;
+  }
+
+  TextCache* text_cache() {
+    Table *t = table();
+    if (t && !t->text_cache) {
+      void *p = resource->allocate(sizeof(TextCache), alignof(TextCache));
+      t->text_cache = new (p) TextCache(get_allocator());
+    }
+    return t ? t->text_cache : NULL;
+  }
+
+
+  // Parses every lazy table at or below this one, after which the text they
+  // were parsed from may be released
+  void materialize_all() {
+    if (Table *t = table()) {
+      for (TableEntry &entry : t->entries) {
+        entry.item.materialize_all();
+      }
+    }
+  }
 
 
   // Table diatom lookup
   // -----------------------------
 
-  TableEntryVector::iterator index_of(const std::string &s) {
-    return std::find_if(table_entries.begin(), table_entries.end(), [=](const TableEntry &item) {
-      return item.name == s;
-    });
+  // Key matching for lookups by string and by interned key
+  static size_t key_hash(std::string_view s)    { return DiatomKey::hash(s); }
+  static size_t key_hash(const DiatomKey &key)  { return key.hash(); }
+  static bool key_matches(const TableEntry &e, std::string_view s)   { return e.name.str() == s; }
+  static bool key_matches(const TableEntry &e, const DiatomKey &key) { return e.name == key; }
+
+  // Returns the entry with the given key, or NULL. Like operator[], find
+  // gives the table its own entries first, as the entry may be changed
+  // through the pointer. The const find only reads.
+  template <class K>
+  TableEntry* find(const K &key) {
+    will_modify();
+    return lookup(key, true);
+  }
+
+  template <class K>
+  const TableEntry* find(const K &key) const {
+    return const_cast<Diatom*>(this)->lookup(key);
+  }
+
+  // Returns the entry with the given key, or NULL, without will_modify().
+  // Reading leaves the table unchanged, so a table whose index is out of
+  // date is searched in order. Calls that have made will_modify() pass
+  // rebuild_index, and rebuild it instead.
+  template <class K>
+  TableEntry* lookup(const K &key, bool rebuild_index = false) {
+    Table *t = table();
+    if (!t) {
+      return NULL;
+    }
+    TableEntryVector &entries = t->entries;
+    TableIndex &index = t->index;
+
+    // A slot whose hash matches but whose entry's key does not hash the
+    // same is out of date, as entries were moved through table_entries()
+    if (entries.size() >= table_index_threshold) {
+      size_t h = key_hash(key);
+      for (int attempt = 0; attempt < 2; ++attempt) {
+        if (!index.slots || index.n_indexed != entries.size()) {
+          if (!rebuild_index) {
+            break;
+          }
+          build_index();
+        }
+        size_t mask = index.n_slots - 1;
+        bool stale = false;
+        for (size_t i = h & mask; index.slots[i].pos != 0 && !stale; i = (i + 1) & mask) {
+          const TableIndex::Slot &slot = index.slots[i];
+          if (slot.hash != uint32_t(h)) {
+            continue;
+          }
+          size_t pos = slot.pos - 1;
+          if (pos < entries.size() && key_matches(entries[pos], key)) {
+            return &entries[pos];
+          }
+          stale = pos >= entries.size() || uint32_t(entries[pos].name.hash()) != slot.hash;
+        }
+        if (!stale) {
+          return NULL;
+        }
+        if (!rebuild_index) {
+          break;
+        }
+        index.reset();
+      }
+    }
+
+    for (TableEntry &entry : entries) {
+      if (key_matches(entry, key)) {
+        return &entry;
+      }
+    }
+    return NULL;
+  }
+
+  void index_insert(size_t pos) {
+    TableIndex &index = table_data->index;
+    size_t h = table_data->entries[pos].name.hash();
+    size_t mask = index.n_slots - 1;
+    size_t i = h & mask;
+    while (index.slots[i].pos != 0) {
+      i = (i + 1) & mask;
+    }
+    index.slots[i] = { uint32_t(pos + 1), uint32_t(h) };
+    index.n_indexed += 1;
+  }
+
+  // Keeps the index up to date after entries are removed
+  void reindex() {
+    if (table_data->entries.size() >= table_index_threshold) {
+      build_index();
+    }
+    else {
+      table_data->index.reset();
+    }
+  }
+
+  void build_index() {
+    typedef TableIndex::Slot Slot;
+    TableIndex &index = table_data->index;
+    size_t n_entries = table_data->entries.size();
+    index.reset();
+    size_t n_slots = 16;
+    while (n_slots < n_entries * 2) {
+      n_slots *= 2;
+    }
+    index.resource = resource;
+    index.slots = (Slot*) resource->allocate(n_slots * sizeof(Slot), alignof(Slot));
+    index.n_slots = n_slots;
+    std::fill(index.slots, index.slots + n_slots, Slot{ 0, 0 });
+    for (size_t i=0; i < n_entries; ++i) {
+      index_insert(i);
+    }
+  }
+
+  // Indexing a diatom that is not a table makes it an empty table first
+  Diatom& operator[](std::string_view s) {
+    will_modify();
+    TableEntry *entry = lookup(s, true);
+    return entry ? entry->item : append_entry(DiatomKey(s), Diatom(Type::Empty));
+  }
+
+  Diatom& operator[](const DiatomKey &key) {
+    will_modify();
+    TableEntry *entry = lookup(key, true);
+    return entry ? entry->item : append_entry(key, Diatom(Type::Empty));
+  }
+
+  // Sets the entry for key to d, moving it into place
+  Diatom& set(std::string_view s, Diatom &&d) {
+    will_modify();
+    TableEntry *entry = lookup(s, true);
+    return entry ? (entry->item = std::move(d)) : append_entry(DiatomKey(s), std::move(d));
+  }
+
+  Diatom& set(const DiatomKey &key, Diatom &&d) {
+    will_modify();
+    TableEntry *entry = lookup(key, true);
+    return entry ? (entry->item = std::move(d)) : append_entry(key, std::move(d));
+  }
+
+  // Sets the entry for key to a Diatom constructed from args, using this
+  // table's memory resource
+  template <class K, class... Args>
+  Diatom& emplace(const K &key, Args&&... args) {
+    return set(key, Diatom(std::forward<Args>(args)..., get_allocator()));
+  }
+
+  Diatom& append_entry(const DiatomKey &key, Diatom &&d) {
+    TableEntryVector &entries = own_entries();
+    TableIndex &index = table_data->index;
+    entries.emplace_back(key, std::move(d));
+    if (index.slots && index.n_indexed == entries.size() - 1 && entries.size() * 2 <= index.n_slots) {
+      index_insert(entries.size() - 1);
+    }
+    else if (entries.size() >= table_index_threshold) {
+      build_index();
+    }
+    return entries.back().item;
+  }
+
+  void remove_child(std::string_view s)    { will_modify(); remove_entry(lookup(s, true));   }
+  void remove_child(const DiatomKey &key)  { will_modify(); remove_entry(lookup(key, true)); }
+
+  // Removes an entry found after will_modify()
+  void remove_entry(TableEntry *entry) {
+    if (entry) {
+      TableEntryVector &entries = table_data->entries;
+      entries.erase(entries.begin() + (entry - entries.data()));
+      reindex();
+    }
+  }
+
+  // Removes the entries at the positions marked true, after will_modify(),
+  // in one pass: removing many entries one at a time is quadratic, and
+  // rebuilds the index for each
+  void remove_entries(const std::vector<bool> &marked) {
+    TableEntryVector &entries = table_data->entries;
+    size_t n_kept = 0;
+    for (size_t i=0; i < entries.size(); ++i) {
+      if (marked[i]) {
+        continue;
+      }
+      if (n_kept != i) {
+        entries[n_kept] = std::move(entries[i]);
+      }
+      n_kept += 1;
+    }
+    entries.erase(entries.begin() + n_kept, entries.end());
+    reindex();
+  }
+
+  bool has(std::string_view s) const    { return find(s) != NULL;   }
+  bool has(const DiatomKey &key) const  { return find(key) != NULL; }
+
+
+  // Arrays
+  //  - an array's items are indexed from 0. An array is packed while every
+  //    item is a number: array_numbers() returns its numbers, stored
+  //    contiguously. Adding any other item, or calling array_items(),
+  //    unpacks it, after which its items are held as diatoms. Unpacked
+  //    arrays stay unpacked.
+  // -----------------------------
+
+  Array* make_array() {
+    void *p = resource->allocate(sizeof(Array), alignof(Array));
+    array_data = new (p) Array(get_allocator());
+    return array_data;
+  }
+
+  // Gives this array its own copy of a's items
+  void copy_array(const Array &a) {
+    Array *copy = make_array();
+    copy->packed = a.packed;
+    copy->numbers.assign(a.numbers.begin(), a.numbers.end());
+    copy->items.reserve(a.items.size());
+    for (const Diatom &item : a.items) {
+      copy->items.emplace_back(item);
+    }
+  }
+
+  // The array's items, or NULL if it has none or is not an array. For
+  // reading only, like table().
+  Array* array() {
+    return type == Type::Array ? array_data : NULL;
+  }
+  const Array* array() const {
+    return type == Type::Array ? array_data : NULL;
+  }
+
+  bool is_packed() const {
+    return type == Type::Array && (!array_data || array_data->packed);
   }
 
-  Diatom& operator[](const std::string &s) {
-    const TableEntryVector::iterator &it = index_of(s);
+  size_t array_size() const {
+    const Array *a = array();
+    return !a ? 0 : a->packed ? a->numbers.size() : a->items.size();
+  }
 
-    if (it == table_entries.end()) {
-      table_entries.push_back({ s, Diatom(Type::Empty) });
-      return table_entries.back().item;
+  // Item i's number value, or 0 if it is not a number. i must be less than
+  // array_size().
+  double number_at(size_t i) const {
+    const Array *a = array_data;
+    if (a->packed) {
+      return a->numbers[i];
     }
+    return a->items[i].is_number() ? a->items[i].number_value : 0;
+  }
+
+  // Makes this diatom an empty array if it is not an array
+  void make_array_type() {
+    if (type != Type::Array) {
+      release();
+      type = Type::Array;
+      array_data = NULL;
+    }
+  }
 
-    return it->item;
+  // A packed array's numbers, in order, making this diatom an empty array
+  // first if it is not an array. An unpacked array's numbers are empty and
+  // not part of its value: its items must be read and written through
+  // array_items().
+  std::pmr::vector<double>& array_numbers() {
+    make_array_type();
+    will_modify();
+    Array *a = array_data ? array_data : make_array();
+    a->referenced = true;
+    return a->numbers;
   }
 
-  void remove_child(std::string s) {
-    auto i = index_of(s);
-    if (i != table_entries.end()) {
-      table_entries.erase(i);
+  // An array's items, in order, unpacking it first, and making this diatom
+  // an empty array first if it is not an array
+  std::pmr::vector<Diatom>& array_items() {
+    make_array_type();
+    will_modify();
+    unpack();
+    array_data->referenced = true;
+    return array_data->items;
+  }
+
+  // Moves a packed array's numbers into its items, after will_modify()
+  void unpack() {
+    Array *a = array_data ? array_data : make_array();
+    if (a->packed) {
+      a->items.reserve(a->numbers.size());
+      for (double x : a->numbers) {
+        a->items.emplace_back(x);
+      }
+      a->numbers = std::pmr::vector<double>(a->numbers.get_allocator());
+      a->packed = false;
     }
   }
 
-  bool has(std::string key) {
-    return index_of(key) != table_entries.end();
+  // Appends d, making this diatom an empty array first if it is not an array.
+  // Numbers added to a packed array keep it packed.
+  void push_back(Diatom &&d) {
+    make_array_type();
+    will_modify();
+    Array *a = array_data ? array_data : make_array();
+    if (a->packed && d.type == Type::Number) {
+      a->numbers.push_back(d.number_value);
+      return;
+    }
+    unpack();
+    a->items.emplace_back(std::move(d));
   }
 
 
   // Iteration
+  //  - callbacks receive the entry's name as a std::string_view
+  //  - recurse descends into tables and arrays. Array items are visited
+  //    with an empty name. The numbers in a packed array are not held as
+  //    diatoms, and are not visited: read them with array_numbers() or
+  //    number_at().
+  //  - the const versions pass const Diatom& and only read, so shared
+  //    tables stay shared and cached text stays clean. Call them through
+  //    std::as_const(d) to traverse a snapshot.
   // -----------------------------
 
   template <class F>
   void each(F f) {
-    for (TableEntry &entry : table_entries) {
-      f(entry.name, entry.item);
+    will_modify();
+    if (Table *t = table()) {
+      for (TableEntry &entry : t->entries) {
+        f(entry.name.str(), entry.item);
+      }
+    }
+  }
+
+  template <class F>
+  void each(F f) const {
+    if (const Table *t = table()) {
+      for (const TableEntry &entry : t->entries) {
+        f(entry.name.str(), entry.item);
+      }
     }
   }
 
   template <class F>
   void recurse(F f, bool include_top = false) {
     if (include_top) {
-      f("", *this);
+      f(std::string_view(), *this);
     }
-    for (TableEntry &entry : table_entries) {
-      f(entry.name, entry.item);
-      if (entry.item.type == Type::Table) {
-        entry.item.recurse(f);
+    will_modify();
+    if (Table *t = table()) {
+      for (TableEntry &entry : t->entries) {
+        f(entry.name.str(), entry.item);
+        if (entry.item.type == Type::Table || entry.item.type == Type::Array) {
+          entry.item.recurse(f);
+        }
+      }
+    }
+    else if (type == Type::Array && array_data && !array_data->packed) {
+      for (Diatom &item : array_data->items) {
+        f(std::string_view(), item);
+        if (item.type == Type::Table || item.type == Type::Array) {
+          item.recurse(f);
+        }
+      }
+    }
+  }
+
+  template <class F>
+  void recurse(F f, bool include_top = false) const {
+    if (include_top) {
+      f(std::string_view(), *this);
+    }
+    if (const Table *t = table()) {
+      for (const TableEntry &entry : t->entries) {
+        f(entry.name.str(), entry.item);
+        if (entry.item.type == Type::Table || entry.item.type == Type::Array) {
+          entry.item.recurse(f);
+        }
+      }
+    }
+    else if (type == Type::Array && array_data && !array_data->packed) {
+      for (const Diatom &item : array_data->items) {
+        f(std::string_view(), item);
+        if (item.type == Type::Table || item.type == Type::Array) {
+          item.recurse(f);
+        }
       }
     }
   }
@@ -122,17 +1145,132 @@ struct Diatom {
   // Other
   // -----------------------------
 
-  std::string type_string() {
+  std::string type_string() const {
     return (
       type == Type::Number ? "Number" :
       type == Type::String ? "String" :
       type == Type::Bool   ? "Bool"   :
       type == Type::Table  ? "Table"  :
+      type == Type::Array  ? "Array"  :
       type == Type::Empty  ? "Empty"  : "Unknown"
     );
   };
 };
 
 
-#endif
+// DiatomPath
+//  - a dotted path to a diatom within a tree, compiled once:
+//
+//      static DiatomPath hp("world.units.player.hp");
+//      if (Diatom *d = hp.find(state)) { ... }
+//      if (const Diatom *d = hp.find(std::as_const(snapshot))) { ... }
+//
+//    Each hop's key is interned, and the position at which it was last found
+//    is kept as a hint. A lookup checks the hinted entry first, by pointer
+//    compare, and only searches the table if the entry has moved. The hints
+//    are updated as paths are looked up, so a path should not be used by
+//    several threads at once.
+// -----------------------------
+
+struct DiatomPath {
+  struct Hop {
+    DiatomKey key;
+    size_t hint;    // Position of the entry when last found
+  };
+
+  std::vector<Hop> hops;
+
+  DiatomPath() { }
+  explicit DiatomPath(std::string_view path) {
+    if (path.empty()) {
+      return;
+    }
+    for (size_t i = 0; ; ) {
+      size_t dot = path.find('.', i);
+      hops.push_back(Hop{ DiatomKey(path.substr(i, dot - i)), 0 });
+      if (dot == std::string_view::npos) {
+        break;
+      }
+      i = dot + 1;
+    }
+  }
+
+  // Returns the diatom at this path below d, or NULL if there is none.
+  // The empty path finds d itself. Like operator[], finding through a
+  // non-const diatom gives each table on the path its own entries, as the
+  // result may be changed through the pointer. Finding through a const
+  // diatom only reads, so shared tables stay shared.
+  Diatom* find(Diatom &d)             { return follow(d); }
+  const Diatom* find(const Diatom &d) { return follow(d); }
+
+  bool has(const Diatom &d) {
+    return find(d) != NULL;
+  }
 
+  template <class D>
+  D* follow(D &d) {
+    D *node = &d;
+    for (Hop &hop : hops) {
+      if constexpr (!std::is_const<D>::value) {
+        node->will_modify();
+      }
+      auto *t = node->table();
+      if (!t) {
+        return NULL;
+      }
+      auto &entries = t->entries;
+      if (hop.hint < entries.size() && entries[hop.hint].name == hop.key) {
+        node = &entries[hop.hint].item;
+        continue;
+      }
+      auto *entry = node->find(hop.key);
+      if (!entry) {
+        return NULL;
+      }
+      hop.hint = entry - entries.data();
+      node = &entry->item;
+    }
+    return node;
+  }
+
+  std::string str() const {
+    std::string s;
+    for (size_t i=0; i < hops.size(); ++i) {
+      s += (i == 0 ? "" : ".") + std::string(hops[i].key.str());
+    }
+    return s;
+  }
+};
+
+
+// DiatomArena
+//  - a monotonic buffer for diatoms. Diatoms made by the arena, and
+//    everything added to them, are allocated from it, and are released all
+//    at once when the arena is destroyed: their destructors are never run.
+//
+//      DiatomArena arena;
+//      auto result = diatom__unserialize(text, arena.resource());
+//      Diatom &level = arena.make(std::move(result.d));
+//
+// -----------------------------
+
+struct DiatomArena {
+  std::pmr::monotonic_buffer_resource buffer;
+
+  DiatomArena(size_t initial_size = 64 * 1024) : buffer(initial_size) { }
+  DiatomArena(const DiatomArena &) = delete;
+  DiatomArena& operator=(const DiatomArena &) = delete;
+
+  std::pmr::memory_resource* resource() {
+    return &buffer;
+  }
+
+  template <class... Args>
+  Diatom& make(Args&&... args) {
+    void *p = buffer.allocate(sizeof(Diatom), alignof(Diatom));
+    return *new (p) Diatom(std::forward<Args>(args)..., Diatom::allocator_type(&buffer));
+  }
+};
+
+
+#endif
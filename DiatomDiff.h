@@ -0,0 +1,238 @@
+//
+// DiatomDiff.h
+//
+// Structural diffs between diatoms, and applying them.
+//
+//   Diatom patch = diatom__diff(before, after);
+//   diatom__apply(before, patch);     // before now matches after
+//
+// A patch is itself a diatom, so it can be serialized and sent like any
+// other. It holds up to three trees, each following the paths of the
+// diatoms it was made from:
+//
+//    added:              entries of after that are not in before
+//      units:
+//        unit_7:
+//          hp: 100
+//    changed:            entries whose value differs
+//      world:
+//        tick: 1200
+//    removed:            entries of before that are not in after
+//      units:
+//        unit_3: true
+//
+// In added and changed, a table is descended into, creating it if need
+// be, and other values are set. In removed, a table is descended into, and
+// any other value removes its entry. If either diatom is not a table, the
+// patch is instead "replaced", holding the whole of after.
+//
+// Arrays are values: an array that differs in any item is changed as a
+// whole. Entry order is not part of a diff: added entries are appended to
+// their table. Empty entries are treated as absent. Diffing and applying are
+// linear in the size of the diatoms and patch, as tables look up their
+// entries by hash, and removals from a table are made in one pass.
+//
+// MIT licensed - http://opensource.org/licenses/MIT
+//
+
+#ifndef __DiatomDiff_h
+#define __DiatomDiff_h
+
+#include "Diatom.h"
+#include <vector>
+
+
+// Interface
+// -----------------------------
+
+// Returns the changes that turn a into b
+static Diatom diatom__diff(Diatom &a, Diatom &b);
+
+// Applies changes made by diatom__diff to d
+static void diatom__apply(Diatom &d, Diatom &patch);
+
+
+
+// Implementation
+// -----------------------------
+
+struct _DiatomDiff {
+  static const DiatomKey& key_added()    { static const DiatomKey k("added");    return k; }
+  static const DiatomKey& key_changed()  { static const DiatomKey k("changed");  return k; }
+  static const DiatomKey& key_removed()  { static const DiatomKey k("removed");  return k; }
+  static const DiatomKey& key_replaced() { static const DiatomKey k("replaced"); return k; }
+
+  static bool numbers_equal(double x, double y) {
+    return x == y || (x != x && y != y);
+  }
+
+  static bool values_equal(Diatom &a, Diatom &b) {
+    if (a.type != b.type) {
+      return false;
+    }
+    switch (a.type) {
+      case Diatom::Type::Number: return numbers_equal(a.number_value, b.number_value);
+      case Diatom::Type::Bool:   return a.bool_value == b.bool_value;
+      case Diatom::Type::String: return a.string_value == b.string_value.view();
+      case Diatom::Type::Array:  return arrays_equal(a, b);
+      case Diatom::Type::Table:  return tables_equal(a, b);
+      default:                   return true;
+    }
+  }
+
+  // Items are compared by value, whether or not their arrays are packed
+  static bool arrays_equal(Diatom &a, Diatom &b) {
+    size_t n = a.array_size();
+    if (b.array_size() != n) {
+      return false;
+    }
+    if (b.is_packed() && !a.is_packed()) {
+      return arrays_equal(b, a);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      bool equal = (
+        !a.is_packed() ? values_equal(a.array()->items[i], b.array()->items[i]) :
+        b.is_packed()  ? numbers_equal(a.number_at(i), b.number_at(i)) :
+        b.array()->items[i].is_number() && numbers_equal(a.number_at(i), b.number_at(i))
+      );
+      if (!equal) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // For tables held in arrays
+  static bool tables_equal(Diatom &a, Diatom &b) {
+    Diatom added, changed, removed;
+    diff_tables(a, b, added, changed, removed);
+    return !added.table() && !changed.table() && !removed.table();
+  }
+
+  static Diatom::TableEntry* find_value(Diatom &d, const DiatomKey &key) {
+    Diatom::TableEntry *entry = d.lookup(key);
+    return entry && !entry->item.is_empty() ? entry : NULL;
+  }
+
+  // Adds the differences between tables a and b to the added, changed and
+  // removed trees, which must be Empty tables
+  static void diff_tables(Diatom &a, Diatom &b, Diatom &added, Diatom &changed, Diatom &removed) {
+    Diatom::allocator_type alloc = added.get_allocator();
+
+    if (Diatom::Table *tb = b.table()) {
+      for (Diatom::TableEntry &entry : tb->entries) {
+        Diatom &item = entry.item;
+        if (item.is_empty()) {
+          continue;
+        }
+        Diatom::TableEntry *before = find_value(a, entry.name);
+        if (!before) {
+          added.set(entry.name, Diatom(item, alloc));
+        }
+        else if (before->item.is_table() && item.is_table()) {
+          Diatom sub_added(alloc), sub_changed(alloc), sub_removed(alloc);
+          diff_tables(before->item, item, sub_added, sub_changed, sub_removed);
+          if (sub_added.table())   { added.set(entry.name, std::move(sub_added));     }
+          if (sub_changed.table()) { changed.set(entry.name, std::move(sub_changed)); }
+          if (sub_removed.table()) { removed.set(entry.name, std::move(sub_removed)); }
+        }
+        else if (!values_equal(before->item, item)) {
+          changed.set(entry.name, Diatom(item, alloc));
+        }
+      }
+    }
+
+    if (Diatom::Table *ta = a.table()) {
+      for (Diatom::TableEntry &entry : ta->entries) {
+        if (!entry.item.is_empty() && !find_value(b, entry.name)) {
+          removed.set(entry.name, Diatom(true, alloc));
+        }
+      }
+    }
+  }
+
+  static Diatom diff(Diatom &a, Diatom &b) {
+    Diatom patch;
+    if (!a.is_table() || !b.is_table()) {
+      patch.set(key_replaced(), Diatom(b));
+      return patch;
+    }
+    Diatom added, changed, removed;
+    diff_tables(a, b, added, changed, removed);
+    if (added.table())   { patch.set(key_added(), std::move(added));     }
+    if (changed.table()) { patch.set(key_changed(), std::move(changed)); }
+    if (removed.table()) { patch.set(key_removed(), std::move(removed)); }
+    return patch;
+  }
+
+  static void apply_set(Diatom &d, Diatom &changes) {
+    Diatom::Table *t = changes.table();
+    if (!t) {
+      return;
+    }
+    for (Diatom::TableEntry &entry : t->entries) {
+      Diatom &target = d[entry.name];
+      if (entry.item.is_table()) {
+        if (!target.is_table()) {
+          target = Diatom();
+        }
+        apply_set(target, entry.item);
+      }
+      else {
+        target = entry.item;
+      }
+    }
+  }
+
+  // Entries to remove are marked as they are found, and removed together,
+  // so removing k entries from a table of n is O(k + n)
+  static void apply_remove(Diatom &d, Diatom &removals) {
+    Diatom::Table *t = removals.table();
+    if (!t) {
+      return;
+    }
+    d.will_modify();
+    Diatom::Table *target_table = d.table();
+    if (!target_table) {
+      return;
+    }
+    std::vector<bool> marked;
+    for (Diatom::TableEntry &entry : t->entries) {
+      Diatom::TableEntry *target = d.lookup(entry.name, true);
+      if (!target) {
+        continue;
+      }
+      if (entry.item.is_table()) {
+        apply_remove(target->item, entry.item);
+      }
+      else {
+        marked.resize(target_table->entries.size());
+        marked[target - target_table->entries.data()] = true;
+      }
+    }
+    if (!marked.empty()) {
+      d.remove_entries(marked);
+    }
+  }
+
+  static void apply(Diatom &d, Diatom &patch) {
+    if (Diatom::TableEntry *replaced = patch.lookup(key_replaced())) {
+      d = replaced->item;
+      return;
+    }
+    if (Diatom::TableEntry *removed = patch.lookup(key_removed())) { apply_remove(d, removed->item); }
+    if (Diatom::TableEntry *changed = patch.lookup(key_changed())) { apply_set(d, changed->item);    }
+    if (Diatom::TableEntry *added = patch.lookup(key_added()))     { apply_set(d, added->item);      }
+  }
+};
+
+
+Diatom diatom__diff(Diatom &a, Diatom &b) {
+  return _DiatomDiff::diff(a, b);
+}
+
+void diatom__apply(Diatom &d, Diatom &patch) {
+  _DiatomDiff::apply(d, patch);
+}
+
+#endif
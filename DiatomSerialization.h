@@ -10,12 +10,20 @@
 //    animals:
 //      birds:
 //        penguins: 7
+//    path: [0, 1.5, 3]
+//    units: [{hp: 10, pos: [1, 2]}, {hp: 7}]
 //
 // Format:
-//  - values are tables, strings, numbers, or booleans
+//  - values are tables, arrays, strings, numbers, or booleans
+//  - arrays are written on one line, and hold strings, numbers, booleans,
+//    arrays, or tables, separated by commas. A table in an array is
+//    written {name: value, ...}
 //  - names must begin with a letter, contain only alphanumeric + underscore.
 //  - indenting: 2 spaces or 1 tab
 //
+// Diatoms can also be converted to and from a compact binary encoding, see
+// "Binary serialization" below.
+//
 // MIT licensed - http://opensource.org/licenses/MIT
 // -- BH 2012
 //
@@ -25,7 +33,155 @@
 
 #include "Diatom.h"
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <unordered_map>
 #include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <ostream>
+#include <functional>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <memory>
+
+// Scanning uses SSE2, or AVX2 where the CPU supports it, on x86-64 with
+// GCC or Clang. Define DIATOM_NO_SIMD to use only the scalar scanners.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(DIATOM_NO_SIMD)
+  #define DIATOM_SIMD_X86
+  #include <immintrin.h>
+#endif
+
+
+// DiatomSink
+//  - a destination for serialized text. Output is gathered in a buffer and
+//    passed to flush_bytes() when the buffer fills, and at the end, so it is
+//    written once, straight to its destination. Once a write fails, ok is
+//    false and later output is dropped.
+//
+//    Serialization also fails if the diatom holds something text cannot:
+//    an Empty array item, or arrays and tables nested more than
+//    max_array_depth deep on one line.
+// -----------------------------
+
+struct DiatomSink {
+  char   *buffer;
+  size_t  capacity;
+  size_t  used = 0;
+  bool    ok = true;
+
+  DiatomSink(char *_buffer, size_t _capacity) : buffer(_buffer), capacity(_capacity) { }
+  virtual ~DiatomSink() { }
+
+  // Writes n bytes to the destination, returning false on failure
+  virtual bool flush_bytes(const char *p, size_t n) = 0;
+
+  void write(std::string_view s) {
+    if (used + s.size() > capacity) {
+      size_t n = capacity - used;
+      memcpy(buffer + used, s.data(), n);
+      used = capacity;
+      s.remove_prefix(n);
+      flush();
+      if (s.size() > capacity) {
+        ok = ok && flush_bytes(s.data(), s.size());
+        return;
+      }
+    }
+    memcpy(buffer + used, s.data(), s.size());
+    used += s.size();
+  }
+
+  void put(char c) {
+    if (used == capacity) {
+      flush();
+    }
+    buffer[used++] = c;
+  }
+
+  void put(char c, size_t n) {
+    for (size_t i=0; i < n; ++i) {
+      put(c);
+    }
+  }
+
+  void fail() {
+    ok = false;
+  }
+
+  bool flush() {
+    if (used > 0) {
+      ok = ok && flush_bytes(buffer, used);
+      used = 0;
+    }
+    return ok;
+  }
+};
+
+// Sinks with their own buffer
+template <size_t N>
+struct DiatomBufferedSink : DiatomSink {
+  char storage[N];
+  DiatomBufferedSink() : DiatomSink(storage, N) { }
+};
+
+struct DiatomStringSink : DiatomBufferedSink<4096> {
+  std::string &s;
+  DiatomStringSink(std::string &_s) : s(_s) { }
+  bool flush_bytes(const char *p, size_t n) {
+    s.append(p, n);
+    return true;
+  }
+};
+
+struct DiatomFileSink : DiatomBufferedSink<16384> {
+  FILE *f;
+  DiatomFileSink(FILE *_f) : f(_f) { }
+  bool flush_bytes(const char *p, size_t n) {
+    return fwrite(p, 1, n, f) == n;
+  }
+};
+
+struct DiatomStreamSink : DiatomBufferedSink<16384> {
+  std::ostream &os;
+  DiatomStreamSink(std::ostream &_os) : os(_os) { }
+  bool flush_bytes(const char *p, size_t n) {
+    os.write(p, n);
+    return bool(os);
+  }
+};
+
+struct DiatomFdSink : DiatomBufferedSink<16384> {
+  int fd;
+  DiatomFdSink(int _fd) : fd(_fd) { }
+  bool flush_bytes(const char *p, size_t n) {
+    while (n > 0) {
+      ssize_t written = ::write(fd, p, n);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        return false;
+      }
+      p += written;
+      n -= written;
+    }
+    return true;
+  }
+};
+
+// Writes into a caller-supplied buffer, which must not be empty, passing
+// each full buffer, and the remainder at the end, to a callback
+struct DiatomCallbackSink : DiatomSink {
+  std::function<bool(const char*, size_t)> callback;
+  DiatomCallbackSink(char *_buffer, size_t _capacity, std::function<bool(const char*, size_t)> _callback) :
+    DiatomSink(_buffer, _capacity), callback(_callback) { }
+  bool flush_bytes(const char *p, size_t n) {
+    return callback(p, n);
+  }
+};
 
 
 // Interface
@@ -34,153 +190,692 @@
 struct DiatomParseResult {
   bool success;
   std::string error_string;
-  Diatom d;
+  Diatom d = {};
 
   bool operator==(DiatomParseResult &r) {
     return success == r.success && error_string == r.error_string;
   }
+
+  // Moves the parsed diatom out of the result
+  Diatom take() {
+    return std::move(d);
+  }
 };
 
+// Serializing fails if d holds something text cannot: see DiatomSink. The
+// _to functions then return false, and the others an empty string.
 static std::string diatom__serialize(Diatom &d);
-static DiatomParseResult diatom__unserialize(const std::string &);
+static bool diatom__serialize_to(Diatom &d, DiatomSink &sink);
+static bool diatom__serialize_to(Diatom &d, FILE *f);
+static bool diatom__serialize_to(Diatom &d, std::ostream &os);
+static bool diatom__serialize_to(Diatom &d, int fd);
+
+// Serializes a table's entries on n_threads threads, or one per core if 0
+static std::string diatom__serialize_parallel(Diatom &d, size_t n_threads = 0);
+static bool diatom__serialize_parallel_to(Diatom &d, DiatomSink &sink, size_t n_threads = 0);
+static DiatomParseResult diatom__unserialize(std::string_view, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+// Serializes as diatom__serialize does, keeping each table's text and
+// reusing it while the table is unchanged: see Diatom::will_modify
+static std::string diatom__serialize_cached(Diatom &d);
+static bool diatom__serialize_cached_to(Diatom &d, DiatomSink &sink);
+
+// Parses large documents on n_threads threads, or one per core if 0. The
+// memory resource must be safe to use from several threads, as the default
+// resource is.
+static DiatomParseResult diatom__unserialize_parallel(std::string_view, size_t n_threads = 0, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+// Parses tables lazily: each table's entries are built when it is first
+// accessed, so the text must outlive the result until then, or until
+// materialize_all() is called. Unless validate is false, the indentation
+// of every line is checked first, without lexing: see
+// diatom__lazy_status for errors found as tables are built.
+static DiatomParseResult diatom__unserialize_lazy(std::string_view, bool validate = true, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+// Event parsing
+//  - reads .diatom text without building a tree, calling the handler's
+//    methods as values are read. Handlers derive from DiatomHandler and
+//    define the methods they need. Keys and strings point into the text.
+//
+//    If the text is invalid, no events are sent after the line where the
+//    first error is found, but events for the lines before it will have
+//    been sent. If done() returns true, parsing stops, successfully.
+//
+//    An array's items are sent between on_array_begin and on_array_end,
+//    with empty keys. A table in an array is sent as a table with an empty
+//    key.
+
+struct DiatomHandler {
+  void on_table_begin(std::string_view /* key */) { }
+  void on_table_end() { }
+  void on_array_begin(std::string_view /* key */) { }
+  void on_array_end() { }
+  void on_number(std::string_view /* key */, double /* x */) { }
+  void on_string(std::string_view /* key */, std::string_view /* s */) { }
+  void on_bool(std::string_view /* key */, bool /* b */) { }
+  bool done() { return false; }
+};
+
+struct DiatomParseStatus {
+  bool success;
+  std::string error_string;
+};
+
+template <class Handler>
+static DiatomParseStatus diatom__parse(std::string_view s, Handler &h);
+
+// The errors found so far in building the tables of a diatom from
+// diatom__unserialize_lazy, reported as diatom__unserialize would report
+// them. Lines with errors are skipped when their table is built, so after
+// materialize_all() this reports any error in the text.
+static DiatomParseStatus diatom__lazy_status(Diatom &d);
+
+static std::string diatom__serialize_binary(Diatom &d);
+static DiatomParseResult diatom__unserialize_binary(std::string_view, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
 
 
 
 // Implementation
 // -----------------------------
 
+// Shared by the tables of a diatom from diatom__unserialize_lazy, recording
+// the first line of each kind of error found as they are built. Tables may
+// be built on different threads.
+struct DiatomLazyDocument {
+  static const size_t none = -1;
+
+  const char *start;    // The text's first line, from which lines are counted
+  std::mutex mutex;
+  size_t i_unexpected_input = none;
+  size_t i_invalid_structure = none;
+
+  DiatomLazyDocument(const char *_start) : start(_start) { }
+
+  void found(size_t &i_first, const char *line) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t i_line = std::count(start, line, '\n');
+    i_first = std::min(i_first, i_line);
+  }
+};
+
 struct _DiatomSerialization {
 
   // Helpers
   // -----------------------------
 
-  static std::string float_format(double x) {
-    std::string s;
-    s.insert(0, 100, '0');
-    sprintf(&s[0], "%.17f", x);
+  // Numbers are written in the shortest form that reads back as exactly the
+  // same double, e.g. 2.4 -> "2.4", 1e21 -> "1e+21"
+  static const size_t float_format_max_length = 32;
+
+  static std::string_view float_format(double x, char *buf) {
+    auto result = std::to_chars(buf, buf + float_format_max_length, x);
+    return std::string_view(buf, result.ptr - buf);
+  }
+
+  static bool has_both_tabs_and_spaces(std::string_view s) {
+    bool contains_space = s.find(' ') != std::string_view::npos;
+    bool contains_tab   = s.find('\t') != std::string_view::npos;
+    return contains_space && contains_tab;
+  }
+
+  static bool is_whitespace(char c) { return c == ' ' || c == '\t'; }
+  static bool is_numeric(char c) { return c >= '0' && c <= '9'; }
+  static bool is_az(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+  static bool is_alphanumeric(char c) { return is_az(c) || is_numeric(c); }
+  static bool is_alphanumeric_or_underscore(char c) { return is_alphanumeric(c) || c == '_'; }
+
+
+  // Scanning
+  //  - each scanner returns the position in p[0, n) of the first character
+  //    that is not a name character, not a space or tab, or that may end
+  //    a string (a quote, \n or \r), or n if there is none. The SIMD
+  //    scanners test 16 or 32 characters at a time, and are chosen once,
+  //    at first use.
+  // -----------------------------
+
+  struct Scanner {
+    const char *name;
+    size_t (*name_end)(const char *p, size_t n);
+    size_t (*whitespace_end)(const char *p, size_t n);
+    size_t (*string_stop)(const char *p, size_t n);
+  };
+
+  static size_t scalar__name_end(const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && is_alphanumeric_or_underscore(p[i])) {
+      ++i;
+    }
+    return i;
+  }
 
-    std::string::iterator it__last_nonzero;
-    for (auto it = s.begin(); it < s.end(); ++it) {
-      if (*it != '0' && *it != '\0') {
-        it__last_nonzero = it;
+  static size_t scalar__whitespace_end(const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && is_whitespace(p[i])) {
+      ++i;
+    }
+    return i;
+  }
+
+  static size_t scalar__string_stop(const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && p[i] != '"' && p[i] != '\n' && p[i] != '\r') {
+      ++i;
+    }
+    return i;
+  }
+
+#ifdef DIATOM_SIMD_X86
+  // Bytes are compared as signed, so characters >= 0x80 are never in range
+  static __m128i sse2__in_range(__m128i x, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8(hi + 1)));
+  }
+
+  static int sse2__name_mask(__m128i x) {
+    __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+    __m128i name = _mm_or_si128(
+      _mm_or_si128(sse2__in_range(lower, 'a', 'z'), sse2__in_range(x, '0', '9')),
+      _mm_cmpeq_epi8(x, _mm_set1_epi8('_'))
+    );
+    return _mm_movemask_epi8(name);
+  }
+
+  static int sse2__whitespace_mask(__m128i x) {
+    return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))));
+  }
+
+  static int sse2__string_stop_mask(__m128i x) {
+    return _mm_movemask_epi8(_mm_or_si128(
+      _mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+      _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\r')))
+    ));
+  }
+
+  // Finds the first block position where mask_fn's bits are (not) set
+  template <int (*mask_fn)(__m128i), bool stop_when_set, size_t (*tail)(const char*, size_t)>
+  static size_t sse2__scan(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+      int mask = mask_fn(_mm_loadu_si128((const __m128i*) (p + i)));
+      int stops = stop_when_set ? mask : (~mask & 0xffff);
+      if (stops) {
+        return i + __builtin_ctz(stops);
       }
     }
+    return i + tail(p + i, n - i);
+  }
 
-    return std::string(
-      s.begin(),
-      it__last_nonzero + (*it__last_nonzero == '.' ? 0 : 1)
+  __attribute__((target("avx2")))
+  static __m256i avx2__in_range(__m256i x, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(lo - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), x));
+  }
+
+  __attribute__((target("avx2")))
+  static uint32_t avx2__name_mask(__m256i x) {
+    __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+    __m256i name = _mm256_or_si256(
+      _mm256_or_si256(avx2__in_range(lower, 'a', 'z'), avx2__in_range(x, '0', '9')),
+      _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_'))
     );
+    return _mm256_movemask_epi8(name);
+  }
 
-    // Note: within a nonzero range of the real numbers the proportion that are
-    // perfectly representable as a double is zero.
-    // So some numbers will serialize as expected: eg integers, multiples of 0.25.
-    // Others will include the floating point error, e.g. 2.4 -> 2.39999999999999991
+  __attribute__((target("avx2")))
+  static uint32_t avx2__whitespace_mask(__m256i x) {
+    return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'))));
   }
 
-  static bool has_both_tabs_and_spaces(const std::string &s) {
-    bool contains_space = s.find(' ') != std::string::npos;
-    bool contains_tab   = s.find('\t') != std::string::npos;
-    return contains_space && contains_tab;
+  __attribute__((target("avx2")))
+  static uint32_t avx2__string_stop_mask(__m256i x) {
+    return _mm256_movemask_epi8(_mm256_or_si256(
+      _mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+      _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r')))
+    ));
   }
 
-  static std::string indent(size_t n) {
-    std::string s;
-    s.insert(0, n*2, ' ');
+  template <uint32_t (*mask_fn)(__m256i), bool stop_when_set, size_t (*tail)(const char*, size_t)>
+  __attribute__((target("avx2")))
+  static size_t avx2__scan(const char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+      uint32_t mask = mask_fn(_mm256_loadu_si256((const __m256i*) (p + i)));
+      uint32_t stops = stop_when_set ? mask : ~mask;
+      if (stops) {
+        return i + __builtin_ctz(stops);
+      }
+    }
+    return i + tail(p + i, n - i);
+  }
+#endif
+
+  static const Scanner& scalar_scanner() {
+    static const Scanner s = { "scalar", scalar__name_end, scalar__whitespace_end, scalar__string_stop };
+    return s;
+  }
+
+#ifdef DIATOM_SIMD_X86
+  static const Scanner& sse2_scanner() {
+    static const Scanner s = {
+      "sse2",
+      sse2__scan<sse2__name_mask, false, scalar__name_end>,
+      sse2__scan<sse2__whitespace_mask, false, scalar__whitespace_end>,
+      sse2__scan<sse2__string_stop_mask, true, scalar__string_stop>,
+    };
+    return s;
+  }
+
+  static const Scanner& avx2_scanner() {
+    static const Scanner s = {
+      "avx2",
+      avx2__scan<avx2__name_mask, false, sse2__scan<sse2__name_mask, false, scalar__name_end>>,
+      avx2__scan<avx2__whitespace_mask, false, sse2__scan<sse2__whitespace_mask, false, scalar__whitespace_end>>,
+      avx2__scan<avx2__string_stop_mask, true, sse2__scan<sse2__string_stop_mask, true, scalar__string_stop>>,
+    };
     return s;
   }
+#endif
+
+  // The scanners this CPU supports, fastest last
+  static std::vector<const Scanner*> available_scanners() {
+    std::vector<const Scanner*> scanners = { &scalar_scanner() };
+#ifdef DIATOM_SIMD_X86
+    scanners.push_back(&sse2_scanner());
+    if (__builtin_cpu_supports("avx2")) {
+      scanners.push_back(&avx2_scanner());
+    }
+#endif
+    return scanners;
+  }
+
+  static const Scanner& scanner() {
+    static const Scanner *s = available_scanners().back();
+    return *s;
+  }
+
+  // Short inputs, which are most names and indents, are scanned inline
+  static const size_t scan_simd_min_length = 16;
+
+  static size_t scan__name_end(const char *p, size_t n) {
+    return n < scan_simd_min_length ? scalar__name_end(p, n) : scanner().name_end(p, n);
+  }
+  static size_t scan__whitespace_end(const char *p, size_t n) {
+    return n < scan_simd_min_length ? scalar__whitespace_end(p, n) : scanner().whitespace_end(p, n);
+  }
+  static size_t scan__string_stop(const char *p, size_t n) {
+    return n < scan_simd_min_length ? scalar__string_stop(p, n) : scanner().string_stop(p, n);
+  }
+
+
+  // Serialize
+  // -----------------------------
+
+  static void serialize_value(Diatom &d, DiatomSink &sink) {
+    if (d.is_number()) {
+      char buf[float_format_max_length];
+      sink.write(float_format(d.number_value, buf));
+    }
+    else if (d.is_string()) {
+      sink.put('"');
+      sink.write(d.string_value);
+      sink.put('"');
+    }
+    else if (d.is_bool()) {
+      sink.write(d.bool_value ? "true" : "false");
+    }
+    else if (d.is_array()) {
+      serialize_item(d, sink, 1);
+    }
+  }
+
+  // Writes an item of an array, or a value in a table in an array. depth is
+  // the item's depth of nesting on the line, if it is an array or table.
+  // Empty items and deeper nesting than the parser reads cannot be written,
+  // and fail the sink.
+  static void serialize_item(Diatom &item, DiatomSink &sink, size_t depth) {
+    if (item.is_empty() || ((item.is_table() || item.is_array()) && depth > max_array_depth)) {
+      sink.fail();
+    }
+    else if (item.is_table()) {
+      serialize_inline_table(item, sink, depth);
+    }
+    else if (item.is_array()) {
+      serialize_array(item, sink, depth);
+    }
+    else {
+      serialize_value(item, sink);
+    }
+  }
+
+  // Empty entries are skipped, as they are on table lines
+  static void serialize_inline_table(Diatom &d, DiatomSink &sink, size_t depth) {
+    sink.put('{');
+    bool first = true;
+    if (Diatom::Table *t = d.table()) {
+      for (Diatom::TableEntry &entry : t->entries) {
+        if (entry.item.is_empty()) {
+          continue;
+        }
+        sink.write(first ? "" : ", ");
+        sink.write(entry.name.str());
+        sink.write(": ");
+        serialize_item(entry.item, sink, depth + 1);
+        first = false;
+      }
+    }
+    sink.put('}');
+  }
 
-  template <class Vec, class F>
-  static Vec filter(const Vec &v, F f) {
-    Vec out;
-    for (auto &i : v) {
-      if (f(i)) {
-        out.push_back(i);
+  static void serialize_array(Diatom &d, DiatomSink &sink, size_t depth) {
+    sink.put('[');
+    if (Diatom::Array *a = d.array()) {
+      if (a->packed) {
+        char buf[float_format_max_length];
+        for (size_t i = 0; i < a->numbers.size(); ++i) {
+          if (i > 0) {
+            sink.write(", ");
+          }
+          sink.write(float_format(a->numbers[i], buf));
+        }
+      }
+      else {
+        for (size_t i = 0; i < a->items.size(); ++i) {
+          if (i > 0) {
+            sink.write(", ");
+          }
+          serialize_item(a->items[i], sink, depth + 1);
+        }
       }
     }
-    return out;
+    sink.put(']');
   }
 
-  template <class VectorItem, class ReturnItem, class F>
-  static std::vector<ReturnItem> map(const std::vector<VectorItem> &v, F f) {
-    std::vector<ReturnItem> out;
-    for (auto &i : v) {
-      out.push_back(f(i));
+  static void serialize_entry(std::string_view key, Diatom &item, DiatomSink &sink, size_t indentation) {
+    if (item.is_empty()) {
+      return;
+    }
+    sink.put(' ', indentation * 2);
+    sink.write(key);
+    sink.put(':');
+    if (item.is_table()) {
+      sink.put('\n');
+      serialize_table(item, sink, indentation + 1);
+    }
+    else {
+      sink.put(' ');
+      serialize_value(item, sink);
+      sink.put('\n');
     }
-    return out;
   }
 
-  template <class Vec, class Item>
-  static bool contains(const Vec &v, Item x) {
-    for (auto &i : v) {
-      if (i == x) {
-        return true;
+  static void serialize_table(Diatom &d, DiatomSink &sink, size_t indentation) {
+    if (Diatom::Table *t = d.table()) {
+      for (Diatom::TableEntry &entry : t->entries) {
+        serialize_entry(entry.name.str(), entry.item, sink, indentation);
       }
     }
-    return false;
   }
 
-  static std::vector<std::string> split(std::string s, char c) {
-    if (s.length() == 0) {
-      return { };
+  static bool serialize(Diatom &d, DiatomSink &sink) {
+    if (d.is_table()) {
+      serialize_table(d, sink, 0);
+    }
+    else {
+      serialize_value(d, sink);
+      sink.put('\n');
+    }
+    return sink.flush();
+  }
+
+  static std::string serialize(Diatom &d) {
+    std::string s;
+    DiatomStringSink sink(s);
+    if (!serialize(d, sink)) {
+      s.clear();
+    }
+    return s;
+  }
+
+  // Cached serialization
+  //  - each table keeps the text of its own lines in its TextCache, and
+  //    rebuilds it only when the table is dirty, or its fingerprint has
+  //    changed. Its table entries' text is written from their own caches,
+  //    in between. So the work of writing a table that has not changed is
+  //    hashing its values and copying its text.
+  //  - the fingerprint is a 64-bit hash of a table's entries' names, types
+  //    and values, not including the contents of its table entries, which
+  //    have their own. It catches values changed through held references,
+  //    e.g. `Diatom &hp = d["hp"]`, a held array, or a kept
+  //    table_entries() vector, which the table is not told about. Only a
+  //    hash collision would leave a change unwritten.
+  // -----------------------------
+
+  static uint64_t fingerprint_mix(uint64_t h, uint64_t x) {
+    h = (h ^ x) * 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 32);
+  }
+
+  static uint64_t fingerprint_item(uint64_t h, Diatom &d) {
+    h = fingerprint_mix(h, d.type);
+    if (d.is_number()) {
+      uint64_t bits;
+      memcpy(&bits, &d.number_value, sizeof(bits));
+      h = fingerprint_mix(h, bits);
+    }
+    else if (d.is_bool()) {
+      h = fingerprint_mix(h, d.bool_value);
+    }
+    else if (d.is_string()) {
+      h = fingerprint_mix(h, d.string_value.size());
+      h = fingerprint_mix(h, DiatomKey::hash(d.string_value.view()));
+    }
+    else if (Diatom::Array *a = d.array()) {
+      h = fingerprint_mix(h, a->packed ? a->numbers.size() : a->items.size());
+      if (a->packed) {
+        for (double n : a->numbers) {
+          uint64_t bits;
+          memcpy(&bits, &n, sizeof(bits));
+          h = fingerprint_mix(h, bits);
+        }
+      }
+      else {
+        for (Diatom &item : a->items) {
+          h = fingerprint_item(h, item);
+        }
+      }
+    }
+    else if (Diatom::Table *t = d.table()) {
+      // A table in an array, written inline
+      h = fingerprint_entries(h, t, true);
     }
+    return h;
+  }
 
-    std::vector<std::string::iterator> i_splits;
-    for (auto i = s.begin(); i < s.end(); ++i) {
-      if (*i == c) {
-        i_splits.push_back(i);
+  static uint64_t fingerprint_entries(uint64_t h, Diatom::Table *t, bool with_tables) {
+    h = fingerprint_mix(h, t->entries.size());
+    for (Diatom::TableEntry &entry : t->entries) {
+      h = fingerprint_mix(h, uint64_t(uintptr_t(entry.name.k)));
+      if (entry.item.is_table() && !with_tables) {
+        h = fingerprint_mix(h, entry.item.type);
+      }
+      else {
+        h = fingerprint_item(h, entry.item);
       }
     }
+    return h;
+  }
+
+  struct TextCacheSink : DiatomBufferedSink<1024> {
+    std::pmr::string &s;
+    TextCacheSink(std::pmr::string &_s) : s(_s) { }
+    bool flush_bytes(const char *p, size_t n) {
+      s.append(p, n);
+      return true;
+    }
+    size_t size() {
+      return s.size() + used;
+    }
+  };
 
-    if (i_splits.size() == 0) {
-      return { s };
+  static void serialize_table_cached(Diatom &d, DiatomSink &sink, size_t indentation) {
+    Diatom::Table *t = d.table();
+    if (!t || t->entries.empty()) {
+      return;
+    }
+    Diatom::TextCache *c = d.text_cache();
+    uint64_t fingerprint = fingerprint_entries(0, t, false);
+    if (c->dirty || c->indentation != indentation || c->fingerprint != fingerprint) {
+      c->text.clear();
+      c->splits.clear();
+      TextCacheSink cache_sink(c->text);
+      for (size_t i = 0; i < t->entries.size(); ++i) {
+        Diatom::TableEntry &entry = t->entries[i];
+        if (entry.item.is_table()) {
+          cache_sink.put(' ', indentation * 2);
+          cache_sink.write(entry.name.str());
+          cache_sink.write(":\n");
+          c->splits.push_back({ cache_sink.size(), i });
+        }
+        else {
+          serialize_entry(entry.name.str(), entry.item, cache_sink, indentation);
+        }
+      }
+      if (!cache_sink.flush()) {
+        c->text.clear();
+        c->splits.clear();
+        sink.fail();
+        return;
+      }
+      c->indentation = indentation;
+      c->fingerprint = fingerprint;
+      c->dirty = false;
     }
 
-    std::vector<std::string> out;
-    for (size_t i=0; i < i_splits.size(); ++i) {
-      auto terminal_newline = i_splits[i];
-      auto prev_newline = i == 0 ? s.begin() : i_splits[i - 1];
-      out.push_back(std::string{ prev_newline + (i == 0 ? 0 : 1), terminal_newline });
+    std::string_view text = c->text;
+    size_t written = 0;
+    for (const Diatom::TextCache::Split &split : c->splits) {
+      sink.write(text.substr(written, split.offset - written));
+      written = split.offset;
+      if (split.pos < t->entries.size()) {
+        serialize_table_cached(t->entries[split.pos].item, sink, indentation + 1);
+      }
     }
-    if (i_splits.back() != s.end() - 1) {
-      out.push_back(std::string{ i_splits.back() + 1, s.end() });
+    sink.write(text.substr(written));
+  }
+
+  static bool serialize_cached(Diatom &d, DiatomSink &sink) {
+    if (!d.is_table()) {
+      return serialize(d, sink);
     }
-    return out;
+    serialize_table_cached(d, sink, 0);
+    return sink.flush();
   }
 
-  static bool is_whitespace(char c) { return c == ' ' || c == '\t'; }
-  static bool is_numeric(char c) { return c >= '0' && c <= '9'; }
-  static bool is_az(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
-  static bool is_alphanumeric(char c) { return is_az(c) || is_numeric(c); }
-  static bool is_alphanumeric_or_underscore(char c) { return is_alphanumeric(c) || c == '_'; }
+  static std::string serialize_cached(Diatom &d) {
+    std::string s;
+    DiatomStringSink sink(s);
+    if (!serialize_cached(d, sink)) {
+      s.clear();
+    }
+    return s;
+  }
 
 
-  // Serialize
+  // Parallel serialization
+  //  - a table's entries are divided into runs, each serialized into its
+  //    own buffer on a worker thread. The buffers are written out in order,
+  //    so the output is the same as serialize's.
+  //  - each run has at least parallel_min_run_values values, some hundreds
+  //    of KB of text, as parallel parsing's chunks have a minimum size.
+  //    Smaller tables are serialized on the calling thread, as starting
+  //    threads would cost more than it saves. Values are counted only up
+  //    to the number that would give every thread its runs.
   // -----------------------------
 
-  static std::string serialize(Diatom &d, size_t indentation = 0, bool prefix_space = false) {
-    std::string s;
-    std::string key_value_space = std::string(prefix_space ? " " : "");
+  static const size_t parallel_min_run_values = 16384;
 
-    if (d.is_table()) {
-      if (indentation > 0) {
-        s += "\n";
+  // The number of values in d, including d, counted up to at least limit
+  static size_t count_values(const Diatom &d, size_t limit) {
+    size_t n = 1;
+    if (const Diatom::Table *t = d.table()) {
+      for (size_t i = 0; i < t->entries.size() && n < limit; ++i) {
+        n += count_values(t->entries[i].item, limit - n);
+      }
+    }
+    else if (const Diatom::Array *a = d.array()) {
+      if (a->packed) {
+        n += a->numbers.size();
+      }
+      for (size_t i = 0; i < a->items.size() && n < limit; ++i) {
+        n += count_values(a->items[i], limit - n);
       }
-      d.each([&s, indentation](std::string &key, Diatom &d) -> void {
-        if (d.is_empty()) {
-          return;
+    }
+    return n;
+  }
+
+  // The number of runs serialize_parallel divides d's entries into, or 1 if
+  // it serializes d on the calling thread
+  static size_t parallel_runs(Diatom &d, size_t n_threads) {
+    if (n_threads == 0) {
+      n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    Diatom::Table *t = d.table();
+    size_t n_entries = t ? t->entries.size() : 0;
+    size_t max_runs = std::min(n_threads * 4, n_entries);
+    if (n_threads == 1 || max_runs < 2) {
+      return 1;
+    }
+    size_t n_values = count_values(d, max_runs * parallel_min_run_values);
+    return std::max(size_t(1), std::min(max_runs, n_values / parallel_min_run_values));
+  }
+
+  static bool serialize_parallel(Diatom &d, DiatomSink &sink, size_t n_threads) {
+    if (n_threads == 0) {
+      n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t n_runs = parallel_runs(d, n_threads);
+    if (n_runs < 2) {
+      return serialize(d, sink);
+    }
+    Diatom::Table *t = d.table();
+    size_t n_entries = t->entries.size();
+
+    std::vector<std::string> buffers(n_runs);
+    std::atomic<size_t> i_next_run(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+      for (size_t k; (k = i_next_run++) < n_runs; ) {
+        DiatomStringSink run_sink(buffers[k]);
+        for (size_t i = n_entries * k / n_runs; i < n_entries * (k + 1) / n_runs; ++i) {
+          Diatom::TableEntry &entry = t->entries[i];
+          serialize_entry(entry.name.str(), entry.item, run_sink, 0);
+        }
+        if (!run_sink.flush()) {
+          failed = true;
         }
-        s += indent(indentation);
-        s += key + std::string(":");
-        s += serialize(d, indentation + 1, true);
-      });
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(n_threads, n_runs); ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+      thread.join();
     }
-    else if (d.is_number()) { s += key_value_space + float_format(d.number_value); }
-    else if (d.is_string()) { s += key_value_space + std::string("\"") + d.string_value + "\""; }
-    else if (d.is_bool())   { s += key_value_space + (d.bool_value ? "true" : "false"); }
-    else if (d.is_empty())  { };
 
-    if (!d.is_table()) {
-      s += "\n";
+    if (failed) {
+      sink.fail();
+    }
+    for (auto &buffer : buffers) {
+      sink.write(buffer);
+    }
+    return sink.flush();
+  }
+
+  static std::string serialize_parallel(Diatom &d, size_t n_threads) {
+    std::string s;
+    DiatomStringSink sink(s);
+    if (!serialize_parallel(d, sink, n_threads)) {
+      s.clear();
     }
     return s;
   }
@@ -196,6 +891,8 @@ struct _DiatomSerialization {
       Property__String,
       Property__Number,
       Property__Bool,
+      Property__Array,
+      Property__Table,   // Only in arrays
       Whitespace,
       Colon,
       Comma,
@@ -203,17 +900,15 @@ struct _DiatomSerialization {
       Error
     };
 
-    Type        type;
-    double      n;
-    std::string s;
-    std::string error_str;
+    Type             type = Invalid;
+    double           n = 0;   // A number's value, or an array's number of items
+    std::string_view s = {};  // Points into the input
 
     bool operator==(const Token &t) const {
       return (
         type == t.type  &&
         t.n - n < 0.001 &&
-        s == t.s        &&
-        error_str == t.error_str
+        s == t.s
       );
     }
 
@@ -228,6 +923,8 @@ struct _DiatomSerialization {
         type == Property__String ? "Property__String" :
         type == Property__Number ? "Property__Number" :
         type == Property__Bool   ? "Property__Bool"   :
+        type == Property__Array  ? "Property__Array"  :
+        type == Property__Table  ? "Property__Table"  :
         type == Whitespace       ? "Whitespace"       :
         type == Colon            ? "Colon"            :
         type == Comma            ? "Comma"            :
@@ -238,424 +935,1240 @@ struct _DiatomSerialization {
     }
   };
 
-  typedef std::vector<Token> TokenVector;
-  typedef std::vector<Token::Type> TokenTypeVector;
-
 
   // Tokenisation functions
+  //  - each takes the remainder of the current line, and returns a token
+  //    viewing its start, or Invalid if it does not begin with one
   // -----------------------------
 
-  static Token token__name(std::string::iterator it, std::string &s) {
-    if (!is_az(*it)) {
-      return Token{ Token::Invalid };
+  static size_t name_length(std::string_view s) {
+    if (s.size() == 0 || !is_az(s[0])) {
+      return 0;
+    }
+    return 1 + scan__name_end(s.data() + 1, s.size() - 1);
+  }
+
+  static size_t number_length(std::string_view s) {
+    size_t i = 0;
+    if (i < s.size() && s[i] == '-') {
+      ++i;
+    }
+    size_t n_digits = 0;
+    for (; i < s.size() && is_numeric(s[i]); ++i) { ++n_digits; }
+    if (i < s.size() && s[i] == '.') {
+      ++i;
+      for (; i < s.size() && is_numeric(s[i]); ++i) { ++n_digits; }
+    }
+    if (n_digits == 0) {
+      return 0;
+    }
+
+    // An exponent is only part of the number if it has digits
+    if (i < s.size() && (s[i] == 'e' || s[i] == 'E')) {
+      size_t j = i + 1;
+      if (j < s.size() && (s[j] == '+' || s[j] == '-')) {
+        ++j;
+      }
+      if (j < s.size() && is_numeric(s[j])) {
+        for (i = j; i < s.size() && is_numeric(s[i]); ++i);
+      }
     }
+    return i;
+  }
 
-    std::string out;
-    for (; it < s.end() && is_alphanumeric_or_underscore(*it); ++it) {
-      out += *it;
+  static Token token__name(std::string_view s) {
+    size_t n = name_length(s);
+    if (n == 0) {
+      return Token{ Token::Invalid };
     }
-    if (out == "true" || out == "false") {
+    std::string_view name = s.substr(0, n);
+    if (name == "true" || name == "false") {
       return Token{ Token::Invalid };
     }
-    return Token{ Token::Name, 0, out };
+    return Token{ Token::Name, 0, name };
   }
 
-  static Token token__str_property(std::string::iterator it, std::string &s) {
-    if (*it != '"') {
+  static Token token__str_property(std::string_view s) {
+    if (s.size() == 0 || s[0] != '"') {
       return Token{ Token::Invalid };
     }
 
-    std::string out = "\"";
-    for (it += 1; it < s.end(); ++it) {
-      char c = *it;
-      bool is_escaped = it != s.begin() && *(it-1) == '\\';
+    for (size_t i = 1; i < s.size(); ++i) {
+      i += scan__string_stop(s.data() + i, s.size() - i);
+      if (i == s.size()) {
+        break;
+      }
+      char c = s[i];
       if (c == '\n' || c == '\r') {
-        return Token{ Token::Error, 0, "", "Unexpected newline in string literal" };
+        return Token{ Token::Error };
       }
-      out += c;
-      if (c == '"' && !is_escaped) {
-        break;
+      if (c == '"' && s[i-1] != '\\') {
+        return Token{ Token::Property__String, 0, s.substr(0, i + 1) };
       }
     }
-    return Token{ Token::Property__String, 0, out };
+    return Token{ Token::Error };    // Unterminated string literal
   }
 
-  static Token token__number_property(std::string::iterator it, std::string &s) {
-    if (!(is_numeric(*it) || *it == '.' || *it == '-')) {
+  static Token token__number_property(std::string_view s) {
+    size_t n = number_length(s);
+    if (n == 0) {
       return Token{ Token::Invalid };
     }
-    try {
-      size_t i_after;
-      float n = std::stof(std::string(it, s.end()), &i_after);
-      return Token{ Token::Property__Number, n, std::string(it, it + i_after) };
-    }
-    catch(...) {
+    // from_chars reads the exact nearest double, without allocating or
+    // throwing, so values written by float_format read back bit-for-bit
+    double x;
+    auto result = std::from_chars(s.data(), s.data() + n, x);
+    if (result.ec != std::errc()) {
       return Token{ Token::Invalid };
     }
+    return Token{ Token::Property__Number, x, s.substr(0, n) };
   }
 
-  static Token token__bool_property(std::string::iterator it, std::string &s) {
-    auto substr__true = s.substr(it - s.begin(), 4);
-    auto substr__false = s.substr(it - s.begin(), 5);
-
-    if (substr__true == "true") {
-      return Token{ Token::Property__Bool, 0, "true" };
+  static Token token__bool_property(std::string_view s) {
+    if (s.substr(0, 4) == "true") {
+      return Token{ Token::Property__Bool, 0, s.substr(0, 4) };
     }
-    else if (substr__false == "false") {
-      return Token{ Token::Property__Bool, 0, "false" };
+    else if (s.substr(0, 5) == "false") {
+      return Token{ Token::Property__Bool, 0, s.substr(0, 5) };
     }
     return Token{ Token::Invalid };
   }
 
-  static Token token__whitespace(std::string::iterator it, std::string &s) {
-    std::string whitespace;
-    for (; it < s.end() && is_whitespace(*it); ++it) {
-      whitespace += *it;
+  // Arrays, and the tables in them, may nest up to max_array_depth deep
+  static const size_t max_array_depth = 64;
+
+  static size_t array_whitespace_end(std::string_view s, size_t i) {
+    while (i < s.size() && is_whitespace(s[i])) {
+      ++i;
+    }
+    return i;
+  }
+
+  static Token token__array_property(std::string_view s, size_t depth = 1) {
+    if (s.size() == 0 || s[0] != '[') {
+      return Token{ Token::Invalid };
+    }
+    if (depth > max_array_depth) {
+      return Token{ Token::Error };
+    }
+
+    // Items are values, separated by commas, with optional whitespace
+    size_t i = array_whitespace_end(s, 1);
+    size_t n_items = 0;
+    if (i < s.size() && s[i] == ']') {
+      return Token{ Token::Property__Array, 0, s.substr(0, i + 1) };
+    }
+    while (i < s.size()) {
+      Token item = token__item(s.substr(i), depth + 1);
+      if (item.type == Token::Error) {
+        return item;
+      }
+      n_items += 1;
+      i = array_whitespace_end(s, i + item.s.length());
+      if (i < s.size() && s[i] == ']') {
+        return Token{ Token::Property__Array, double(n_items), s.substr(0, i + 1) };
+      }
+      if (i == s.size() || s[i] != ',') {
+        break;
+      }
+      i = array_whitespace_end(s, i + 1);
+    }
+    return Token{ Token::Error };    // Unterminated or malformed array
+  }
+
+  // A table in an array: {name: value, ...}, where values are array items
+  static Token token__inline_table(std::string_view s, size_t depth) {
+    if (depth > max_array_depth) {
+      return Token{ Token::Error };
+    }
+    size_t i = array_whitespace_end(s, 1);
+    size_t n_entries = 0;
+    if (i < s.size() && s[i] == '}') {
+      return Token{ Token::Property__Table, 0, s.substr(0, i + 1) };
+    }
+    while (i < s.size()) {
+      Token name = token__name(s.substr(i));
+      if (name.type != Token::Name) {
+        break;
+      }
+      i = array_whitespace_end(s, i + name.s.length());
+      if (i == s.size() || s[i] != ':') {
+        break;
+      }
+      i = array_whitespace_end(s, i + 1);
+      Token item = token__item(s.substr(i), depth + 1);
+      if (item.type == Token::Error) {
+        return item;
+      }
+      n_entries += 1;
+      i = array_whitespace_end(s, i + item.s.length());
+      if (i < s.size() && s[i] == '}') {
+        return Token{ Token::Property__Table, double(n_entries), s.substr(0, i + 1) };
+      }
+      if (i == s.size() || s[i] != ',') {
+        break;
+      }
+      i = array_whitespace_end(s, i + 1);
+    }
+    return Token{ Token::Error };    // Unterminated or malformed table
+  }
+
+  // An array item, at the given depth of nesting, or Error
+  static Token token__item(std::string_view s, size_t depth) {
+    if (s.size() > 0 && s[0] == '[') {
+      return token__array_property(s, depth);
+    }
+    if (s.size() > 0 && s[0] == '{') {
+      return token__inline_table(s, depth);
     }
+    Token t = next_token(s);
+    if (
+      t.type != Token::Property__String &&
+      t.type != Token::Property__Number &&
+      t.type != Token::Property__Bool
+    ) {
+      return Token{ Token::Error };
+    }
+    return t;
+  }
+
+  static Token token__whitespace(std::string_view s) {
+    size_t i = scan__whitespace_end(s.data(), s.size());
 
-    if (whitespace.length() == 0) {
+    if (i == 0) {
       return Token{ Token::Invalid };
     }
+    std::string_view whitespace = s.substr(0, i);
     if (has_both_tabs_and_spaces(whitespace)) {
-      return Token{ Token::Error, 0, "", "Input contains both tabs and spaces" };
+      return Token{ Token::Error };
     }
     return Token{ Token::Whitespace, 0, whitespace };
   }
 
-  static Token token__colon(std::string::iterator it) {
-    return *it == ':' ?
-      Token{ Token::Colon, 0, ":" } :
+  static Token token__colon(std::string_view s) {
+    return s.size() > 0 && s[0] == ':' ?
+      Token{ Token::Colon, 0, s.substr(0, 1) } :
       Token{ Token::Invalid };
   }
 
+  static Token next_token(std::string_view s) {
+    // The first character determines which token can match. A word is a bool
+    // only if it is exactly true or false - otherwise the longer name wins.
+    if (s.size() == 0) {
+      return Token{ Token::EndOfString };
+    }
+    char c = s[0];
+    Token t{ Token::Invalid };
+    if (is_az(c)) {
+      t = token__name(s);
+      if (t.type == Token::Invalid) {
+        t = token__bool_property(s);
+      }
+    }
+    else if (c == '"')                          { t = token__str_property(s); }
+    else if (is_numeric(c) || c == '.' || c == '-') { t = token__number_property(s); }
+    else if (is_whitespace(c))                  { t = token__whitespace(s); }
+    else if (c == ':')                          { t = token__colon(s); }
+    else if (c == '[')                          { t = token__array_property(s); }
+
+    return t.type == Token::Invalid ? Token{ Token::Error } : t;
+  }
+
 
   // Parsing
   // -----------------------------
 
   struct Line {
     size_t indent;
+    Token  whitespace;   // Leading whitespace, or Invalid
+    Token  name;
+    Token  prop;         // Invalid for table lines
+
+    bool is_table() {
+      return prop.type == Token::Invalid;
+    }
+  };
 
-    Token name;
-    Token prop_str;
-    Token prop_num;
-    Token prop_bool;
+  enum class LineStatus {
+    Valid,
+    UnexpectedInput,
+    InvalidStructure,
+  };
 
-    Diatom d;
+  static size_t calculate_indent(const Token &whitespace) {
+    if (whitespace.type != Token::Whitespace) {
+      return 0;
+    }
+    if (whitespace.s[0] == ' ') {
+      return whitespace.s.length() / 2;   // 2 spaces per indent
+    }
+    return whitespace.s.length();         // 1 tab per indent
+  }
 
-    bool operator==(const Line &l) {
-      return (
-        indent == l.indent &&
-        name == l.name &&
-        prop_str  == l.prop_str &&
-        prop_num  == l.prop_num &&
-        prop_bool == l.prop_bool
-      );
+  static LineStatus parse_line(std::string_view l, Line &line) {
+    // Valid lines are: [Whitespace] Name Colon [Property]
+    // where a property may be an array
+    // with optional whitespace between tokens. The whole line is always
+    // lexed, as unexpected input takes precedence over structure errors.
+    line.whitespace = Token{ Token::Invalid };
+    line.name       = Token{ Token::Invalid };
+    line.prop       = Token{ Token::Invalid };
+
+    enum { ExpectName, ExpectColon, ExpectProperty, ExpectEnd, Malformed } state = ExpectName;
+
+    for (size_t i = 0; i < l.size(); ) {
+      Token t = next_token(l.substr(i));
+      if (t.type == Token::Error) {
+        return LineStatus::UnexpectedInput;
+      }
+
+      if (t.type == Token::Whitespace) {
+        if (i == 0) {
+          line.whitespace = t;
+        }
+      }
+      else if (state == ExpectName && t.type == Token::Name) {
+        line.name = t;
+        state = ExpectColon;
+      }
+      else if (state == ExpectColon && t.type == Token::Colon) {
+        state = ExpectProperty;
+      }
+      else if (state == ExpectProperty && (
+        t.type == Token::Property__String ||
+        t.type == Token::Property__Number ||
+        t.type == Token::Property__Bool ||
+        t.type == Token::Property__Array
+      )) {
+        line.prop = t;
+        state = ExpectEnd;
+      }
+      else {
+        state = Malformed;
+      }
+
+      i += t.s.length();
     }
 
-    bool is_table() {
-      return (
-        prop_str.type  == Token::Invalid &&
-        prop_num.type  == Token::Invalid &&
-        prop_bool.type == Token::Invalid
-      );
+    if (state != ExpectProperty && state != ExpectEnd) {
+      return LineStatus::InvalidStructure;
     }
+    line.indent = calculate_indent(line.whitespace);
+    return LineStatus::Valid;
+  }
+
+  struct WhitespaceState {
+    char   ws_char = 0;   // Established by the first indented line
+    size_t prev_indent = 0;
+    bool   prev_was_property_line = false;
   };
 
-  static bool line_is_valid(TokenVector tokens) {
-    // NB: non-leading optional whitespace items and empty lines must have been stripped
-    if (tokens.size() == 0) {
-      return false;
+  static bool whitespace_is_consistent(Line &line, bool is_first_line, WhitespaceState &ws) {
+    bool consistent = true;
+
+    if (line.whitespace.type == Token::Whitespace) {
+      std::string_view s = line.whitespace.s;
+
+      // The first line cannot start with whitespace
+      if (is_first_line) {
+        consistent = false;
+      }
+
+      // Whitespace type must be consistent
+      if (ws.ws_char == 0) {
+        ws.ws_char = s[0];
+      }
+      else if (s[0] != ws.ws_char) {
+        consistent = false;
+      }
+
+      // Must not be odd numbers of spaces
+      if (ws.ws_char == ' ' && s.length()%2 != 0) {
+        consistent = false;
+      }
+
+      // Indent must not increase following a property line, or by more than 1 level
+      int indent_change = int(line.indent) - int(ws.prev_indent);
+      if (!is_first_line && ws.prev_was_property_line && indent_change > 0) {
+        consistent = false;
+      }
+      if (!is_first_line && indent_change > 1) {
+        consistent = false;
+      }
     }
-    auto types = map<Token, Token::Type>(tokens, [](Token t)  {
-      return t.type;
-    });
-    if (types[0] == Token::Whitespace) {
-      types = std::vector<Token::Type> (types.begin() + 1, types.end());
+
+    ws.prev_indent = line.indent;
+    ws.prev_was_property_line = !line.is_table();
+    return consistent;
+  }
+
+
+  // Unserialization
+  // -----------------------------
+
+  static DiatomParseStatus error_status(const char *error, size_t i_line) {
+    return { false, std::string(error) + std::to_string(i_line + 1) };
+  }
+
+  // Sends an array item, or a value in a table in an array, from the start
+  // of s. The array token it is in has already been checked. Returns the
+  // item's length.
+  template <class Handler>
+  static size_t send_item(std::string_view key, std::string_view s, Handler &h) {
+    if (s[0] != '[' && s[0] != '{') {
+      Token t = next_token(s);
+      if (t.type == Token::Property__String)      { h.on_string(key, t.s.substr(1, t.s.length() - 2)); }
+      else if (t.type == Token::Property__Number) { h.on_number(key, t.n); }
+      else                                        { h.on_bool(key, t.s == "true"); }
+      return t.s.length();
     }
 
-    // Lines without properties (ie tables): Name, Colon
-    if (types == std::vector<Token::Type>{
-      Token::Name,
-      Token::Colon,
-    }) {
-      return true;
+    bool is_array = s[0] == '[';
+    if (is_array) { h.on_array_begin(key); }
+    else          { h.on_table_begin(key); }
+    size_t i = array_whitespace_end(s, 1);
+    while (s[i] != ']' && s[i] != '}') {
+      std::string_view item_key;
+      if (!is_array) {
+        item_key = s.substr(i, name_length(s.substr(i)));
+        i = array_whitespace_end(s, array_whitespace_end(s, i + item_key.length()) + 1);
+      }
+      i = array_whitespace_end(s, i + send_item(item_key, s.substr(i), h));
+      if (s[i] == ',') {
+        i = array_whitespace_end(s, i + 1);
+      }
     }
+    if (is_array) { h.on_array_end(); }
+    else          { h.on_table_end(); }
+    return i + 1;
+  }
 
-    // Lines with properties: Name, Colon, Prop
-    return (
-      types.size() == 3 &&
-      TokenTypeVector(types.begin(), types.begin() + 2) == TokenTypeVector{
-        Token::Name,
-        Token::Colon,
-      } &&
-      contains(TokenTypeVector{
-        Token::Property__Number,
-        Token::Property__String,
-        Token::Property__Bool,
-      }, types[2])
-    );
+  template <class Handler>
+  static void send_value(const Line &line, Handler &h) {
+    const Token &prop = line.prop;
+    if (prop.type == Token::Property__String)      { h.on_string(line.name.s, prop.s.substr(1, prop.s.length() - 2)); }
+    else if (prop.type == Token::Property__Number) { h.on_number(line.name.s, prop.n); }
+    else if (prop.type == Token::Property__Bool)   { h.on_bool(line.name.s, prop.s == "true"); }
+    else if (prop.type == Token::Property__Array)  { send_item(line.name.s, prop.s, h); }
+    else                                           { h.on_table_begin(line.name.s); }
   }
 
-  static TokenVector matching_tokens(std::string::iterator it, std::string &s) {
-    TokenVector tokens = {
-      token__name(it, s),
-      token__str_property(it, s),
-      token__number_property(it, s),
-      token__bool_property(it, s),
-      token__whitespace(it, s),
-      token__colon(it),
-    };
-    TokenVector valid_tokens = filter(tokens, [](Token t) {
-      return t.type != Token::Invalid;
-    });
-    return valid_tokens;
+  // The state of a parse, which may cover the whole text or a part of it
+  // beginning at a line with no indent.
+  //
+  // Unexpected input is reported first, then invalid line structure, then
+  // inconsistent whitespace, each at the first line where it occurs. So
+  // after a structure or whitespace error the remaining lines are still
+  // lexed, to find any higher precedence error.
+  struct LineScan {
+    static const size_t none = -1;
+
+    bool   starts_document = true;
+    size_t i_line = 0;
+    size_t i_unexpected_input = none;
+    size_t i_invalid_structure = none;
+    size_t i_inconsistent_whitespace = none;
+    size_t i_whitespace_established = none;   // Where ws.ws_char was set
+    WhitespaceState ws;
+
+    // Whitespace checking guarantees a line is indented by at most one
+    // level more than the table line above it, so a line with indent n ends
+    // any tables open deeper than n.
+    size_t n_open_tables = 0;
+
+    DiatomParseStatus status() {
+      if (i_unexpected_input != none) {
+        return error_status("Unexpected input at line ", i_unexpected_input);
+      }
+      if (i_invalid_structure != none) {
+        return error_status("Invalid line structure at line ", i_invalid_structure);
+      }
+      if (i_inconsistent_whitespace != none) {
+        return error_status("Inconsistent whitespace found at line ", i_inconsistent_whitespace);
+      }
+      return { true, "" };
+    }
+  };
+
+  // Parses lines until the end of s, unexpected input, or the handler is
+  // done. Returns false if the handler is done.
+  template <class Handler>
+  static bool parse_lines(std::string_view s, Handler &h, LineScan &scan) {
+    for (size_t i = 0; i < s.size(); ++scan.i_line) {
+      size_t i_end = s.find('\n', i);
+      if (i_end == std::string_view::npos) {
+        i_end = s.size();
+      }
+      std::string_view l = s.substr(i, i_end - i);
+      i = i_end + 1;
+
+      Line line;
+      LineStatus status = parse_line(l, line);
+
+      if (status == LineStatus::UnexpectedInput) {
+        scan.i_unexpected_input = scan.i_line;
+        return true;
+      }
+      if (status == LineStatus::InvalidStructure && scan.i_invalid_structure == LineScan::none) {
+        scan.i_invalid_structure = scan.i_line;
+      }
+      if (scan.i_invalid_structure != LineScan::none || scan.i_inconsistent_whitespace != LineScan::none) {
+        continue;
+      }
+      bool had_ws_char = scan.ws.ws_char != 0;
+      bool consistent = whitespace_is_consistent(line, scan.starts_document && scan.i_line == 0, scan.ws);
+      if (!had_ws_char && scan.ws.ws_char != 0) {
+        scan.i_whitespace_established = scan.i_line;
+      }
+      if (!consistent) {
+        scan.i_inconsistent_whitespace = scan.i_line;
+        continue;
+      }
+
+      for (; scan.n_open_tables > line.indent; --scan.n_open_tables) {
+        h.on_table_end();
+      }
+      send_value(line, h);
+      if (line.is_table()) {
+        scan.n_open_tables += 1;
+      }
+      if (h.done()) {
+        ++scan.i_line;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static std::string_view trim_newlines(std::string_view s) {
+    while (s.size() > 0 && s.back() == '\n') {
+      s.remove_suffix(1);
+    }
+    while (s.size() > 0 && s.front() == '\n') {
+      s.remove_prefix(1);
+    }
+    return s;
   }
 
-  static TokenVector strip_nonleading_whitespace(const TokenVector &ts) {
-    if (ts.size() == 0) {
-      return ts;
+  template <class Handler>
+  static DiatomParseStatus parse(std::string_view s, Handler &h) {
+    LineScan scan;
+    if (!parse_lines(trim_newlines(s), h, scan)) {
+      return { true, "" };
+    }
+
+    DiatomParseStatus status = scan.status();
+    if (status.success) {
+      for (; scan.n_open_tables > 0; --scan.n_open_tables) {
+        h.on_table_end();
+      }
+    }
+    return status;
+  }
+
+
+  // Building diatoms from events
+  //  - tables[n] is the table or array that values at depth n are added to.
+  //    Values are created in place in their parent, and pointers in the
+  //    stack are never to items of a table or array that is still being
+  //    added to. Everything is allocated from the given resource.
+  // -----------------------------
+
+  // Adds d to parent, a table or an array
+  static void add_value(Diatom &parent, std::string_view key, Diatom &&d) {
+    if (parent.is_array()) {
+      parent.push_back(std::move(d));
+    }
+    else {
+      parent.set(DiatomKey(key), std::move(d));
+    }
+  }
+
+  // Adds a table or array to parent, returning it
+  static Diatom& add_child(Diatom &parent, std::string_view key, Diatom &&d) {
+    if (parent.is_array()) {
+      parent.push_back(std::move(d));
+      return parent.array_items().back();
+    }
+    return parent.set(DiatomKey(key), std::move(d));
+  }
+
+  struct TreeBuilder : DiatomHandler {
+    Diatom::allocator_type alloc;
+    Diatom top;
+    std::vector<Diatom*> tables;
+
+    TreeBuilder(std::pmr::memory_resource *resource) : alloc(resource), top(alloc), tables{ &top } { }
+
+    void on_table_begin(std::string_view key) {
+      tables.push_back(&add_child(*tables.back(), key, Diatom(alloc)));
+    }
+    void on_table_end() {
+      tables.back()->forget_references();
+      tables.pop_back();
+    }
+    void on_array_begin(std::string_view key) {
+      tables.push_back(&add_child(*tables.back(), key, Diatom(Diatom::Type::Array, alloc)));
+    }
+    void on_array_end() {
+      tables.back()->forget_references();
+      tables.pop_back();
+    }
+    void on_number(std::string_view key, double x) {
+      add_value(*tables.back(), key, Diatom(x, alloc));
+    }
+    void on_string(std::string_view key, std::string_view s) {
+      add_value(*tables.back(), key, Diatom(s, alloc));
+    }
+    void on_bool(std::string_view key, bool b) {
+      add_value(*tables.back(), key, Diatom(b, alloc));
+    }
+  };
+
+  static DiatomParseResult unserialize(std::string_view s, std::pmr::memory_resource *resource) {
+    TreeBuilder builder(resource);
+    DiatomParseStatus status = parse(s, builder);
+    if (!status.success) {
+      return { false, status.error_string };
+    }
+    builder.top.forget_references();
+    return { true, "", std::move(builder.top) };
+  }
+
+
+  // Lazy unserialization
+  //  - a lazy table's text is its entries' lines, and the lines of their
+  //    subtrees. Its entries are the lines with the least indentation, and
+  //    each table entry's subtree is the more indented lines below it,
+  //    which become that entry's lazy text. So building a table reads only
+  //    the first characters of its subtrees' lines.
+  //  - validation checks only each line's indentation, and that none is
+  //    empty, which is what building tables relies on. A line is taken to
+  //    be a table line if it ends in a colon. Other errors are found when
+  //    their line's table is built, and recorded in the DiatomLazyDocument
+  //    its tables share.
+  // -----------------------------
+
+  struct LazyTableBuilder : DiatomHandler {
+    Diatom &d;
+    const std::shared_ptr<DiatomLazyDocument> &document;
+    Diatom::allocator_type alloc;
+    std::string_view subtree;     // The lines below a table entry
+    std::vector<Diatom*> open;    // Arrays and tables in them, on the current line
+
+    LazyTableBuilder(Diatom &_d, const std::shared_ptr<DiatomLazyDocument> &_document) :
+      d(_d), document(_document), alloc(_d.get_allocator()) { }
+
+    Diatom& parent() {
+      return open.empty() ? d : *open.back();
+    }
+
+    // Only tables in arrays end: a table line's entries are its lazy text
+    void on_table_begin(std::string_view key) {
+      if (!open.empty()) {
+        open.push_back(&add_child(parent(), key, Diatom(alloc)));
+        return;
+      }
+      Diatom &t = d.set(DiatomKey(key), Diatom(alloc));
+      if (!subtree.empty()) {
+        t.make_lazy_table(subtree, lazy__build_table, document);
+      }
+    }
+    void on_table_end() {
+      open.pop_back();
+    }
+    void on_array_begin(std::string_view key) {
+      open.push_back(&add_child(parent(), key, Diatom(Diatom::Type::Array, alloc)));
+    }
+    void on_array_end() {
+      open.pop_back();
+    }
+    void on_number(std::string_view key, double x) {
+      add_value(parent(), key, Diatom(x, alloc));
+    }
+    void on_string(std::string_view key, std::string_view s) {
+      add_value(parent(), key, Diatom(s, alloc));
+    }
+    void on_bool(std::string_view key, bool b) {
+      add_value(parent(), key, Diatom(b, alloc));
+    }
+  };
+
+  static size_t leading_whitespace(std::string_view s, size_t i) {
+    size_t n = 0;
+    while (i + n < s.size() && is_whitespace(s[i + n])) {
+      ++n;
     }
-    TokenVector out{ ts[0] };
-    TokenVector allbutfirst{ts.begin() + 1, ts.end()};
-    allbutfirst = filter(allbutfirst, [](Token t) {
-      return t.type != Token::Whitespace;
-    });
-    out.insert(out.end(), allbutfirst.begin(), allbutfirst.end());
-    return out;
+    return n;
   }
 
-  static size_t calculate_indent(TokenVector line) {
-    size_t indent = 0;
-    if (line[0].type == Token::Whitespace) {
-      if (line[0].s[0] == ' ') {
-        indent = line[0].s.length() / 2;   // 2 spaces per indent
+  static void lazy__build_table(Diatom &d, std::string_view s, const std::shared_ptr<DiatomLazyDocument> &document) {
+    LazyTableBuilder builder(d, document);
+    size_t entry_indent = leading_whitespace(s, 0);
+
+    for (size_t i = 0; i < s.size(); ) {
+      size_t i_end = s.find('\n', i);
+      if (i_end == std::string_view::npos) {
+        i_end = s.size();
+      }
+      std::string_view l = s.substr(i, i_end - i);
+
+      // Skip the entry's subtree
+      size_t i_subtree = i = std::min(i_end + 1, s.size());
+      while (i < s.size() && leading_whitespace(s, i) > entry_indent) {
+        i_end = s.find('\n', i);
+        i = i_end == std::string_view::npos ? s.size() : i_end + 1;
+      }
+      builder.subtree = trim_newlines(s.substr(i_subtree, i - i_subtree));
+
+      Line line;
+      LineStatus status = parse_line(l, line);
+      if (status == LineStatus::Valid) {
+        send_value(line, builder);
+      }
+      else if (status == LineStatus::UnexpectedInput) {
+        document->found(document->i_unexpected_input, l.data());
       }
       else {
-        indent = line[0].s.length();       // 1 tab per indent
+        document->found(document->i_invalid_structure, l.data());
       }
     }
-    return indent;
   }
 
-  static size_t find_inconsistent_whitespace(const std::vector<TokenVector> lines) {
-    int ws_type = 0;  // 0 for not yet discovered, 1 for tabs, 2 for spaces
-    if (lines.size() == 0) {
-      return -1;
+  // If the structure is invalid, the text is parsed in full, to report the
+  // error diatom__unserialize would
+  static DiatomParseStatus lazy__check_structure(std::string_view s) {
+    WhitespaceState ws;
+    bool valid = true;
+    for (size_t i = 0, i_line = 0; valid && i < s.size(); ++i_line) {
+      size_t i_end = s.find('\n', i);
+      if (i_end == std::string_view::npos) {
+        i_end = s.size();
+      }
+      std::string_view l = s.substr(i, i_end - i);
+      i = i_end + 1;
+
+      size_t n_whitespace = scan__whitespace_end(l.data(), l.size());
+      size_t n = l.size();
+      while (n > n_whitespace && is_whitespace(l[n - 1])) {
+        --n;
+      }
+      if (n == n_whitespace || has_both_tabs_and_spaces(l.substr(0, n_whitespace))) {
+        valid = false;
+        break;
+      }
+
+      // Only the whitespace, and whether the line is a table line, are read
+      Line line;
+      line.whitespace = n_whitespace > 0 ? Token{ Token::Whitespace, 0, l.substr(0, n_whitespace) } : Token{ Token::Invalid };
+      line.prop = l[n - 1] == ':' ? Token{ Token::Invalid } : Token{ Token::Colon };
+      line.indent = calculate_indent(line.whitespace);
+      valid = whitespace_is_consistent(line, i_line == 0, ws);
+    }
+    if (valid) {
+      return { true, "" };
     }
+    DiatomHandler none;
+    return parse(s, none);
+  }
 
-    // The first line cannot start with whitespace
-    if (lines[0][0].type == Token::Whitespace) {
-      return 0;
+  static DiatomParseResult unserialize_lazy(std::string_view s, bool validate, std::pmr::memory_resource *resource) {
+    s = trim_newlines(s);
+    if (validate) {
+      DiatomParseStatus status = lazy__check_structure(s);
+      if (!status.success) {
+        return { false, status.error_string };
+      }
     }
+    Diatom top{ Diatom::allocator_type(resource) };
+    if (!s.empty()) {
+      top.make_lazy_table(s, lazy__build_table, std::make_shared<DiatomLazyDocument>(s.data()));
+    }
+    return { true, "", std::move(top) };
+  }
 
-    for (auto i = lines.begin(); i < lines.end(); ++i) {
-      Token t = (*i)[0];
-      if (t.type == Token::Whitespace) {
-        std::string s = t.s;
-        if (has_both_tabs_and_spaces(s)) {
-          return i - lines.begin();
-        }
+  static DiatomParseStatus lazy_status(Diatom &d) {
+    DiatomLazyDocument *document = d.is_table() && d.table_data ? d.table_data->lazy_document.get() : NULL;
+    if (!document) {
+      return { true, "" };
+    }
+    std::lock_guard<std::mutex> lock(document->mutex);
+    LineScan scan;
+    scan.i_unexpected_input = document->i_unexpected_input;
+    scan.i_invalid_structure = document->i_invalid_structure;
+    return scan.status();
+  }
 
-        // Establish whitespace type
-        if (ws_type == 0) {
-          ws_type = s[0] == '\t' ? 1 : 2;
-        }
-        // Check uses a consistent whitespace type
-        else {
-          if ((s[0] == '\t' && ws_type == 2) || (s[0] == ' ' && ws_type == 1)) {
-            return i - lines.begin();
-          }
-        }
 
-        // Must not be odd numbers of spaces
-        if (ws_type == 2 && s.length()%2 != 0) {
-          return i - lines.begin();
-        }
+  // Parallel unserialization
+  //  - the text is split into chunks at lines with no indent, which start
+  //    independent top-level subtrees. Each chunk is parsed on its own
+  //    thread with its own LineScan, and the results are merged in order.
+  //
+  //    The whitespace type is established by the first indented line of the
+  //    whole document, so a chunk whose first indented line uses a different
+  //    type is inconsistent at that line. Everything else a line's checks
+  //    depend on is reset at a line with no indent.
+  // -----------------------------
 
-        if (i != lines.begin()) {
-          TokenVector lprev = *(i - 1);
-          bool prev_was_property_line = filter(lprev, [](Token t) {
-            return (
-              t.type == Token::Property__String ||
-              t.type == Token::Property__Number ||
-              t.type == Token::Property__Bool
-            );
-          }).size() > 0;
-          int indent_change = int(calculate_indent(*i)) - int(calculate_indent(lprev));
-
-          // Indent must not increase following a property line
-          if (prev_was_property_line && indent_change > 0) {
-            return i - lines.begin();
-          }
+  static const size_t parallel_min_chunk_size = 256 * 1024;
 
-          // Indent must not increase by more than 1 level
-          if (indent_change > 1) {
-            return i - lines.begin();
-          }
-        }
+  struct Chunk {
+    std::string_view s;
+    LineScan scan;
+    size_t n_lines = 0;
+    TreeBuilder builder;
+
+    Chunk(std::string_view _s, std::pmr::memory_resource *resource) : s(_s), builder(resource) { }
+  };
+
+  // Returns the start of the first line with no indent at or after i
+  static size_t next_top_level_line(std::string_view s, size_t i) {
+    if (i == 0) {
+      return 0;
+    }
+    for (i = s.find('\n', i - 1); i != std::string_view::npos; i = s.find('\n', i + 1)) {
+      if (i + 1 < s.size() && !is_whitespace(s[i + 1])) {
+        return i + 1;
       }
     }
-    return -1;
+    return s.size();
   }
 
-  static TokenVector tokenize(std::string &s) {
-    auto it = s.begin();
-    TokenVector out;
+  static DiatomParseResult unserialize_parallel(std::string_view s, size_t n_threads, std::pmr::memory_resource *resource) {
+    s = trim_newlines(s);
+    if (n_threads == 0) {
+      n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t n_chunks = std::min(n_threads * 4, s.size() / parallel_min_chunk_size);
+    if (n_threads == 1 || n_chunks < 2) {
+      return unserialize(s, resource);
+    }
 
-    while (it < s.end()) {
-      auto ts = matching_tokens(it, s);
-      if (ts.size() == 0 || (ts.size() == 1 && ts[0].type == Token::Error)) {
-        return { { Token::Error, 0, "", "Invalid input" } };
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    for (size_t k = 0, i = 0; i < s.size(); ++k) {
+      size_t i_end = next_top_level_line(s, std::max(i + 1, s.size() / n_chunks * (k + 1)));
+      chunks.push_back(std::make_unique<Chunk>(s.substr(i, i_end - i), resource));
+      chunks.back()->scan.starts_document = (i == 0);
+      i = i_end;
+    }
+
+    std::atomic<size_t> i_next_chunk(0);
+    auto worker = [&]() {
+      for (size_t k; (k = i_next_chunk++) < chunks.size(); ) {
+        Chunk &c = *chunks[k];
+        parse_lines(c.s, c.builder, c.scan);
+        c.n_lines = c.scan.i_unexpected_input == LineScan::none ?
+          c.scan.i_line :
+          std::count(c.s.begin(), c.s.end(), '\n') + (c.s.back() != '\n');
       }
-      // As per Modern Compiler Implementation, the chosen token is the longest
-      // matching one
-      size_t longest_token_i = 0;
-      size_t longest_token_length = 0;
-      for (size_t i=0; i < ts.size(); ++i) {
-        auto t = ts[i];
-        if (t.s.length() > longest_token_length) {
-          longest_token_i = i;
-          longest_token_length = t.s.length();
-        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(n_threads, chunks.size()); ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+      t.join();
+    }
+
+    // Merge each chunk's first error of each kind, using line numbers
+    // from the start of the document
+    LineScan merged;
+    size_t i_first_line = 0;
+    for (auto &c : chunks) {
+      LineScan &scan = c->scan;
+      if (merged.ws.ws_char == 0) {
+        merged.ws.ws_char = scan.ws.ws_char;
+      }
+      else if (scan.ws.ws_char != 0 && scan.ws.ws_char != merged.ws.ws_char) {
+        scan.i_inconsistent_whitespace = std::min(scan.i_inconsistent_whitespace, scan.i_whitespace_established);
       }
-      Token longest = ts[longest_token_i];
-      out.push_back(longest);
-      it += longest.s.length();
+      auto merge = [i_first_line](size_t &merged_i, size_t i) {
+        if (merged_i == LineScan::none && i != LineScan::none) {
+          merged_i = i_first_line + i;
+        }
+      };
+      merge(merged.i_unexpected_input, scan.i_unexpected_input);
+      merge(merged.i_invalid_structure, scan.i_invalid_structure);
+      merge(merged.i_inconsistent_whitespace, scan.i_inconsistent_whitespace);
+      i_first_line += c->n_lines;
+    }
+    DiatomParseStatus status = merged.status();
+    if (!status.success) {
+      return { false, status.error_string };
     }
 
-    return out;
+    Diatom top{Diatom::allocator_type(resource)};
+    size_t n_entries = 0;
+    for (auto &c : chunks) {
+      n_entries += c->builder.top.table_entries().size();
+    }
+    top.table_entries().reserve(n_entries);
+    for (auto &c : chunks) {
+      for (auto &entry : c->builder.top.table_entries()) {
+        top.set(entry.name, std::move(entry.item));
+      }
+    }
+    top.forget_references();
+    return { true, "", std::move(top) };
   }
 
-  static Line tokens_to_line(TokenVector ts) {
-    Line line{
-      0,
-      Token{Token::Invalid},
-      Token{Token::Invalid},
-      Token{Token::Invalid},
-      Token{Token::Invalid},
+  // Binary serialization
+  //
+  //   header:  "DTMB", version byte
+  //   keys:    varint n_keys, then n_keys * (varint length, bytes)
+  //   value:   the top diatom
+  //
+  // Each value is a tag byte followed by:
+  //   Empty, False, True:  nothing
+  //   Number:  8 byte IEEE 754 double, little-endian
+  //   String:  varint length, bytes
+  //   Table:   varint n_entries, 4 byte little-endian body length,
+  //            then n_entries * (varint key index, value)
+  //   Array:   varint n_items, 4 byte little-endian body length,
+  //            then n_items * value
+  //   NumberArray:  varint n_items, then n_items * 8 byte doubles
+  //
+  // The body length lets a reader skip a table or array without decoding
+  // it. Packed arrays are written as NumberArrays, so item i of one can be
+  // read directly. Tables and arrays nested more than max_depth deep are
+  // rejected when read, so that reading cannot overflow the stack.
+  // -----------------------------
+
+  struct Binary {
+    enum Tag : unsigned char {
+      Empty  = 0,
+      Number = 1,
+      False  = 2,
+      True   = 3,
+      String = 4,
+      Table  = 5,
+      Array  = 6,
+      NumberArray = 7,
     };
+    static constexpr const char *magic = "DTMB";
+    static const size_t magic_length = 4;
+    static const unsigned char version = 1;
+    static const size_t max_depth = 1024;
+  };
 
-    line.indent = calculate_indent(ts);
-    if (ts[0].type == Token::Whitespace) {
-      ts = TokenVector{ ts.begin() + 1, ts.end() };
+  static void binary__write_varint(std::string &s, uint64_t x) {
+    while (x >= 0x80) {
+      s += char((x & 0x7f) | 0x80);
+      x >>= 7;
     }
+    s += char(x);
+  }
 
-    line.name = ts[0];
+  static void binary__write_u32(std::string &s, size_t i, uint32_t x) {
+    for (int b = 0; b < 4; ++b) {
+      s[i + b] = char((x >> (8*b)) & 0xff);
+    }
+  }
 
-    if (ts.size() == 2) {
-      line.d = Diatom();
+  static void binary__write_double(std::string &s, double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    for (int b = 0; b < 8; ++b) {
+      s += char((bits >> (8*b)) & 0xff);
     }
-    else {
-      Token prop = ts[2];
-      if (prop.type == Token::Property__String)      { line.prop_str = prop; }
-      else if (prop.type == Token::Property__Number) { line.prop_num = prop; }
-      else if (prop.type == Token::Property__Bool)   { line.prop_bool = prop; }
+  }
+
+  static void binary__write_doubles(std::string &s, const double *x, size_t n) {
+  #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    s.append((const char*) x, n * sizeof(double));
+  #else
+    for (size_t i = 0; i < n; ++i) {
+      binary__write_double(s, x[i]);
     }
+  #endif
+  }
+
+  // Key indices are assigned in order of first use, and recorded for every
+  // table entry in the order binary__write_value visits them.
+  struct BinaryKeys {
+    std::unordered_map<DiatomKey, uint32_t, DiatomKey::Hash> index;
+    std::vector<std::string_view> keys;
+    std::vector<uint32_t> entry_keys;
+  };
 
-    return line;
+  static void binary__collect_keys(Diatom &d, BinaryKeys &k) {
+    if (Diatom::Array *a = d.array()) {
+      for (auto &item : a->items) {
+        binary__collect_keys(item, k);
+      }
+      return;
+    }
+    Diatom::Table *t = d.table();
+    if (!t) {
+      return;
+    }
+    for (auto &entry : t->entries) {
+      auto inserted = k.index.emplace(entry.name, uint32_t(k.keys.size()));
+      if (inserted.second) {
+        k.keys.push_back(entry.name.str());
+      }
+      k.entry_keys.push_back(inserted.first->second);
+      binary__collect_keys(entry.item, k);
+    }
   }
 
-  static Diatom line_to_single_diatom(Line l) {
-    if (l.prop_str.type != Token::Invalid) {
-      const std::string &s = l.prop_str.s;
-      return s.length() > 0 ? std::string(s.begin() + 1, s.end() - 1) : s;
+  static void binary__write_value(std::string &s, Diatom &d, const BinaryKeys &k, size_t &i_entry) {
+    if (d.is_number()) {
+      s += char(Binary::Number);
+      binary__write_double(s, d.number_value);
     }
-    else if (l.prop_num.type != Token::Invalid) { return l.prop_num.n; }
-    else if (l.prop_bool.type != Token::Invalid) {
-      return l.prop_bool.s == "true" ? true : false;
+    else if (d.is_bool()) {
+      s += char(d.bool_value ? Binary::True : Binary::False);
+    }
+    else if (d.is_string()) {
+      s += char(Binary::String);
+      binary__write_varint(s, d.string_value.size());
+      s += d.string_value;
+    }
+    else if (d.is_table()) {
+      Diatom::Table *t = d.table();
+      s += char(Binary::Table);
+      binary__write_varint(s, t ? t->entries.size() : 0);
+      size_t i_length = s.size();
+      s.append(4, '\0');
+      for (size_t i = 0; t && i < t->entries.size(); ++i) {
+        binary__write_varint(s, k.entry_keys[i_entry++]);
+        binary__write_value(s, t->entries[i].item, k, i_entry);
+      }
+      binary__write_u32(s, i_length, uint32_t(s.size() - i_length - 4));
+    }
+    else if (d.is_packed()) {
+      Diatom::Array *a = d.array();
+      s += char(Binary::NumberArray);
+      binary__write_varint(s, a ? a->numbers.size() : 0);
+      if (a) {
+        binary__write_doubles(s, a->numbers.data(), a->numbers.size());
+      }
+    }
+    else if (d.is_array()) {
+      Diatom::Array *a = d.array();
+      s += char(Binary::Array);
+      binary__write_varint(s, a->items.size());
+      size_t i_length = s.size();
+      s.append(4, '\0');
+      for (auto &item : a->items) {
+        binary__write_value(s, item, k, i_entry);
+      }
+      binary__write_u32(s, i_length, uint32_t(s.size() - i_length - 4));
+    }
+    else {
+      s += char(Binary::Empty);
     }
-    return Diatom();
   }
 
+  static std::string serialize_binary(Diatom &d) {
+    BinaryKeys k;
+    binary__collect_keys(d, k);
 
-  // Unserialization
-  // -----------------------------
+    std::string s(Binary::magic, Binary::magic_length);
+    s += char(Binary::version);
+    binary__write_varint(s, k.keys.size());
+    for (auto key : k.keys) {
+      binary__write_varint(s, key.size());
+      s.append(key.data(), key.size());
+    }
 
-  static DiatomParseResult unserialize(std::string s) {
-    while (s.back() == '\n') {
-      s.pop_back();
+    size_t i_entry = 0;
+    binary__write_value(s, d, k, i_entry);
+    return s;
+  }
+
+  // Reads from a byte range, failing without reading past its end
+  struct BinaryReader {
+    const unsigned char *p;
+    const unsigned char *end;
+    const char *error = NULL;
+
+    bool fail(const char *e) {
+      if (!error) {
+        error = e;
+      }
+      p = end;
+      return false;
     }
-    size_t i_last_leading_newline = -1;
-    for (auto i = s.begin(); *i == '\n' && i < s.end(); ++i) {
-      ++i_last_leading_newline;
+
+    bool has(size_t n) {
+      return size_t(end - p) >= n || fail("Unexpected end of binary input");
     }
-    if (i_last_leading_newline != -1) {
-      s = std::string(s.begin() + i_last_leading_newline + 1, s.end());
+
+    unsigned char byte() {
+      return has(1) ? *p++ : 0;
     }
 
-    auto lines_str = split(s, '\n');
-    auto lines_tok = map<std::string, TokenVector>(lines_str, [](std::string l) {
-      return tokenize(l);
-    });
+    uint64_t varint() {
+      uint64_t x = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+        if (!has(1)) {
+          return 0;
+        }
+        unsigned char b = *p++;
+        x |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+          return x;
+        }
+      }
+      fail("Invalid binary varint");
+      return 0;
+    }
 
+    uint32_t u32() {
+      if (!has(4)) {
+        return 0;
+      }
+      uint32_t x = 0;
+      for (int b = 0; b < 4; ++b) {
+        x |= uint32_t(*p++) << (8*b);
+      }
+      return x;
+    }
 
-    // Look for input errors
-    for (auto i = lines_tok.begin(); i < lines_tok.end(); ++i) {
-      auto v = *i;
-      if (v.size() == 1 && v[0].type == Token::Error) {
-        return {
-          false,
-          std::string("Unexpected input at line ") + std::to_string(i - lines_tok.begin() + 1),
-        };
+    double f64() {
+      if (!has(8)) {
+        return 0;
+      }
+      uint64_t bits = 0;
+      for (int b = 0; b < 8; ++b) {
+        bits |= uint64_t(*p++) << (8*b);
       }
+      double x;
+      memcpy(&x, &bits, sizeof(x));
+      return x;
     }
 
-    // Strip non-leading whitespace
-    lines_tok = map<TokenVector, TokenVector>(lines_tok, [](TokenVector ts) {
-      return strip_nonleading_whitespace(ts);
-    });
+    void doubles(double *x, uint64_t n) {
+      if (n > uint64_t(end - p) / 8) {
+        fail("Unexpected end of binary input");
+        return;
+      }
+      if (n == 0) {
+        return;
+      }
+    #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      memcpy(x, p, n * 8);
+      p += n * 8;
+    #else
+      for (uint64_t i = 0; i < n; ++i) {
+        x[i] = f64();
+      }
+    #endif
+    }
 
-    // Check lines are valid
-    for (auto i = lines_tok.begin(); i < lines_tok.end(); ++i) {
-      if (!line_is_valid(*i)) {
-        return {
-          false,
-          std::string("Invalid line structure at line ") + std::to_string(i - lines_tok.begin() + 1),
-        };
+    std::string_view bytes(uint64_t n) {
+      if (!has(n)) {
+        return std::string_view();
       }
+      std::string_view s((const char*) p, n);
+      p += n;
+      return s;
     }
+  };
 
-    // Check whitespace is consistent
-    size_t i_inconsistent_whitespace = find_inconsistent_whitespace(lines_tok);
-    if (i_inconsistent_whitespace != -1) {
-      return {
-        false,
-        std::string("Inconsistent whitespace found at line ") + std::to_string(i_inconsistent_whitespace + 1),
-      };
+  static Diatom binary__read_value(BinaryReader &r, const std::vector<DiatomKey> &keys, const Diatom::allocator_type &a, size_t depth) {
+    unsigned char tag = r.byte();
+    if ((tag == Binary::Table || tag == Binary::Array) && depth >= Binary::max_depth) {
+      r.fail("Binary data nested too deeply");
+      return Diatom(Diatom::Type::Empty, a);
     }
+    switch (tag) {
+      case Binary::Empty:  return Diatom(Diatom::Type::Empty, a);
+      case Binary::Number: return Diatom(r.f64(), a);
+      case Binary::False:  return Diatom(false, a);
+      case Binary::True:   return Diatom(true, a);
+      case Binary::String: return Diatom(r.bytes(r.varint()), a);
+      case Binary::Table: {
+        uint64_t n = r.varint();
+        uint32_t length = r.u32();
+        const unsigned char *body = r.p;
+        if (size_t(r.end - r.p) < length || n > length) {
+          r.fail("Invalid binary table length");
+          return Diatom(a);
+        }
 
-    // Convert to lines
-    auto lines = map<TokenVector, Line>(lines_tok, [](TokenVector ts) {
-      return tokens_to_line(ts);
-    });
+        Diatom d(a);
+        d.table_entries().reserve(n);
+        for (uint64_t i = 0; i < n && !r.error; ++i) {
+          uint64_t k = r.varint();
+          if (k >= keys.size()) {
+            r.fail("Invalid binary key index");
+            break;
+          }
+          d.set(keys[k], binary__read_value(r, keys, a, depth + 1));
+        }
+        if (r.p != body + length) {
+          r.fail("Invalid binary table length");
+        }
+        d.forget_references();
+        return d;
+      }
+      case Binary::Array: {
+        uint64_t n = r.varint();
+        uint32_t length = r.u32();
+        const unsigned char *body = r.p;
+        if (size_t(r.end - r.p) < length || n > length) {
+          r.fail("Invalid binary array length");
+          return Diatom(Diatom::Type::Array, a);
+        }
 
-    // Compose diatoms
-    Diatom top;
-    for (size_t i = lines.size() - 1; i != -1; --i) {
-      Line &l = lines[i];
-      if (l.d.table_entries.size() == 0) {
-        l.d = line_to_single_diatom(l);
-      }
-
-      Diatom *parent = NULL;
-      size_t j;
-      for (j = i - 1; j != -1; --j) {
-        Line &ancestor_line = lines[j];
-        if (l.indent > 0 && l.indent - ancestor_line.indent == 1) {
-          parent = &ancestor_line.d;
-          break;
+        Diatom d(Diatom::Type::Array, a);
+        std::pmr::vector<Diatom> &items = d.array_items();
+        items.reserve(n);
+        for (uint64_t i = 0; i < n && !r.error; ++i) {
+          items.push_back(binary__read_value(r, keys, a, depth + 1));
         }
+        if (r.p != body + length) {
+          r.fail("Invalid binary array length");
+        }
+        d.forget_references();
+        return d;
+      }
+      case Binary::NumberArray: {
+        uint64_t n = r.varint();
+        Diatom d(Diatom::Type::Array, a);
+        if (n > size_t(r.end - r.p) / 8) {
+          r.fail("Invalid binary array length");
+          return d;
+        }
+        std::pmr::vector<double> &numbers = d.array_numbers();
+        numbers.resize(n);
+        r.doubles(numbers.data(), n);
+        d.forget_references();
+        return d;
       }
+    }
+    r.fail("Invalid binary type tag");
+    return Diatom(Diatom::Type::Empty, a);
+  }
 
-      (*(parent ? parent : &top))[l.name.s] = l.d;
+  static DiatomParseResult unserialize_binary(std::string_view s, std::pmr::memory_resource *resource) {
+    BinaryReader r{ (const unsigned char*) s.data(), (const unsigned char*) s.data() + s.size() };
+
+    std::string_view magic = r.bytes(Binary::magic_length);
+    if (magic != std::string_view(Binary::magic, Binary::magic_length) || r.byte() != Binary::version) {
+      return { false, "Invalid binary header" };
     }
-    top.recurse([](std::string key, Diatom &d) {
-      if (d.is_table()) {
-        std::reverse(d.table_entries.begin(), d.table_entries.end());
-      }
-    });
 
-    return { true, "", top };
+    // Keys are interned once, when the dictionary is read
+    std::vector<DiatomKey> keys;
+    uint64_t n_keys = r.varint();
+    for (uint64_t i = 0; i < n_keys && !r.error; ++i) {
+      keys.push_back(DiatomKey(r.bytes(r.varint())));
+    }
+
+    Diatom d = binary__read_value(r, keys, Diatom::allocator_type(resource), 0);
+    if (!r.error && r.p != r.end) {
+      r.fail("Unexpected data after binary value");
+    }
+    if (r.error) {
+      return { false, r.error };
+    }
+    return { true, "", std::move(d) };
   }
 };
 
@@ -667,8 +2180,68 @@ std::string diatom__serialize(Diatom &d) {
   return _DiatomSerialization::serialize(d);
 }
 
-DiatomParseResult diatom__unserialize(const std::string &s) {
-  return _DiatomSerialization::unserialize(s);
+std::string diatom__serialize_parallel(Diatom &d, size_t n_threads) {
+  return _DiatomSerialization::serialize_parallel(d, n_threads);
+}
+
+bool diatom__serialize_parallel_to(Diatom &d, DiatomSink &sink, size_t n_threads) {
+  return _DiatomSerialization::serialize_parallel(d, sink, n_threads);
+}
+
+std::string diatom__serialize_cached(Diatom &d) {
+  return _DiatomSerialization::serialize_cached(d);
+}
+
+bool diatom__serialize_cached_to(Diatom &d, DiatomSink &sink) {
+  return _DiatomSerialization::serialize_cached(d, sink);
+}
+
+bool diatom__serialize_to(Diatom &d, DiatomSink &sink) {
+  return _DiatomSerialization::serialize(d, sink);
+}
+
+bool diatom__serialize_to(Diatom &d, FILE *f) {
+  DiatomFileSink sink(f);
+  return _DiatomSerialization::serialize(d, sink);
+}
+
+bool diatom__serialize_to(Diatom &d, std::ostream &os) {
+  DiatomStreamSink sink(os);
+  return _DiatomSerialization::serialize(d, sink);
+}
+
+bool diatom__serialize_to(Diatom &d, int fd) {
+  DiatomFdSink sink(fd);
+  return _DiatomSerialization::serialize(d, sink);
+}
+
+DiatomParseResult diatom__unserialize(std::string_view s, std::pmr::memory_resource *resource) {
+  return _DiatomSerialization::unserialize(s, resource);
+}
+
+DiatomParseResult diatom__unserialize_parallel(std::string_view s, size_t n_threads, std::pmr::memory_resource *resource) {
+  return _DiatomSerialization::unserialize_parallel(s, n_threads, resource);
+}
+
+DiatomParseResult diatom__unserialize_lazy(std::string_view s, bool validate, std::pmr::memory_resource *resource) {
+  return _DiatomSerialization::unserialize_lazy(s, validate, resource);
+}
+
+DiatomParseStatus diatom__lazy_status(Diatom &d) {
+  return _DiatomSerialization::lazy_status(d);
+}
+
+template <class Handler>
+DiatomParseStatus diatom__parse(std::string_view s, Handler &h) {
+  return _DiatomSerialization::parse(s, h);
+}
+
+std::string diatom__serialize_binary(Diatom &d) {
+  return _DiatomSerialization::serialize_binary(d);
+}
+
+DiatomParseResult diatom__unserialize_binary(std::string_view s, std::pmr::memory_resource *resource) {
+  return _DiatomSerialization::unserialize_binary(s, resource);
 }
 
 #endif
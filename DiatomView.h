@@ -0,0 +1,475 @@
+//
+// DiatomView.h
+//
+// Read-only access to a binary diatom document, without unserializing it.
+//
+//   DiatomMappedFile file("level.diatomb");
+//   DiatomView hp = file.root()["units"]["player"]["hp"];
+//   hp.number_value();
+//
+// A DiatomView points at a value inside the document's bytes, and decodes
+// it only when asked. Looking up a child finds the index of its name in the
+// document's key dictionary once, then walks the table's entries comparing
+// key indices, skipping over the bodies of its siblings, so untouched parts
+// of a document are never read. DiatomMappedFile maps a file read-only, so
+// processes reading the same file share its pages.
+//
+// Items of packed number arrays are read directly, by index. Items of other
+// arrays are found by skipping the items before them.
+//
+// The document must outlive any views onto it. Views into malformed data
+// read as Empty. recurse and to_diatom stop at Binary::max_depth, as
+// diatom__unserialize_binary does: tables and arrays below it are not
+// visited, and decode as Empty.
+//
+// MIT licensed - http://opensource.org/licenses/MIT
+//
+
+#ifndef __DiatomView_h
+#define __DiatomView_h
+
+#include "DiatomSerialization.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct DiatomBinaryDocument;
+
+
+// DiatomView
+// -----------------------------
+
+struct DiatomView {
+  typedef _DiatomSerialization::Binary Binary;
+  typedef _DiatomSerialization::BinaryReader BinaryReader;
+
+  const DiatomBinaryDocument *doc;
+  const unsigned char *p;     // The value's tag byte, or NULL for an Empty view
+  const unsigned char *end;   // End of the enclosing data
+  bool packed_number;         // p is an item of a NumberArray, with no tag
+
+  DiatomView() : doc(NULL), p(NULL), end(NULL), packed_number(false) { }
+  DiatomView(const DiatomBinaryDocument *_doc, const unsigned char *_p, const unsigned char *_end, bool _packed_number = false) :
+    doc(_doc), p(_p), end(_end), packed_number(_packed_number) { }
+
+  Diatom::Type::T type() const {
+    if (!p) {
+      return Diatom::Type::Empty;
+    }
+    if (packed_number) {
+      return Diatom::Type::Number;
+    }
+    switch (*p) {
+      case Binary::Number: return Diatom::Type::Number;
+      case Binary::False:
+      case Binary::True:   return Diatom::Type::Bool;
+      case Binary::String: return Diatom::Type::String;
+      case Binary::Table:  return Diatom::Type::Table;
+      case Binary::Array:
+      case Binary::NumberArray: return Diatom::Type::Array;
+    }
+    return Diatom::Type::Empty;
+  }
+
+  bool is_empty()  const { return type() == Diatom::Type::Empty;  }
+  bool is_number() const { return type() == Diatom::Type::Number; }
+  bool is_bool()   const { return type() == Diatom::Type::Bool;   }
+  bool is_string() const { return type() == Diatom::Type::String; }
+  bool is_table()  const { return type() == Diatom::Type::Table;  }
+  bool is_array()  const { return type() == Diatom::Type::Array;  }
+  bool is_packed() const { return p && !packed_number && *p == Binary::NumberArray; }
+
+
+  // Values
+  // -----------------------------
+
+  double number_value() const {
+    if (!is_number()) {
+      return 0;
+    }
+    BinaryReader r = reader(packed_number ? 0 : 1);
+    return r.f64();
+  }
+
+  bool bool_value() const {
+    return p && !packed_number && *p == Binary::True;
+  }
+
+  std::string_view string_value() const {
+    if (!is_string()) {
+      return std::string_view();
+    }
+    BinaryReader r = reader(1);
+    return r.bytes(r.varint());
+  }
+
+
+  // Table lookup
+  // -----------------------------
+
+  // The number of entries in a table, or items in an array
+  size_t size() const {
+    if (!is_table() && !is_array()) {
+      return 0;
+    }
+    BinaryReader r = reader(1);
+    return r.varint();
+  }
+
+  DiatomView operator[](std::string_view name) const;
+
+  bool has(std::string_view name) const {
+    return (*this)[name].p != NULL;
+  }
+
+
+  // Array items
+  // -----------------------------
+
+  // Item i of an array, or an Empty view if there is none
+  DiatomView at(size_t i) const;
+
+  // Item i's number value, or 0 if it is not a number
+  double number_at(size_t i) const {
+    return at(i).number_value();
+  }
+
+
+  // Iteration
+  // -----------------------------
+
+  // Calls f(std::string_view name, DiatomView item) for each entry
+  template <class F>
+  void each(F f) const;
+
+  template <class F>
+  void recurse(F f, bool include_top = false) const {
+    if (include_top) {
+      f(std::string_view(), *this);
+    }
+    recurse_from(f, 0);
+  }
+
+  template <class F>
+  void recurse_from(F &f, size_t depth) const {
+    if (depth >= Binary::max_depth) {
+      return;
+    }
+    each([&](std::string_view name, const DiatomView &item) {
+      f(name, item);
+      if (item.is_table() || item.is_array()) {
+        item.recurse_from(f, depth + 1);
+      }
+    });
+    visit_items([&](const DiatomView &item) {
+      f(std::string_view(), item);
+      if (item.is_table() || item.is_array()) {
+        item.recurse_from(f, depth + 1);
+      }
+      return true;
+    });
+  }
+
+
+  // Other
+  // -----------------------------
+
+  std::string type_string() const {
+    return Diatom(type()).type_string();
+  }
+
+  // Decodes this value and everything below it
+  Diatom to_diatom() const {
+    return to_diatom_from(0);
+  }
+
+  Diatom to_diatom_from(size_t depth) const {
+    if ((is_table() || is_array()) && depth >= Binary::max_depth) {
+      return Diatom(Diatom::Type::Empty);
+    }
+    switch (type()) {
+      case Diatom::Type::Number: return number_value();
+      case Diatom::Type::Bool:   return bool_value();
+      case Diatom::Type::String: return string_value();
+      case Diatom::Type::Table: {
+        Diatom d;
+        each([&](std::string_view name, const DiatomView &item) {
+          d.set(name, item.to_diatom_from(depth + 1));
+        });
+        d.forget_references();
+        return d;
+      }
+      case Diatom::Type::Array: {
+        Diatom d(Diatom::Type::Array);
+        if (is_packed()) {
+          std::pmr::vector<double> &numbers = d.array_numbers();
+          BinaryReader r = reader(1);
+          numbers.resize(r.varint());
+          r.doubles(numbers.data(), numbers.size());
+          if (r.error) {
+            numbers.clear();
+          }
+        }
+        else {
+          std::pmr::vector<Diatom> &items = d.array_items();
+          visit_items([&](const DiatomView &item) {
+            items.push_back(item.to_diatom_from(depth + 1));
+            return true;
+          });
+        }
+        d.forget_references();
+        return d;
+      }
+      default:
+        return Diatom(Diatom::Type::Empty);
+    }
+  }
+
+  BinaryReader reader(size_t offset) const {
+    BinaryReader r{ p, end };
+    r.p = size_t(end - p) >= offset ? p + offset : end;
+    return r;
+  }
+
+  // Advances r past the value at r.p, returning false if it is malformed
+  static bool skip_value(BinaryReader &r) {
+    uint64_t n = 0;
+    switch (r.byte()) {
+      case Binary::Empty:
+      case Binary::False:
+      case Binary::True:   n = 0; break;
+      case Binary::Number: n = 8; break;
+      case Binary::String: n = r.varint(); break;
+      case Binary::Table:
+      case Binary::Array:  r.varint(); n = r.u32(); break;
+      case Binary::NumberArray: {
+        n = r.varint();
+        if (n > uint64_t(r.end - r.p) / 8) {
+          return false;
+        }
+        n *= 8;
+        break;
+      }
+      default:             return false;
+    }
+    if (r.error || !r.has(n)) {
+      return false;
+    }
+    r.p += n;
+    return true;
+  }
+
+  // Calls f(key index, item) for each entry until f returns false
+  template <class F>
+  void visit_entries(F f) const;
+
+  // Calls f(item) for each item of an unpacked array until f returns false
+  template <class F>
+  void visit_items(F f) const;
+};
+
+
+// DiatomBinaryDocument
+//  - a view onto bytes produced by diatom__serialize_binary. Construction
+//    reads only the header and the key dictionary, which it indexes by
+//    name for lookups.
+// -----------------------------
+
+struct DiatomBinaryDocument {
+  bool success = false;
+  std::string error_string;
+  std::vector<std::string_view> keys;
+  std::unordered_map<std::string_view, uint64_t> key_indices;
+  DiatomView top;
+
+  DiatomBinaryDocument() { }
+  DiatomBinaryDocument(std::string_view bytes) {
+    open(bytes);
+  }
+  DiatomBinaryDocument(const DiatomBinaryDocument &) = delete;
+  DiatomBinaryDocument& operator=(const DiatomBinaryDocument &) = delete;
+
+  void open(std::string_view bytes) {
+    typedef _DiatomSerialization::Binary Binary;
+
+    auto begin = (const unsigned char*) bytes.data();
+    auto end   = begin + bytes.size();
+    _DiatomSerialization::BinaryReader r{ begin, end };
+
+    keys.clear();
+    key_indices.clear();
+    top = DiatomView();
+    std::string_view magic = r.bytes(Binary::magic_length);
+    if (magic != std::string_view(Binary::magic, Binary::magic_length) || r.byte() != Binary::version) {
+      success = false;
+      error_string = "Invalid binary header";
+      return;
+    }
+
+    uint64_t n_keys = r.varint();
+    for (uint64_t i = 0; i < n_keys && !r.error; ++i) {
+      keys.push_back(r.bytes(r.varint()));
+      key_indices.emplace(keys.back(), i);
+    }
+    if (r.error || r.p == end) {
+      success = false;
+      error_string = r.error ? r.error : "Unexpected end of binary input";
+      return;
+    }
+
+    success = true;
+    error_string = "";
+    top = DiatomView(this, r.p, end);
+  }
+
+  DiatomView root() const {
+    return top;
+  }
+};
+
+
+// DiatomMappedFile
+//  - maps a binary diatom file read-only
+// -----------------------------
+
+struct DiatomMappedFile : DiatomBinaryDocument {
+  void   *mapping = NULL;
+  size_t  mapping_size = 0;
+
+  DiatomMappedFile(const char *path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd == -1) {
+      error_string = std::string("Could not open ") + path;
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (m != MAP_FAILED) {
+        mapping = m;
+        mapping_size = st.st_size;
+      }
+    }
+    close(fd);
+
+    if (!mapping) {
+      error_string = std::string("Could not map ") + path;
+      return;
+    }
+    open(std::string_view((const char*) mapping, mapping_size));
+  }
+
+  ~DiatomMappedFile() {
+    if (mapping) {
+      munmap(mapping, mapping_size);
+    }
+  }
+};
+
+
+// DiatomView implementations
+// -----------------------------
+
+template <class F>
+void DiatomView::visit_entries(F f) const {
+  if (!is_table()) {
+    return;
+  }
+  BinaryReader r = reader(1);
+  uint64_t n = r.varint();
+  uint32_t length = r.u32();
+  if (r.error || !r.has(length)) {
+    return;
+  }
+
+  BinaryReader body{ r.p, r.p + length };
+  for (uint64_t i = 0; i < n; ++i) {
+    uint64_t k = body.varint();
+    if (body.error || k >= doc->keys.size()) {
+      return;
+    }
+    const unsigned char *item = body.p;
+    if (!skip_value(body)) {
+      return;
+    }
+    if (!f(k, DiatomView(doc, item, body.p))) {
+      return;
+    }
+  }
+}
+
+template <class F>
+void DiatomView::visit_items(F f) const {
+  if (!is_array() || is_packed()) {
+    return;
+  }
+  BinaryReader r = reader(1);
+  uint64_t n = r.varint();
+  uint32_t length = r.u32();
+  if (r.error || !r.has(length)) {
+    return;
+  }
+
+  BinaryReader body{ r.p, r.p + length };
+  for (uint64_t i = 0; i < n; ++i) {
+    const unsigned char *item = body.p;
+    if (!skip_value(body)) {
+      return;
+    }
+    if (!f(DiatomView(doc, item, body.p))) {
+      return;
+    }
+  }
+}
+
+inline DiatomView DiatomView::at(size_t i) const {
+  if (is_packed()) {
+    BinaryReader r = reader(1);
+    uint64_t n = r.varint();
+    if (r.error || i >= n || n > uint64_t(r.end - r.p) / 8) {
+      return DiatomView();
+    }
+    return DiatomView(doc, r.p + i * 8, r.p + n * 8, true);
+  }
+  DiatomView found;
+  size_t i_item = 0;
+  visit_items([&](const DiatomView &item) {
+    if (i_item++ == i) {
+      found = item;
+      return false;
+    }
+    return true;
+  });
+  return found;
+}
+
+template <class F>
+void DiatomView::each(F f) const {
+  visit_entries([&](uint64_t k, const DiatomView &item) {
+    f(doc->keys[k], item);
+    return true;
+  });
+}
+
+inline DiatomView DiatomView::operator[](std::string_view name) const {
+  DiatomView found;
+  if (!is_table()) {
+    return found;
+  }
+  auto i_key = doc->key_indices.find(name);
+  if (i_key == doc->key_indices.end()) {
+    return found;
+  }
+  uint64_t k_name = i_key->second;
+  visit_entries([&](uint64_t k, const DiatomView &item) {
+    if (k == k_name) {
+      found = item;
+      return false;
+    }
+    return true;
+  });
+  return found;
+}
+
+#endif
@@ -3,7 +3,8 @@
 Diatom diatomize(const Diatomize::Descriptor &sd) {
   Diatom d;
   for (auto s : sd.descriptor)
-    d[s->getName()] = s->convertToDiatom();
+    d.set(s->getName(), s->convertToDiatom());
+  d.forget_references();
   return d;
 }
 
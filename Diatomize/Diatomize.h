@@ -6,6 +6,10 @@
 #define __Diatomize_h
 
 #include <vector>
+#include <tuple>
+#include <array>
+#include <utility>
+#include <type_traits>
 #include "../Diatom.h"
 
 namespace Diatomize {
@@ -20,9 +24,9 @@ namespace Diatomize {
   inline Diatom _serialize(std::string *x) {  return Diatom(*x); }
   template <typename T>
   inline Diatom _serialize(std::vector<T> &vec) {
-    Diatom d;
+    Diatom d(Diatom::Type::Array);
     for (int i=0, n=vec.size(); i < n; ++i)
-      d[std::to_string(i)] = Diatom(vec[i]);
+      d.push_back(Diatom(vec[i]));
     return d;
   }
 
@@ -32,14 +36,26 @@ namespace Diatomize {
   inline void _deserialize(Diatom &d, bool &b)   {  b = d.bool_value; }
   inline void _deserialize(Diatom &d, std::string &x) {  x = d.string_value;  }
   inline void _deserialize(Diatom &d, std::string *x) {  x = new std::string(d.string_value); }
+  // Vectors are read from arrays, or from tables as written before arrays
   template <typename T>
   inline void _deserialize(Diatom &d, std::vector<T> &vec) {
     vec.clear();
-    d.each([&](std::string &s, Diatom &d) {
-      T x;
-      _deserialize(d, x);
-      vec.push_back(x);
-    });
+    if (Diatom::Array *a = d.array()) {
+      for (size_t i=0, n=d.array_size(); i < n; ++i) {
+        Diatom item = a->packed ? Diatom(a->numbers[i]) : Diatom(a->items[i]);
+        T x;
+        _deserialize(item, x);
+        vec.push_back(x);
+      }
+      return;
+    }
+    if (Diatom::Table *t = d.table()) {
+      for (Diatom::TableEntry &entry : t->entries) {
+        T x;
+        _deserialize(entry.item, x);
+        vec.push_back(x);
+      }
+    }
   }
 
 
@@ -185,5 +201,236 @@ diatomPart(const std::string &name, const Diatomize::Descriptor &sd, ptype *p) {
 }
 
 
+#pragma mark - Field lists
+
+//  A type can instead list its fields once, at compile time, in a static
+//  constexpr diatom_fields() function:
+//
+//    struct Position {
+//      float x, y;
+//      static constexpr auto diatom_fields() {
+//        return Diatomize::fields(
+//          Diatomize::field("x", &Position::x),
+//          Diatomize::field("y", &Position::y)
+//        );
+//      }
+//    };
+//
+//    Diatom d = diatomize(position);
+//    antidiatomize(position, d);
+//
+//  The list is a tuple of names and member pointers, which diatomize and
+//  antidiatomize unroll at compile time: there are no virtual calls, and
+//  nothing is allocated besides the diatoms made. Field names are interned
+//  once per type. Fields may be numbers, bools, strings, types with their
+//  own field lists, or vectors of any of these, which become arrays, packed
+//  for numbers. Other fields can give conversion functions, taking
+//  (const M&) -> Diatom and (Diatom&, M&):
+//
+//    Diatomize::field("hp", &Unit::hp, hp_to_diatom, hp_from_diatom)
+//
+//  antidiatomize leaves fields missing from the diatom unchanged. To write
+//  and read text without building a diatom, see DiatomizeText.h.
+
+namespace Diatomize {
+
+  template <class T, class M>
+  struct Field {
+    const char *name;
+    M T::*member;
+  };
+
+  template <class T, class M, class S, class D>
+  struct CustomField {
+    const char *name;
+    M T::*member;
+    S to_diatom;
+    D from_diatom;
+  };
+
+  template <class T, class M>
+  constexpr Field<T, M> field(const char *name, M T::*member) {
+    return { name, member };
+  }
+
+  template <class T, class M, class S, class D>
+  constexpr CustomField<T, M, S, D> field(const char *name, M T::*member, S s, D d) {
+    return { name, member, s, d };
+  }
+
+  template <class... Fields>
+  constexpr std::tuple<Fields...> fields(Fields... f) {
+    return std::tuple<Fields...>(f...);
+  }
+
+  template <class T, class = void>
+  struct has_fields : std::false_type { };
+
+  template <class T>
+  struct has_fields<T, std::void_t<decltype(T::diatom_fields())>> : std::true_type { };
+
+  template <class T>
+  using if_has_fields = std::enable_if_t<has_fields<T>::value, int>;
+
+  template <class T, if_has_fields<T> = 0>
+  Diatom to_diatom(const T &x, const Diatom::allocator_type &a = {});
+
+  template <class T, if_has_fields<T> = 0>
+  void from_diatom(Diatom &d, T &x);
+
+  // Each type's field names, interned on first use
+  template <class T>
+  const auto& field_keys() {
+    static const auto keys = std::apply([](auto... f) {
+      return std::array<DiatomKey, sizeof...(f)>{ DiatomKey(f.name)... };
+    }, T::diatom_fields());
+    return keys;
+  }
+
+
+  #pragma mark - Value conversions
+
+  template <class N, std::enable_if_t<std::is_arithmetic<N>::value && !std::is_same<N, bool>::value, int> = 0>
+  Diatom value_to_diatom(const N &x, const Diatom::allocator_type &a) {
+    return Diatom(double(x), a);
+  }
+  inline Diatom value_to_diatom(const bool &b, const Diatom::allocator_type &a) {
+    return Diatom(b, a);
+  }
+  inline Diatom value_to_diatom(const std::string &s, const Diatom::allocator_type &a) {
+    return Diatom(std::string_view(s), a);
+  }
+  template <class T, if_has_fields<T> = 0>
+  Diatom value_to_diatom(const T &x, const Diatom::allocator_type &a) {
+    return to_diatom(x, a);
+  }
+  template <class T>
+  Diatom value_to_diatom(const std::vector<T> &vec, const Diatom::allocator_type &a) {
+    if constexpr (std::is_arithmetic<T>::value && !std::is_same<T, bool>::value) {
+      Diatom d(Diatom::Type::Array, a);
+      d.array_numbers().assign(vec.begin(), vec.end());
+      d.forget_references();
+      return d;
+    }
+    else {
+      Diatom d(Diatom::Type::Array, a);
+      std::pmr::vector<Diatom> &items = d.array_items();
+      items.reserve(vec.size());
+      for (size_t i=0; i < vec.size(); ++i) {
+        items.push_back(value_to_diatom(vec[i], a));
+      }
+      d.forget_references();
+      return d;
+    }
+  }
+
+  template <class N, std::enable_if_t<std::is_arithmetic<N>::value && !std::is_same<N, bool>::value, int> = 0>
+  void value_from_diatom(Diatom &d, N &x) {
+    if (d.is_number()) {
+      x = N(d.number_value);
+    }
+  }
+  inline void value_from_diatom(Diatom &d, bool &b) {
+    if (d.is_bool()) {
+      b = d.bool_value;
+    }
+  }
+  inline void value_from_diatom(Diatom &d, std::string &s) {
+    if (d.is_string()) {
+      s = d.string_value.view();
+    }
+  }
+  template <class T, if_has_fields<T> = 0>
+  void value_from_diatom(Diatom &d, T &x) {
+    from_diatom(d, x);
+  }
+  // Vectors are read from arrays, or from tables, in order of their entries,
+  // as vectors of objects were written before tables could be array items
+  template <class T>
+  void value_from_diatom(Diatom &d, std::vector<T> &vec) {
+    vec.clear();
+    if (Diatom::Array *arr = d.array()) {
+      vec.resize(d.array_size());
+      for (size_t i=0; i < vec.size(); ++i) {
+        if (!arr->packed) {
+          value_from_diatom(arr->items[i], vec[i]);
+        }
+        else if constexpr (std::is_arithmetic<T>::value && !std::is_same<T, bool>::value) {
+          vec[i] = T(arr->numbers[i]);
+        }
+      }
+    }
+    else if (Diatom::Table *t = d.table()) {
+      vec.resize(t->entries.size());
+      for (size_t i=0; i < vec.size(); ++i) {
+        value_from_diatom(t->entries[i].item, vec[i]);
+      }
+    }
+  }
+
+
+  #pragma mark - Fields
+
+  template <class T, class M>
+  void field_to_diatom(const Field<T, M> &f, const DiatomKey &key, const T &x, Diatom &d) {
+    d.append_entry(key, value_to_diatom(x.*(f.member), d.get_allocator()));
+  }
+
+  template <class T, class M, class S, class D>
+  void field_to_diatom(const CustomField<T, M, S, D> &f, const DiatomKey &key, const T &x, Diatom &d) {
+    d.append_entry(key, Diatom(f.to_diatom(x.*(f.member)), d.get_allocator()));
+  }
+
+  template <class T, class M>
+  void field_from_diatom(const Field<T, M> &f, Diatom &item, T &x) {
+    value_from_diatom(item, x.*(f.member));
+  }
+
+  template <class T, class M, class S, class D>
+  void field_from_diatom(const CustomField<T, M, S, D> &f, Diatom &item, T &x) {
+    f.from_diatom(item, x.*(f.member));
+  }
+
+  template <class T, class Fields, class Keys, size_t... I>
+  void fields_to_diatom(const T &x, Diatom &d, const Fields &fields, const Keys &keys, std::index_sequence<I...>) {
+    (field_to_diatom(std::get<I>(fields), keys[I], x, d), ...);
+  }
+
+  template <class T, class Fields, class Keys, size_t... I>
+  void fields_from_diatom(Diatom &d, T &x, const Fields &fields, const Keys &keys, std::index_sequence<I...>) {
+    Diatom::TableEntry *entry;
+    ((entry = d.lookup(keys[I]), entry ? field_from_diatom(std::get<I>(fields), entry->item, x) : void()), ...);
+  }
+
+  template <class T, if_has_fields<T>>
+  Diatom to_diatom(const T &x, const Diatom::allocator_type &a) {
+    constexpr auto fields = T::diatom_fields();
+    constexpr size_t n = std::tuple_size<decltype(fields)>::value;
+    Diatom d(a);
+    d.table_entries().reserve(n);
+    fields_to_diatom(x, d, fields, field_keys<T>(), std::make_index_sequence<n>());
+    d.forget_references();
+    return d;
+  }
+
+  template <class T, if_has_fields<T>>
+  void from_diatom(Diatom &d, T &x) {
+    constexpr auto fields = T::diatom_fields();
+    constexpr size_t n = std::tuple_size<decltype(fields)>::value;
+    fields_from_diatom(d, x, fields, field_keys<T>(), std::make_index_sequence<n>());
+  }
+}
+
+template <class T, Diatomize::if_has_fields<T> = 0>
+Diatom diatomize(const T &x, const Diatom::allocator_type &a = {}) {
+  return Diatomize::to_diatom(x, a);
+}
+
+template <class T, Diatomize::if_has_fields<T> = 0>
+void antidiatomize(T &x, Diatom &d) {
+  Diatomize::from_diatom(d, x);
+}
+
+
 #endif
 
@@ -0,0 +1,466 @@
+//
+// DiatomizeText.h
+//
+// Writes objects with field lists (see Diatomize.h) straight to text, and
+// reads them straight from it, without building a Diatom:
+//
+//    diatomize_to(position, sink);               // any DiatomSink
+//    antidiatomize_from(position, text);         // -> DiatomParseStatus
+//
+// The text is the same as diatom__serialize(diatomize(x)) writes, and
+// antidiatomize_from sets fields as antidiatomize would. Fields with
+// conversion functions still go through a Diatom, holding just that field.
+//
+// MIT licensed - http://opensource.org/licenses/MIT
+//
+
+#ifndef __DiatomizeText_h
+#define __DiatomizeText_h
+
+#include "Diatomize.h"
+#include "../DiatomSerialization.h"
+
+namespace Diatomize {
+
+  template <class T>
+  struct is_vector : std::false_type { };
+
+  template <class E, class A>
+  struct is_vector<std::vector<E, A>> : std::true_type { };
+
+  template <class T>
+  inline constexpr auto fields_of = T::diatom_fields();
+
+  template <class T>
+  constexpr size_t n_fields = std::tuple_size<decltype(fields_of<T>)>::value;
+
+  // Calls f(field) for the field of T named key, if there is one
+  template <class T, class F, size_t... I>
+  void visit_field(std::string_view key, F f, std::index_sequence<I...>) {
+    (void) ((key == std::get<I>(fields_of<T>).name ? (f(std::get<I>(fields_of<T>)), true) : false) || ...);
+  }
+
+  template <class T, class F>
+  void visit_field(std::string_view key, F f) {
+    visit_field<T>(key, f, std::make_index_sequence<n_fields<T>>());
+  }
+
+
+  #pragma mark - Writing text
+
+  template <class T, if_has_fields<T> = 0>
+  void fields_to_text(const T &x, DiatomSink &sink, size_t indentation);
+
+  inline void key_to_text(std::string_view key, DiatomSink &sink, size_t indentation) {
+    sink.put(' ', indentation * 2);
+    sink.write(key);
+    sink.put(':');
+  }
+
+  template <class T, size_t... I>
+  void fields_to_inline_text(const T &x, DiatomSink &sink, size_t depth, std::index_sequence<I...>);
+
+  // Writes a value after its key, or as an array item. Objects are written
+  // as tables in arrays, {name: value, ...}. depth is the value's depth of
+  // nesting on the line, if it is an object or vector, as for
+  // _DiatomSerialization::serialize_item.
+  template <class M>
+  void item_to_text(const M &m, DiatomSink &sink, size_t depth) {
+    if constexpr (std::is_same<M, bool>::value) {
+      sink.write(m ? "true" : "false");
+    }
+    else if constexpr (std::is_arithmetic<M>::value) {
+      char buf[_DiatomSerialization::float_format_max_length];
+      sink.write(_DiatomSerialization::float_format(double(m), buf));
+    }
+    else if constexpr (std::is_same<M, std::string>::value) {
+      sink.put('"');
+      sink.write(m);
+      sink.put('"');
+    }
+    else if constexpr (has_fields<M>::value) {
+      if (depth > _DiatomSerialization::max_array_depth) {
+        sink.fail();
+        return;
+      }
+      sink.put('{');
+      fields_to_inline_text(m, sink, depth, std::make_index_sequence<n_fields<M>>());
+      sink.put('}');
+    }
+    else {
+      static_assert(is_vector<M>::value, "Field type cannot be written as text");
+      if (depth > _DiatomSerialization::max_array_depth) {
+        sink.fail();
+        return;
+      }
+      sink.put('[');
+      for (size_t i=0; i < m.size(); ++i) {
+        if (i > 0) {
+          sink.write(", ");
+        }
+        item_to_text<typename M::value_type>(m[i], sink, depth + 1);
+      }
+      sink.put(']');
+    }
+  }
+
+  // A field of an object in an array. Custom fields that convert to Empty
+  // are skipped, as they are on table lines.
+  template <class T, class M>
+  void inline_field_to_text(const Field<T, M> &f, const T &x, DiatomSink &sink, size_t depth, bool &first) {
+    sink.write(first ? "" : ", ");
+    sink.write(f.name);
+    sink.write(": ");
+    item_to_text(x.*(f.member), sink, depth + 1);
+    first = false;
+  }
+
+  template <class T, class M, class S, class D>
+  void inline_field_to_text(const CustomField<T, M, S, D> &f, const T &x, DiatomSink &sink, size_t depth, bool &first) {
+    Diatom d = f.to_diatom(x.*(f.member));
+    if (d.is_empty()) {
+      return;
+    }
+    sink.write(first ? "" : ", ");
+    sink.write(f.name);
+    sink.write(": ");
+    _DiatomSerialization::serialize_item(d, sink, depth + 1);
+    first = false;
+  }
+
+  template <class T, size_t... I>
+  void fields_to_inline_text(const T &x, DiatomSink &sink, size_t depth, std::index_sequence<I...>) {
+    bool first = true;
+    (inline_field_to_text(std::get<I>(fields_of<T>), x, sink, depth, first), ...);
+  }
+
+  template <class M>
+  void value_to_text(std::string_view key, const M &m, DiatomSink &sink, size_t indentation) {
+    key_to_text(key, sink, indentation);
+    if constexpr (has_fields<M>::value) {
+      sink.put('\n');
+      fields_to_text(m, sink, indentation + 1);
+    }
+    else {
+      sink.put(' ');
+      item_to_text(m, sink, 1);
+      sink.put('\n');
+    }
+  }
+
+  template <class T, class M>
+  void field_to_text(const Field<T, M> &f, const T &x, DiatomSink &sink, size_t indentation) {
+    value_to_text(f.name, x.*(f.member), sink, indentation);
+  }
+
+  template <class T, class M, class S, class D>
+  void field_to_text(const CustomField<T, M, S, D> &f, const T &x, DiatomSink &sink, size_t indentation) {
+    Diatom d = f.to_diatom(x.*(f.member));
+    _DiatomSerialization::serialize_entry(f.name, d, sink, indentation);
+  }
+
+  template <class T, size_t... I>
+  void fields_to_text(const T &x, DiatomSink &sink, size_t indentation, std::index_sequence<I...>) {
+    (field_to_text(std::get<I>(fields_of<T>), x, sink, indentation), ...);
+  }
+
+  template <class T, if_has_fields<T>>
+  void fields_to_text(const T &x, DiatomSink &sink, size_t indentation) {
+    fields_to_text(x, sink, indentation, std::make_index_sequence<n_fields<T>>());
+  }
+
+
+  #pragma mark - Reading text
+  //
+  //  Parse events are routed through a stack of frames, one per open table
+  //  or array. A frame points at the object, vector or member being filled,
+  //  with the functions that fill it from events. Tables and arrays with
+  //  nowhere to go get a frame with no functions, and their contents are
+  //  skipped. Vectors are filled from arrays, or from tables. Objects in
+  //  arrays are read from the tables in them.
+
+  struct ParseFrame;
+
+  struct ParseOps {
+    void (*number)(ParseFrame &f, std::string_view key, double x);
+    void (*string)(ParseFrame &f, std::string_view key, std::string_view s);
+    void (*boolean)(ParseFrame &f, std::string_view key, bool b);
+    ParseFrame (*table_begin)(ParseFrame &f, std::string_view key);
+    ParseFrame (*array_begin)(ParseFrame &f, std::string_view key);
+    void (*end)(ParseFrame &f);       // Called when the table or array ends, may be NULL
+    void (*discard)(ParseFrame &f);   // Called instead of end if parsing fails, may be NULL
+  };
+
+  struct ParseFrame {
+    const ParseOps *ops;
+    void *target;
+  };
+
+  // A value of the wrong type leaves a member as it is, except a vector,
+  // which is cleared, as antidiatomize clears it
+  template <class M>
+  void assign_number(M &m, double x) {
+    if constexpr (std::is_arithmetic<M>::value && !std::is_same<M, bool>::value) {
+      m = M(x);
+    }
+    else if constexpr (is_vector<M>::value) {
+      m.clear();
+    }
+  }
+
+  template <class M>
+  void assign_string(M &m, std::string_view s) {
+    if constexpr (std::is_same<M, std::string>::value) {
+      m = s;
+    }
+    else if constexpr (is_vector<M>::value) {
+      m.clear();
+    }
+  }
+
+  template <class M>
+  void assign_bool(M &m, bool b) {
+    if constexpr (std::is_same<M, bool>::value) {
+      m = b;
+    }
+    else if constexpr (is_vector<M>::value) {
+      m.clear();
+    }
+  }
+
+  template <class M>
+  ParseFrame table_frame(M &m);
+
+  // Frames for a type with a field list
+  template <class T>
+  struct FieldsParser {
+    static void number(ParseFrame &f, std::string_view key, double x) {
+      visit_field<T>(key, [&](auto &field) { field_number(field, *(T*) f.target, x); });
+    }
+    static void string(ParseFrame &f, std::string_view key, std::string_view s) {
+      visit_field<T>(key, [&](auto &field) { field_string(field, *(T*) f.target, s); });
+    }
+    static void boolean(ParseFrame &f, std::string_view key, bool b) {
+      visit_field<T>(key, [&](auto &field) { field_bool(field, *(T*) f.target, b); });
+    }
+    static ParseFrame table_begin(ParseFrame &f, std::string_view key) {
+      ParseFrame child{ NULL, NULL };
+      visit_field<T>(key, [&](auto &field) { child = field_table(field, *(T*) f.target); });
+      return child;
+    }
+    static ParseFrame array_begin(ParseFrame &f, std::string_view key) {
+      ParseFrame child{ NULL, NULL };
+      visit_field<T>(key, [&](auto &field) { child = field_array(field, *(T*) f.target); });
+      return child;
+    }
+    static constexpr ParseOps ops = { number, string, boolean, table_begin, array_begin, NULL, NULL };
+  };
+
+  // Frames for a vector, whose entries are appended in order
+  template <class V>
+  struct VectorParser {
+    static V& vec(ParseFrame &f) {
+      return *(V*) f.target;
+    }
+    static void number(ParseFrame &f, std::string_view, double x) {
+      assign_number(vec(f).emplace_back(), x);
+    }
+    static void string(ParseFrame &f, std::string_view, std::string_view s) {
+      assign_string(vec(f).emplace_back(), s);
+    }
+    static void boolean(ParseFrame &f, std::string_view, bool b) {
+      assign_bool(vec(f).emplace_back(), b);
+    }
+    static ParseFrame table_begin(ParseFrame &f, std::string_view) {
+      return table_frame(vec(f).emplace_back());
+    }
+    static constexpr ParseOps ops = { number, string, boolean, table_begin, table_begin, NULL, NULL };
+  };
+
+  // Frames for a Diatom, used to build a custom field's table or array
+  struct TreeParser {
+    static Diatom& tree(ParseFrame &f) {
+      return *(Diatom*) f.target;
+    }
+    static void number(ParseFrame &f, std::string_view key, double x) {
+      _DiatomSerialization::add_value(tree(f), key, Diatom(x));
+    }
+    static void string(ParseFrame &f, std::string_view key, std::string_view s) {
+      _DiatomSerialization::add_value(tree(f), key, Diatom(s));
+    }
+    static void boolean(ParseFrame &f, std::string_view key, bool b) {
+      _DiatomSerialization::add_value(tree(f), key, Diatom(b));
+    }
+    static ParseFrame table_begin(ParseFrame &f, std::string_view key) {
+      return { &ops, &_DiatomSerialization::add_child(tree(f), key, Diatom()) };
+    }
+    static ParseFrame array_begin(ParseFrame &f, std::string_view key) {
+      return { &ops, &_DiatomSerialization::add_child(tree(f), key, Diatom(Diatom::Type::Array)) };
+    }
+    static constexpr ParseOps ops = { number, string, boolean, table_begin, array_begin, NULL, NULL };
+  };
+
+  // Frames for a custom field's table or array, which is built as a Diatom
+  // and passed to the field's function when it ends
+  template <class T, class F>
+  struct CustomTableParser {
+    struct Pending {
+      Diatom tree;
+      const F *field;
+      T *object;
+    };
+    static Pending& pending(ParseFrame &f) {
+      return *(Pending*) f.target;
+    }
+    static void number(ParseFrame &f, std::string_view key, double x) {
+      ParseFrame t{ &TreeParser::ops, &pending(f).tree };
+      TreeParser::number(t, key, x);
+    }
+    static void string(ParseFrame &f, std::string_view key, std::string_view s) {
+      ParseFrame t{ &TreeParser::ops, &pending(f).tree };
+      TreeParser::string(t, key, s);
+    }
+    static void boolean(ParseFrame &f, std::string_view key, bool b) {
+      ParseFrame t{ &TreeParser::ops, &pending(f).tree };
+      TreeParser::boolean(t, key, b);
+    }
+    static ParseFrame table_begin(ParseFrame &f, std::string_view key) {
+      ParseFrame t{ &TreeParser::ops, &pending(f).tree };
+      return TreeParser::table_begin(t, key);
+    }
+    static ParseFrame array_begin(ParseFrame &f, std::string_view key) {
+      ParseFrame t{ &TreeParser::ops, &pending(f).tree };
+      return TreeParser::array_begin(t, key);
+    }
+    static void end(ParseFrame &f) {
+      Pending &p = pending(f);
+      p.field->from_diatom(p.tree, p.object->*(p.field->member));
+      delete &p;
+    }
+    static void discard(ParseFrame &f) {
+      delete &pending(f);
+    }
+    static constexpr ParseOps ops = { number, string, boolean, table_begin, array_begin, end, discard };
+  };
+
+  template <class M>
+  ParseFrame table_frame(M &m) {
+    if constexpr (has_fields<M>::value) {
+      return { &FieldsParser<M>::ops, &m };
+    }
+    else if constexpr (is_vector<M>::value) {
+      m.clear();
+      return { &VectorParser<M>::ops, &m };
+    }
+    else {
+      return { NULL, NULL };
+    }
+  }
+
+  template <class T, class M>
+  void field_number(const Field<T, M> &f, T &x, double n) { assign_number(x.*(f.member), n); }
+  template <class T, class M>
+  void field_string(const Field<T, M> &f, T &x, std::string_view s) { assign_string(x.*(f.member), s); }
+  template <class T, class M>
+  void field_bool(const Field<T, M> &f, T &x, bool b) { assign_bool(x.*(f.member), b); }
+  template <class T, class M>
+  ParseFrame field_table(const Field<T, M> &f, T &x) { return table_frame(x.*(f.member)); }
+  template <class T, class M>
+  ParseFrame field_array(const Field<T, M> &f, T &x) { return table_frame(x.*(f.member)); }
+
+  template <class T, class M, class S, class D>
+  void field_number(const CustomField<T, M, S, D> &f, T &x, double n) {
+    Diatom d(n);
+    f.from_diatom(d, x.*(f.member));
+  }
+  template <class T, class M, class S, class D>
+  void field_string(const CustomField<T, M, S, D> &f, T &x, std::string_view s) {
+    Diatom d(s);
+    f.from_diatom(d, x.*(f.member));
+  }
+  template <class T, class M, class S, class D>
+  void field_bool(const CustomField<T, M, S, D> &f, T &x, bool b) {
+    Diatom d(b);
+    f.from_diatom(d, x.*(f.member));
+  }
+  template <class T, class M, class S, class D>
+  ParseFrame field_table(const CustomField<T, M, S, D> &f, T &x) {
+    typedef CustomTableParser<T, CustomField<T, M, S, D>> Parser;
+    return { &Parser::ops, new typename Parser::Pending{ Diatom(), &f, &x } };
+  }
+  template <class T, class M, class S, class D>
+  ParseFrame field_array(const CustomField<T, M, S, D> &f, T &x) {
+    typedef CustomTableParser<T, CustomField<T, M, S, D>> Parser;
+    return { &Parser::ops, new typename Parser::Pending{ Diatom(Diatom::Type::Array), &f, &x } };
+  }
+
+  struct FieldsHandler : DiatomHandler {
+    std::vector<ParseFrame> frames;
+
+    FieldsHandler(ParseFrame top) {
+      frames.reserve(16);
+      frames.push_back(top);
+    }
+    ~FieldsHandler() {
+      for (ParseFrame &f : frames) {
+        if (f.ops && f.ops->discard) {
+          f.ops->discard(f);
+        }
+      }
+    }
+
+    void on_table_begin(std::string_view key) {
+      ParseFrame &f = frames.back();
+      frames.push_back(f.ops ? f.ops->table_begin(f, key) : ParseFrame{ NULL, NULL });
+    }
+    void on_table_end() {
+      ParseFrame f = frames.back();
+      frames.pop_back();
+      if (f.ops && f.ops->end) {
+        f.ops->end(f);
+      }
+    }
+    void on_array_begin(std::string_view key) {
+      ParseFrame &f = frames.back();
+      frames.push_back(f.ops ? f.ops->array_begin(f, key) : ParseFrame{ NULL, NULL });
+    }
+    void on_array_end() {
+      on_table_end();
+    }
+    void on_number(std::string_view key, double x) {
+      ParseFrame &f = frames.back();
+      if (f.ops) {
+        f.ops->number(f, key, x);
+      }
+    }
+    void on_string(std::string_view key, std::string_view s) {
+      ParseFrame &f = frames.back();
+      if (f.ops) {
+        f.ops->string(f, key, s);
+      }
+    }
+    void on_bool(std::string_view key, bool b) {
+      ParseFrame &f = frames.back();
+      if (f.ops) {
+        f.ops->boolean(f, key, b);
+      }
+    }
+  };
+}
+
+// Writes x's fields as text, without building a Diatom
+template <class T, Diatomize::if_has_fields<T> = 0>
+bool diatomize_to(const T &x, DiatomSink &sink) {
+  Diatomize::fields_to_text(x, sink, 0);
+  return sink.flush();
+}
+
+// Reads x's fields from text, without building a Diatom. If the text is
+// invalid, fields on the lines before the error will have been set.
+template <class T, Diatomize::if_has_fields<T> = 0>
+DiatomParseStatus antidiatomize_from(T &x, std::string_view text) {
+  Diatomize::FieldsHandler handler({ &Diatomize::FieldsParser<T>::ops, &x });
+  return diatom__parse(text, handler);
+}
+
+#endif
@@ -13,12 +13,23 @@
 //
 //      antidiatomize(y.getSD(), d);        // Deserialize x from a Diatom
 //
+//   Z lists its fields at compile time instead, see "Field lists" in
+//   Diatomize.h:
+//
+//      Diatom d = diatomize(z);
+//      antidiatomize(z, d);
+//
+//   Or, without building a Diatom, see DiatomizeText.h:
+//
+//      diatomize_to(z, sink);
+//      antidiatomize_from(z, text);
+//
 // -- BH 2015
 // Published under the MIT license - http://opensource.org/licenses/MIT
 //
 
 #include <cstdio>
-#include "../Diatomize.h"
+#include "../DiatomizeText.h"
 
 
 // A custom serializer function
@@ -34,6 +45,10 @@ public:
   Diatomize::Descriptor getSD() {
     return {{ diatomPart("areaOfEnclosure", &areaOfEnclosure) }};
   }
+
+  static constexpr auto diatom_fields() {
+    return Diatomize::fields(Diatomize::field("areaOfEnclosure", &Y::areaOfEnclosure));
+  }
 };
 
 
@@ -83,6 +98,38 @@ public:
 };
 
 
+// Serializable class – lists its fields at compile time
+class Z {
+public:
+  int monkeys    = 12;
+  float penguins = 5.0;
+  Y zooLayout;
+  std::string zooName                   = "My Compile-time Zoo";
+  std::vector<std::string> penguinNames = { "Jimmy", "Alice" };
+
+  static constexpr auto diatom_fields() {
+    return Diatomize::fields(
+      Diatomize::field("monkeys", &Z::monkeys),
+      Diatomize::field("penguins", &Z::penguins,
+        [](const float &x) { return Diatom((double) x); },
+        [](Diatom &d, float &x) { x = d.number_value; }
+      ),
+      Diatomize::field("zooLayout", &Z::zooLayout),
+      Diatomize::field("zooName", &Z::zooName),
+      Diatomize::field("penguinNames", &Z::penguinNames)
+    );
+  }
+
+  void print() {
+    printf("%s: %5d, %5.2f, %5.2f\n", zooName.c_str(), monkeys, penguins, zooLayout.areaOfEnclosure);
+    printf("  penguin names:");
+    for (auto i : penguinNames)
+      printf("  %s", i.c_str());
+    printf("\n");
+  }
+};
+
+
 int main() {
   X x;
   x.print();
@@ -95,12 +142,54 @@ int main() {
   d["zooName"]  = Diatom("My Second Zoo");
   d["isOpen"]   = Diatom(false);
   d["zooLayout"]["areaOfEnclosure"] = Diatom(0.63);
-  d["penguinHeights"]["2"] = 74.13;
-  d["penguinHeights"]["3"] = -127.4;
-  d["penguinNames"]["2"] = "Titan";
+  d["penguinHeights"].array_numbers()[2] = 74.13;
+  d["penguinHeights"].array_numbers()[3] = -127.4;
+  d["penguinNames"].array_items()[2] = "Titan";
 
   X y;
   antidiatomize(y.getSD(), d);
   y.print();
+
+  Z z;
+  Diatom dz = diatomize(z);
+  dz["monkeys"] = 3.;
+  dz["penguinNames"].push_back("Titan");
+
+  Z z2;
+  antidiatomize(z2, dz);
+  z2.print();
+
+  std::string text;
+  DiatomStringSink sink(text);
+  diatomize_to(z2, sink);
+
+  Z z3;
+  z3.zooName = "My Text Zoo";
+  antidiatomize_from(z3, text);
+  z3.print();
+
+  // Reading text directly gives the same result as reading the Diatom
+  // parsed from it, including for values of the wrong type
+  const char *texts[] = {
+    "monkeys: 3\nzooName: \"Text Zoo\"\npenguinNames: [\"Pip\", \"Pop\"]\n",
+    "monkeys: \"many\"\npenguinNames: \"Pip\"\n",
+    "zooName: 4\npenguinNames: 2\n",
+    "penguinNames: true\nzooLayout: 1\n",
+    "penguinNames:\n  a: \"Pip\"\n  b: 2\n",
+  };
+  bool same = true;
+  for (const char *t : texts) {
+    Z from_text, from_diatom;
+    Diatom dt = diatom__unserialize(t).take();
+    antidiatomize(from_diatom, dt);
+    antidiatomize_from(from_text, t);
+    same = same &&
+      from_text.monkeys == from_diatom.monkeys &&
+      from_text.zooName == from_diatom.zooName &&
+      from_text.penguinNames == from_diatom.penguinNames &&
+      from_text.zooLayout.areaOfEnclosure == from_diatom.zooLayout.areaOfEnclosure;
+  }
+  printf("Text and Diatom readers agree: %s\n", same ? "yes" : "no");
+  return same ? 0 : 1;
 }
 
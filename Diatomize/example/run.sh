@@ -1,2 +1,2 @@
-clang++ -std=c++11 example.cpp ../Diatomize.cpp && ./a.out
+clang++ -std=c++17 example.cpp ../Diatomize.cpp && ./a.out
 
@@ -0,0 +1,555 @@
+//
+// bench.cpp - performance benchmarks
+//
+//   Measures parsing and serialization throughput for documents of several
+//   shapes, table lookup and traversal, and Diatomize. Results are printed
+//   as JSON, so runs can be saved and compared.
+//
+//   Usage: ./a.out [scale]    - scale multiplies document sizes, default 1
+//
+
+#include "../Diatom.h"
+#include "../DiatomSerialization.h"
+#include "../DiatomDiff.h"
+#include "../Diatomize/DiatomizeText.h"
+#include <chrono>
+#include <random>
+#include <new>
+#include <cstdlib>
+#include <atomic>
+#include <sys/resource.h>
+
+
+// Allocation counting
+// -----------------------------
+
+// Atomic, as the parallel benchmarks allocate on several threads. Only the
+// totals are read, so relaxed ordering is enough.
+static std::atomic<size_t> n_allocations{ 0 };
+static std::atomic<size_t> n_allocated_bytes{ 0 };
+
+// Defined out of line, so that the compiler does not match inlined mallocs
+// and frees against new and delete
+__attribute__((noinline)) void* operator new(size_t n) {
+  n_allocations.fetch_add(1, std::memory_order_relaxed);
+  n_allocated_bytes.fetch_add(n, std::memory_order_relaxed);
+  if (void *p = malloc(n ? n : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
+// std::pmr's default resource allocates through the aligned forms
+__attribute__((noinline)) void* operator new(size_t n, std::align_val_t alignment) {
+  n_allocations.fetch_add(1, std::memory_order_relaxed);
+  n_allocated_bytes.fetch_add(n, std::memory_order_relaxed);
+  size_t a = std::max(size_t(alignment), sizeof(void*));
+  if (void *p = aligned_alloc(a, (std::max(n, size_t(1)) + a - 1) / a * a)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void *p, std::align_val_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t, std::align_val_t) noexcept { free(p); }
+
+
+// Timing
+//  - runs f repeatedly for at least min_seconds, and returns the fastest
+//    run in seconds, along with the allocations made by the first run
+// -----------------------------
+
+struct Timing {
+  double seconds;
+  size_t allocations;
+  size_t allocated_bytes;
+};
+
+template <class F>
+Timing time_best(F f, double min_seconds = 0.25) {
+  typedef std::chrono::steady_clock clock;
+  Timing t{ 1e30, 0, 0 };
+  double total = 0;
+  for (int i = 0; i < 3 || total < min_seconds; ++i) {
+    size_t allocations = n_allocations.load(std::memory_order_relaxed);
+    size_t bytes = n_allocated_bytes.load(std::memory_order_relaxed);
+    auto start = clock::now();
+    f();
+    double s = std::chrono::duration<double>(clock::now() - start).count();
+    if (i == 0) {
+      t.allocations = n_allocations.load(std::memory_order_relaxed) - allocations;
+      t.allocated_bytes = n_allocated_bytes.load(std::memory_order_relaxed) - bytes;
+    }
+    t.seconds = std::min(t.seconds, s);
+    total += s;
+  }
+  return t;
+}
+
+
+// Output
+// -----------------------------
+
+static bool first_result = true;
+
+void result(const char *benchmark, const std::string &shape, double value, const char *unit, const Timing &t) {
+  printf(
+    "%s    { \"benchmark\": \"%s\", \"shape\": \"%s\", \"value\": %.3f, \"unit\": \"%s\", \"allocations\": %zu, \"allocated_bytes\": %zu }",
+    first_result ? "" : ",\n", benchmark, shape.c_str(), value, unit, t.allocations, t.allocated_bytes
+  );
+  first_result = false;
+  fflush(stdout);
+}
+
+
+// Documents
+// -----------------------------
+
+struct Shape {
+  std::string name;
+  std::string text;
+};
+
+std::string number_string(double x) {
+  char buf[_DiatomSerialization::float_format_max_length];
+  return std::string(_DiatomSerialization::float_format(x, buf));
+}
+
+std::string wide_flat(size_t n) {
+  std::string s;
+  for (size_t i=0; i < n; ++i) {
+    s += "key_" + std::to_string(i) + ": " + std::to_string(i) + "\n";
+  }
+  return s;
+}
+
+std::string deep(size_t n_chains, size_t depth) {
+  std::string s;
+  for (size_t i=0; i < n_chains; ++i) {
+    for (size_t d=0; d < depth; ++d) {
+      s += std::string(d * 2, ' ') + "level_" + std::to_string(d) + (d == 0 ? "_" + std::to_string(i) : "") + ":\n";
+      s += std::string(d * 2 + 2, ' ') + "value: " + std::to_string(d) + "\n";
+    }
+  }
+  return s;
+}
+
+std::string numeric(size_t n, std::mt19937_64 &random) {
+  std::uniform_real_distribution<double> dist(-1e6, 1e6);
+  std::string s;
+  for (size_t i=0; i < n; ++i) {
+    s += "sample_" + std::to_string(i) + ":\n";
+    for (int j=0; j < 10; ++j) {
+      s += "  v" + std::to_string(j) + ": " + number_string(dist(random)) + "\n";
+    }
+  }
+  return s;
+}
+
+std::string arrays(size_t n, std::mt19937_64 &random) {
+  std::uniform_real_distribution<double> dist(-1e6, 1e6);
+  std::string s;
+  for (size_t i=0; i < n; ++i) {
+    s += "path_" + std::to_string(i) + ": [";
+    for (int j=0; j < 64; ++j) {
+      s += (j == 0 ? "" : ", ") + number_string(dist(random));
+    }
+    s += "]\n";
+  }
+  return s;
+}
+
+std::string strings(size_t n, std::mt19937_64 &random) {
+  std::uniform_int_distribution<int> length(8, 60);
+  std::uniform_int_distribution<int> letter('a', 'z');
+  std::string s;
+  for (size_t i=0; i < n; ++i) {
+    std::string value(length(random), ' ');
+    for (auto &c : value) {
+      c = letter(random);
+    }
+    s += "text_" + std::to_string(i) + ": \"" + value + "\"\n";
+  }
+  return s;
+}
+
+std::string long_strings(size_t n, std::mt19937_64 &random) {
+  std::uniform_int_distribution<int> length(200, 2000);
+  std::uniform_int_distribution<int> letter('a', 'z');
+  std::string s;
+  for (size_t i=0; i < n; ++i) {
+    std::string value(length(random), ' ');
+    for (auto &c : value) {
+      c = letter(random);
+    }
+    s += "a_rather_long_key_name_number_" + std::to_string(i) + ": \"" + value + "\"\n";
+  }
+  return s;
+}
+
+std::string game_state(size_t n_units, std::mt19937_64 &random) {
+  std::uniform_real_distribution<double> position(-500, 500);
+  std::uniform_int_distribution<int> hp(0, 100);
+  std::string s = "world:\n  name: \"Benchmark\"\n  tick: 123456\n  paused: false\nunits:\n";
+  for (size_t i=0; i < n_units; ++i) {
+    std::string n = std::to_string(i);
+    s += "  unit_" + n + ":\n";
+    s += "    id: " + n + "\n";
+    s += "    name: \"Unit number " + n + "\"\n";
+    s += "    hp: " + std::to_string(hp(random)) + "\n";
+    s += "    alive: " + std::string(i % 7 ? "true" : "false") + "\n";
+    s += "    pos:\n";
+    s += "      x: " + number_string(position(random)) + "\n";
+    s += "      y: " + number_string(position(random)) + "\n";
+    s += "      z: " + number_string(position(random)) + "\n";
+    s += "    inventory:\n";
+    for (int j=0; j < 4; ++j) {
+      s += "      item_" + std::to_string((i + j) % 50) + ": " + std::to_string(j + 1) + "\n";
+    }
+  }
+  return s;
+}
+
+
+// Diatomize
+// -----------------------------
+
+struct Position {
+  float x = 1.5, y = -2.25, z = 100;
+
+  Diatomize::Descriptor getSD() {
+    return {{
+      diatomPart("x", &x),
+      diatomPart("y", &y),
+      diatomPart("z", &z),
+    }};
+  }
+
+  static constexpr auto diatom_fields() {
+    return Diatomize::fields(
+      Diatomize::field("x", &Position::x),
+      Diatomize::field("y", &Position::y),
+      Diatomize::field("z", &Position::z)
+    );
+  }
+};
+
+struct Unit {
+  int id = 7;
+  std::string name = "A benchmark unit";
+  bool alive = true;
+  Position pos;
+  std::vector<float> cooldowns = { 0.5, 1, 2.5, 4 };
+
+  Diatomize::Descriptor getSD() {
+    return {{
+      diatomPart("id", &id),
+      diatomPart("name", &name),
+      diatomPart("alive", &alive),
+      diatomPart("pos", pos.getSD(), &pos),
+      diatomPart("cooldowns", &cooldowns),
+    }};
+  }
+
+  static constexpr auto diatom_fields() {
+    return Diatomize::fields(
+      Diatomize::field("id", &Unit::id),
+      Diatomize::field("name", &Unit::name),
+      Diatomize::field("alive", &Unit::alive),
+      Diatomize::field("pos", &Unit::pos),
+      Diatomize::field("cooldowns", &Unit::cooldowns)
+    );
+  }
+};
+
+struct World {
+  std::vector<Unit> units;
+
+  static constexpr auto diatom_fields() {
+    return Diatomize::fields(
+      Diatomize::field("units", &World::units)
+    );
+  }
+};
+
+
+// Benchmarks
+// -----------------------------
+
+void bench_text(const Shape &shape) {
+  double mb = shape.text.size() / 1e6;
+
+  Diatom d;
+  Timing parse = time_best([&]() {
+    d = diatom__unserialize(shape.text).take();
+  });
+  result("unserialize", shape.name, mb / parse.seconds, "MB/s", parse);
+
+  Timing parse_lazy = time_best([&]() {
+    Diatom lazy = diatom__unserialize_lazy(shape.text).take();
+    lazy.table_entries();
+  });
+  result("unserialize_lazy", shape.name, mb / parse_lazy.seconds, "MB/s", parse_lazy);
+
+  Timing parse_lazy_unvalidated = time_best([&]() {
+    Diatom lazy = diatom__unserialize_lazy(shape.text, false).take();
+    lazy.table_entries();
+  });
+  result("unserialize_lazy(unvalidated)", shape.name, mb / parse_lazy_unvalidated.seconds, "MB/s", parse_lazy_unvalidated);
+
+  std::string out;
+  Timing serialize = time_best([&]() {
+    out = diatom__serialize(d);
+  });
+  result("serialize", shape.name, mb / serialize.seconds, "MB/s", serialize);
+
+  std::string binary = diatom__serialize_binary(d);
+  double binary_mb = binary.size() / 1e6;
+  Timing parse_binary = time_best([&]() {
+    d = diatom__unserialize_binary(binary).take();
+  });
+  result("unserialize_binary", shape.name, binary_mb / parse_binary.seconds, "MB/s", parse_binary);
+}
+
+void bench_lookup(const Shape &shape, std::mt19937_64 &random) {
+  Diatom d = diatom__unserialize(shape.text).take();
+  Diatom &units = d["units"];
+  size_t n_units = units.table_entries().size();
+
+  std::vector<std::string> names;
+  std::uniform_int_distribution<size_t> pick(0, n_units - 1);
+  for (int i=0; i < 100000; ++i) {
+    names.push_back("unit_" + std::to_string(pick(random)));
+  }
+  std::vector<DiatomKey> keys;
+  for (auto &name : names) {
+    keys.push_back(DiatomKey(name));
+  }
+  double sum = 0;
+
+  Timing index = time_best([&]() {
+    for (auto &name : names) {
+      sum += units[name]["hp"].number_value;
+    }
+  });
+  result("operator[]", shape.name, index.seconds * 1e9 / (names.size() * 2), "ns/op", index);
+
+  static const DiatomKey key_hp("hp");
+  Timing index_key = time_best([&]() {
+    for (auto &key : keys) {
+      sum += units[key][key_hp].number_value;
+    }
+  });
+  result("operator[](DiatomKey)", shape.name, index_key.seconds * 1e9 / (keys.size() * 2), "ns/op", index_key);
+
+  std::vector<std::string> path_units, path_strings;
+  for (int i=0; i < 300; ++i) {
+    path_units.push_back("unit_" + std::to_string(i * 7 % n_units));
+    path_strings.push_back("units." + path_units.back() + ".pos.x");
+  }
+  Timing chained = time_best([&]() {
+    for (int rep=0; rep < 100; ++rep) {
+      for (auto &unit : path_units) {
+        sum += d["units"][unit]["pos"]["x"].number_value;
+      }
+    }
+  });
+  result("chained operator[]", shape.name, chained.seconds * 1e9 / (path_strings.size() * 100), "ns/path", chained);
+
+  std::vector<DiatomPath> paths;
+  for (auto &p : path_strings) {
+    paths.emplace_back(p);
+  }
+  Timing path = time_best([&]() {
+    for (int rep=0; rep < 100; ++rep) {
+      for (auto &p : paths) {
+        sum += p.find(d)->number_value;
+      }
+    }
+  });
+  result("DiatomPath", shape.name, path.seconds * 1e9 / (paths.size() * 100), "ns/path", path);
+
+  Timing has = time_best([&]() {
+    for (auto &name : names) {
+      sum += units.has(name) + units.has(std::string_view(name).substr(1));
+    }
+  });
+  result("has", shape.name, has.seconds * 1e9 / (names.size() * 2), "ns/op", has);
+
+  size_t n_nodes = 0;
+  Timing recurse = time_best([&]() {
+    n_nodes = 0;
+    d.recurse([&](std::string_view, Diatom &item) {
+      n_nodes += 1;
+      sum += item.is_number() ? item.number_value : 0;
+    });
+  });
+  result("recurse", shape.name, recurse.seconds * 1e9 / n_nodes, "ns/node", recurse);
+
+  if (sum == 42) {
+    fprintf(stderr, " ");
+  }
+}
+
+// Serializes after changing a few values, as an autosave would
+void bench_autosave(const Shape &shape) {
+  Diatom d = diatom__unserialize(shape.text).take();
+  size_t n_units = d["units"].table_entries().size();
+  double mb = shape.text.size() / 1e6;
+  std::string out;
+  size_t i_change = 0;
+  auto change = [&]() {
+    Diatom &units = d["units"];
+    for (int i=0; i < 10; ++i, i_change += 7919) {
+      units.table_entries()[i_change % n_units].item["hp"] = double(i_change % 100);
+    }
+  };
+
+  // No references are held across the copy, so it shares d's tables
+  Timing snapshot = time_best([&]() {
+    d.forget_references();
+    Diatom copy = d;
+    change();
+  });
+  result("snapshot", shape.name, snapshot.seconds * 1e6, "us", snapshot);
+
+  Timing full = time_best([&]() {
+    change();
+    out = diatom__serialize(d);
+  });
+  result("autosave", shape.name, mb / full.seconds, "MB/s", full);
+
+  diatom__serialize_cached(d);
+  Timing cached = time_best([&]() {
+    change();
+    out = diatom__serialize_cached(d);
+  });
+  result("autosave(cached)", shape.name, mb / cached.seconds, "MB/s", cached);
+}
+
+// Diffs a wide document against a copy with a few values changed
+void bench_diff(const Shape &shape) {
+  Diatom a = diatom__unserialize(shape.text).take();
+  Diatom b = a;
+  auto &entries = b.table_entries();
+  for (size_t i=0; i < entries.size(); i += entries.size() / 10 + 1) {
+    entries[i].item = Diatom("changed");
+  }
+  double mb = shape.text.size() / 1e6;
+
+  Diatom patch;
+  Timing diff = time_best([&]() {
+    patch = diatom__diff(a, b);
+  });
+  result("diatom__diff", shape.name, mb / diff.seconds, "MB/s", diff);
+
+  Timing apply = time_best([&]() {
+    Diatom patched = a;
+    diatom__apply(patched, patch);
+  });
+  result("diatom__apply(with copy)", shape.name, mb / apply.seconds, "MB/s", apply);
+}
+
+void bench_diatomize(size_t n) {
+  std::vector<Unit> units(n);
+  std::vector<Diatom> diatoms(n);
+
+  Timing diatomize_t = time_best([&]() {
+    for (size_t i=0; i < n; ++i) {
+      diatoms[i] = diatomize(units[i].getSD());
+    }
+  });
+  result("diatomize", "unit", n / diatomize_t.seconds, "objects/s", diatomize_t);
+
+  Timing antidiatomize_t = time_best([&]() {
+    for (size_t i=0; i < n; ++i) {
+      antidiatomize(units[i].getSD(), diatoms[i]);
+    }
+  });
+  result("antidiatomize", "unit", n / antidiatomize_t.seconds, "objects/s", antidiatomize_t);
+
+  Timing diatomize_fields = time_best([&]() {
+    for (size_t i=0; i < n; ++i) {
+      diatoms[i] = diatomize(units[i]);
+    }
+  });
+  result("diatomize(fields)", "unit", n / diatomize_fields.seconds, "objects/s", diatomize_fields);
+
+  Timing antidiatomize_fields = time_best([&]() {
+    for (size_t i=0; i < n; ++i) {
+      antidiatomize(units[i], diatoms[i]);
+    }
+  });
+  result("antidiatomize(fields)", "unit", n / antidiatomize_fields.seconds, "objects/s", antidiatomize_fields);
+}
+
+// Saving and loading an array of units, through a Diatom and directly
+void bench_diatomize_text(size_t n) {
+  // Objects in vectors are array items, so saving them interns no names
+  // besides the field names of their type, interned on first use
+  World world;
+  world.units.resize(1);
+  diatomize(world);
+  size_t n_interned = DiatomKey::interned_count();
+  world.units.resize(n);
+  Diatom initial = diatomize(world);
+  result("diatomize(keys interned)", "units", DiatomKey::interned_count() - n_interned, "keys", Timing{ 0, 0, 0 });
+  std::string text = diatom__serialize(initial);
+  double mb = text.size() / 1e6;
+
+  Timing save = time_best([&]() {
+    Diatom d = diatomize(world);
+    text = diatom__serialize(d);
+  });
+  result("diatomize+serialize", "units", mb / save.seconds, "MB/s", save);
+
+  Timing save_direct = time_best([&]() {
+    text.clear();
+    DiatomStringSink sink(text);
+    diatomize_to(world, sink);
+  });
+  result("diatomize_to", "units", mb / save_direct.seconds, "MB/s", save_direct);
+
+  Timing load = time_best([&]() {
+    Diatom d = diatom__unserialize(text).take();
+    antidiatomize(world, d);
+  });
+  result("unserialize+antidiatomize", "units", mb / load.seconds, "MB/s", load);
+
+  Timing load_direct = time_best([&]() {
+    antidiatomize_from(world, text);
+  });
+  result("antidiatomize_from", "units", mb / load_direct.seconds, "MB/s", load_direct);
+}
+
+
+int main(int argc, char **argv) {
+  double scale = argc > 1 ? atof(argv[1]) : 1;
+  auto scaled = [scale](size_t n) { return std::max(size_t(1), size_t(n * scale)); };
+  std::mt19937_64 random(2012);
+
+  std::vector<Shape> shapes = {
+    { "wide_flat",  wide_flat(scaled(200000)) },
+    { "deep",       deep(scaled(200), 64) },
+    { "numeric",    numeric(scaled(20000), random) },
+    { "arrays",     arrays(scaled(3000), random) },
+    { "strings",    strings(scaled(100000), random) },
+    { "long_strings", long_strings(scaled(10000), random) },
+    { "game_state", game_state(scaled(20000), random) },
+  };
+
+  printf("{\n  \"scale\": %g,\n  \"results\": [\n", scale);
+  for (auto &shape : shapes) {
+    bench_text(shape);
+  }
+  bench_lookup(shapes.back(), random);
+  bench_autosave(shapes.back());
+  bench_diff(shapes[0]);
+  bench_diatomize(scaled(20000));
+  bench_diatomize_text(scaled(20000));
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("\n  ],\n  \"peak_rss_kb\": %ld\n}\n", usage.ru_maxrss);
+}
@@ -0,0 +1 @@
+clang++ -std=c++17 -O2 bench.cpp ../Diatomize/Diatomize.cpp && ./a.out "$@" | tee ../bench_output.txt
@@ -1,2 +1,2 @@
-clang++ -std=c++11 test.cpp && ./a.out
+clang++ -std=c++17 test.cpp && ./a.out
 
@@ -1,12 +1,39 @@
 #include "_test.h"
 #include "../Diatom.h"
 #include "../DiatomSerialization.h"
+#include "../DiatomView.h"
+#include "../DiatomDiff.h"
 #include <iostream>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <numeric>
 
 
 using Token = _DiatomSerialization::Token;
 
 
+// Counts allocations made through it, forwarding them to the default resource
+struct CountingResource : std::pmr::memory_resource {
+  size_t n_allocations = 0;
+  std::map<size_t, size_t> n_allocations_of_size;
+
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    n_allocations += 1;
+    n_allocations_of_size[bytes] += 1;
+    return std::pmr::get_default_resource()->allocate(bytes, alignment);
+  }
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    std::pmr::get_default_resource()->deallocate(p, bytes, alignment);
+  }
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+
 void printtype(Diatom &d) {
   printf("type: ");
   switch (d.type) {
@@ -15,17 +42,32 @@ void printtype(Diatom &d) {
     case Diatom::Type::Bool:   { printf("bool");   break; }
     case Diatom::Type::Empty:  { printf("empty");  break; }
     case Diatom::Type::Table:  { printf("table");  break; }
+    case Diatom::Type::Array:  { printf("array");  break; }
   }
   printf("\n");
 }
 
 
-std::vector<std::string> get_type_list(std::vector<Token> ts) {
-  return _DiatomSerialization::map<Token, std::string>(ts, [](Token t) {
-    return t.type_string();
-  });
+static std::string number_string(double x) {
+  char buf[_DiatomSerialization::float_format_max_length];
+  return std::string(_DiatomSerialization::float_format(x, buf));
 }
 
+// Records parse events as strings
+struct EventRecorder : DiatomHandler {
+  std::vector<std::string> events;
+  size_t stop_after = -1;
+
+  void on_table_begin(std::string_view key) { events.push_back(std::string(key) + "{"); }
+  void on_table_end() { events.push_back("}"); }
+  void on_array_begin(std::string_view key) { events.push_back(std::string(key) + "["); }
+  void on_array_end() { events.push_back("]"); }
+  void on_number(std::string_view key, double x) { events.push_back(std::string(key) + "=" + number_string(x)); }
+  void on_string(std::string_view key, std::string_view s) { events.push_back(std::string(key) + "=\"" + std::string(s) + "\""); }
+  void on_bool(std::string_view key, bool b) { events.push_back(std::string(key) + "=" + (b ? "true" : "false")); }
+  bool done() { return events.size() >= stop_after; }
+};
+
 
 void testDiatom() {
   p_file_header("Diatom.h");
@@ -54,7 +96,7 @@ void testDiatom() {
   Diatom s2(cstr);
   p_assert(s1.is_string());
   p_assert(s2.is_string());
-  p_assert(s1.string_value == str);
+  p_assert(s1.string_value == std::string_view(str));
   p_assert(s2.string_value == cstr);
 
 
@@ -70,7 +112,7 @@ void testDiatom() {
   p_assert(t1["monkeys"].is_empty());
   t1["custard"] = "lemons";
   t1["bananas"] = false;
-  p_assert(t1.table_entries.size() == 3);
+  p_assert(t1.table_entries().size() == 3);
   p_assert(t1["monkeys"].is_empty());
   p_assert(t1["custard"].is_string());
   p_assert(t1["bananas"].is_bool());
@@ -92,22 +134,287 @@ void testDiatom() {
   Diatom r2 = russians;
   p_assert(russians.is_table());
   p_assert(r2.is_table());
-  p_assert(r2.table_entries.size() == 3);
+  p_assert(r2.table_entries().size() == 3);
   p_assert(r2["scientists"].is_table());
-  p_assert(r2["scientists"].table_entries.size() == 1);
+  p_assert(r2["scientists"].table_entries().size() == 1);
   p_assert(r2["mikhail"].is_string());
   p_assert(r2["mikhail"].string_value == "Gorbachev");
 
+  p_header("copy on write");
+  CountingResource cow_counting;
+  Diatom cow(Diatom::allocator_type{ &cow_counting });
+  for (int i=0; i < 100; ++i) {
+    Diatom &section = cow["section_" + std::to_string(i)];
+    section["hp"] = double(i);
+    section["pos"]["x"] = 1.5;
+  }
+  // Built through operator[], so copied until forgotten
+  cow.forget_references();
+  size_t cow_allocations = cow_counting.n_allocations;
+  Diatom cow_snapshot(cow, cow.get_allocator());
+  p_assert(cow_counting.n_allocations == cow_allocations);
+  p_assert(cow.is_shared() && cow_snapshot.is_shared());
+  cow["section_50"]["pos"]["x"] = 2.5;
+  size_t cow_path_allocations = cow_counting.n_allocations - cow_allocations;
+  p_assert(cow_path_allocations > 0 && cow_path_allocations < 10);
+  p_assert(cow_snapshot["section_50"]["pos"]["x"].number_value == 1.5);
+  p_assert(cow["section_50"]["pos"]["x"].number_value == 2.5);
+  p_assert(cow.table()->entries[49].item.is_shared());
+  p_assert(!cow.table()->entries[50].item.is_shared());
+  cow_snapshot.remove_child("section_0");
+  p_assert(cow.has("section_0") && !cow_snapshot.has("section_0"));
+  Diatom cow_other = r2;
+  r2["mikhail"] = "Baryshnikov";
+  p_assert(cow_other["mikhail"].string_value == "Gorbachev");
+  p_assert(russians["scientists"].table() != scientists.table());
+  scientists.forget_references();
+  russians["scientists"] = scientists;
+  p_assert(russians["scientists"].table() == scientists.table());
+  russians["scientists"]["skinner"] = "Pigeons";
+  p_assert(scientists.table_entries().size() == 1);
+
+  // Writes through references held across a copy do not change the copy
+  Diatom holder;
+  holder["units"]["player"]["hp"] = 10.;
+  holder["units"]["player"]["tags"].push_back(Diatom("new"));
+  holder.forget_references();
+  Diatom &holder_hp = holder["units"]["player"]["hp"];
+  Diatom &holder_units = holder["units"];
+  Diatom::TableEntry *holder_player = holder["units"].find("player");
+  std::pmr::vector<Diatom> &holder_tags = holder_player->item["tags"].array_items();
+  Diatom holder_snapshot = holder;
+  Diatom holder_snapshot_2 = holder_snapshot;
+  p_assert(!holder.is_shared() && holder_snapshot.is_shared() && holder_snapshot_2.is_shared());
+  holder_hp = 3.;
+  holder_player->item["mp"] = 5.;
+  holder_tags[0] = "old";
+  holder_units["enemy"] = 1.;
+  p_assert(holder["units"]["player"]["hp"].number_value == 3);
+  p_assert(holder_snapshot["units"]["player"]["hp"].number_value == 10);
+  p_assert(holder_snapshot["units"]["player"]["tags"].array_items()[0].string_value == "new");
+  p_assert(!holder_snapshot["units"].has("enemy") && !holder_snapshot["units"]["player"].has("mp"));
+  p_assert(!std::as_const(holder_snapshot_2).find("units")->item.has("enemy"));
+
+
   p_header("remove_child");
   Diatom birds;
   birds["A"] = "albatross";
   birds["B"] = "bullfinch";
   birds["C"] = "cassowary";
   birds.remove_child("B");
-  p_assert(birds.table_entries.size() == 2);
+  p_assert(birds.table_entries().size() == 2);
   p_assert(birds["A"].string_value == "albatross");
   p_assert(birds["C"].string_value == "cassowary");
 
+  p_header("large tables");
+  Diatom large;
+  for (int i=0; i < 1000; ++i) {
+    large[std::string("item_") + std::to_string(i)] = (double) i;
+  }
+  Diatom large_copy = large;
+  large.remove_child("item_10");
+  std::reverse(large_copy.table_entries().begin(), large_copy.table_entries().end());
+  p_assert(large.table_entries().size() == 999);
+  p_assert(large.table_entries()[10].name == "item_11");
+  p_assert(large["item_500"].number_value == 500);
+  p_assert(large["item_999"].number_value == 999);
+  p_assert(large.has("item_10") == false);
+  p_assert(large.has("item_11") == true);
+  p_assert(large_copy.table_entries()[0].name == "item_999");
+  p_assert(large_copy["item_10"].number_value == 10);
+  p_assert(large_copy["item_0"].number_value == 0);
+  p_assert(large_copy.table_entries().size() == 1000);
+
+  // Lookups find entries edited through table_entries(), including edits
+  // that leave the table the same size
+  Diatom edited = large;
+  p_assert(edited.find("item_5") && edited.has("item_6"));
+  auto &edited_entries = edited.table_entries();
+  edited_entries.erase(edited_entries.begin() + 5);
+  edited_entries.emplace_back(DiatomKey("appended"), Diatom(1.));
+  p_assert(edited_entries.size() == 999);
+  p_assert(std::as_const(edited).has("appended") && !std::as_const(edited).has("item_5"));
+  p_assert(edited.find("appended") && !edited.find("item_5") && edited.has("item_999"));
+  p_assert(edited["item_500"].number_value == 500);
+  edited.table_entries()[0].name = DiatomKey("renamed");
+  p_assert(std::as_const(edited).has("renamed") && !std::as_const(edited).has("item_0"));
+  p_assert(edited.find("renamed") && !edited.find("item_0"));
+  p_assert(edited.table_entries().size() == 999 && edited["renamed"].number_value == 0);
+
+  // Copies may be made and used on different threads: lookups never change
+  // a shared table's index, even one left out of date by moving entries
+  Diatom large_moved = large;
+  std::reverse(large_moved.table_entries().begin(), large_moved.table_entries().end());
+  large_moved.forget_references();
+  std::vector<int> large_found(4, 0);
+  std::vector<std::thread> large_threads;
+  for (int i=0; i < 4; ++i) {
+    large_threads.emplace_back([&large_moved, &large_found, i]() {
+      Diatom mine = large_moved;
+      bool found = std::as_const(mine).has("item_500") && !std::as_const(mine).has("item_10");
+      mine["item_500"] = double(i);
+      large_found[i] = found && mine["item_500"].number_value == i && mine.table_entries()[0].name == "item_999";
+    });
+  }
+  for (auto &t : large_threads) {
+    t.join();
+  }
+  p_assert(std::accumulate(large_found.begin(), large_found.end(), 0) == 4);
+  p_assert(std::as_const(large_moved).find("item_500")->item.number_value == 500);
+
+  p_header("arrays");
+  Diatom path(Diatom::Type::Array);
+  for (int i=0; i < 100; ++i) {
+    path.push_back(Diatom(i * 0.5));
+  }
+  path.forget_references();
+  Diatom path_copy = path;
+  p_assert(path.is_shared() && path_copy.array() == path.array());
+  path.array_numbers()[10] = -1;
+  Diatom mixed = path_copy;
+  mixed.push_back(Diatom("end"));
+  Diatom became_array = 5.;
+  became_array.push_back(Diatom(true));
+  p_assert(path.is_array() && path.is_packed());
+  p_assert(path.array_size() == 100);
+  p_assert(path.number_at(10) == -1 && path_copy.number_at(10) == 5);
+  p_assert(!path.is_shared() && !path_copy.is_shared() && !mixed.is_shared());
+  p_assert(!mixed.is_packed() && mixed.array_size() == 101);
+  p_assert(mixed.number_at(99) == 49.5 && mixed.number_at(100) == 0);
+  p_assert(mixed.array_items()[100].string_value == "end");
+  p_assert(path_copy.is_packed() && path_copy.array_size() == 100);
+  p_assert(became_array.array_size() == 1 && became_array.array_items()[0].bool_value);
+  p_assert(path_copy.array_items().size() == 100 && !path_copy.is_packed());
+  p_assert(Diatom(1.).array_numbers().empty() && Diatom(1.).array_items().empty());
+  Diatom became_numbers(1.);
+  Diatom became_items("x");
+  became_numbers.array_numbers().push_back(2.);
+  became_items.array_items().push_back(Diatom(true));
+  p_assert(became_numbers.is_packed() && became_numbers.number_at(0) == 2);
+  p_assert(became_items.array_size() == 1 && !became_items.is_packed());
+  p_assert(Diatom(1.).array_numbers().empty() && mixed.array_numbers().empty());
+  p_assert(std::string(path.type_string()) == "Array");
+
+  p_header("interned keys");
+  DiatomKey key_hp("hp");
+  DiatomKey key_hp2(std::string("h") + "p");
+  DiatomKey key_item("item_500");
+  Diatom unit;
+  unit[key_hp] = 10.;
+  unit["pos"] = 2.;
+  p_assert(key_hp == key_hp2);
+  p_assert(key_hp.k == key_hp2.k);
+  p_assert(key_hp == "hp");
+  p_assert(DiatomKey() == "");
+  p_assert(unit["hp"].number_value == 10);
+  p_assert(unit[key_hp2].number_value == 10);
+  p_assert(unit.has(key_hp));
+  p_assert(unit.table_entries()[0].name == key_hp);
+  size_t n_interned = DiatomKey::interned_count();
+  DiatomKey key_new_1("interned_count_test");
+  DiatomKey key_new_2("interned_count_test");
+  p_assert(DiatomKey::interned_count() == n_interned + 1);
+
+  // Keys interned through each thread's cache are the same keys
+  std::vector<DiatomKey> keys_main;
+  std::vector<std::vector<DiatomKey>> keys_threaded(4);
+  for (size_t i=0; i < 5000; ++i) {
+    keys_main.push_back(DiatomKey("thread_key_" + std::to_string(i)));
+  }
+  std::vector<std::thread> key_threads;
+  for (auto &keys : keys_threaded) {
+    key_threads.emplace_back([&keys]() {
+      for (size_t pass=0; pass < 2; ++pass) {
+        keys.clear();
+        for (size_t i=0; i < 5000; ++i) {
+          keys.push_back(DiatomKey("thread_key_" + std::to_string(i)));
+        }
+      }
+    });
+  }
+  for (auto &t : key_threads) {
+    t.join();
+  }
+  bool keys_threaded_match = true;
+  for (auto &keys : keys_threaded) {
+    keys_threaded_match = keys_threaded_match && keys == keys_main;
+  }
+  p_assert(keys_threaded_match);
+  p_assert(DiatomKey::interned_count() == n_interned + 5001);
+  p_assert(large[key_item].number_value == 500);
+  p_assert(large.has(DiatomKey("item_10")) == false);
+  unit.remove_child(key_hp);
+  p_assert(!unit.has("hp") && unit.table_entries().size() == 1);
+
+  p_header("DiatomPath");
+  Diatom world;
+  world["world"]["units"]["player"]["hp"] = 30.;
+  world["world"]["units"]["enemy"]["hp"] = 12.;
+  DiatomPath path_hp("world.units.player.hp");
+  DiatomPath path_missing("world.units.ghost.hp");
+  DiatomPath path_through_leaf("world.units.player.hp.max");
+  Diatom *found_hp = path_hp.find(world);
+  p_assert(found_hp && found_hp->number_value == 30);
+  p_assert(path_hp.hops.size() == 4 && path_hp.hops[2].hint == 0);
+  p_assert(path_hp.str() == "world.units.player.hp");
+  p_assert(DiatomPath("").find(world) == &world);
+  p_assert(!path_missing.has(world));
+  p_assert(!path_through_leaf.has(world));
+  p_assert(!path_hp.has(unit));
+  DiatomPath path_enemy("world.units.enemy.hp");
+  p_assert(path_enemy.find(world)->number_value == 12);
+  p_assert(path_enemy.hops[2].hint == 1);
+  world["world"]["units"].remove_child("player");
+  p_assert(!path_hp.has(world));
+  p_assert(path_enemy.find(world)->number_value == 12);
+  p_assert(path_enemy.hops[2].hint == 0);
+  p_assert(DiatomPath("item_500").find(large)->number_value == 500);
+  p_assert(DiatomPath("item_500").find(large_copy) == &large_copy["item_500"]);
+
+  // Finding through a const diatom leaves a snapshot shared, and its
+  // cached text clean
+  world.forget_references();
+  Diatom world_snapshot = world;
+  diatom__serialize_cached(world_snapshot);
+  const Diatom *found_enemy = path_enemy.find(std::as_const(world_snapshot));
+  p_assert(found_enemy && found_enemy->number_value == 12);
+  p_assert(path_enemy.has(world_snapshot) && !path_hp.has(world_snapshot));
+  p_assert(world_snapshot.is_shared() && world.is_shared());
+  p_assert(!world_snapshot.table()->text_cache->dirty);
+  path_enemy.find(world_snapshot)->number_value = 13;
+  p_assert(!world_snapshot.is_shared() && !world_snapshot.table()->text_cache);
+  p_assert(path_enemy.find(std::as_const(world))->number_value == 12);
+
+
+  p_header("compact layout");
+  std::string long_str(100, 'x');
+  Diatom short_s("penguins");
+  Diatom long_s(long_str);
+  Diatom long_copy = long_s;
+  Diatom reassigned = 5.;
+  reassigned = long_s;
+  reassigned = "short";
+  Diatom leaf_indexed = 1.;
+  leaf_indexed["a"] = 2.;
+  p_assert(sizeof(Diatom) <= 32);
+  p_assert(short_s.string_value.is_inline());
+  p_assert(!long_s.string_value.is_inline());
+  p_assert(long_copy.string_value == long_str);
+  p_assert(long_copy.string_value.data() != long_s.string_value.data());
+  p_assert(reassigned.is_string() && reassigned.string_value == "short");
+  p_assert(leaf_indexed.is_table() && leaf_indexed["a"].number_value == 2);
+  p_assert(Diatom(Diatom::Type::Number).table_entries().size() == 0);
+  Diatom not_table(1.);
+  Diatom not_table_2("text");
+  not_table.table_entries().emplace_back(DiatomKey("a"), Diatom(2.));
+  p_assert(not_table.is_number() && not_table.number_value == 1);
+  p_assert(not_table.table_entries().empty() && std::as_const(not_table).table_entries().empty());
+  p_assert(not_table_2.table_entries().empty() && not_table_2.string_value == "text");
+  Diatom became_table(1.);
+  became_table.make_table_type();
+  became_table.table_entries().emplace_back(DiatomKey("a"), Diatom(2.));
+  p_assert(became_table.is_table() && became_table["a"].number_value == 2);
+
   p_header("recurse");
   Diatom birds_2;
   birds_2["A"] = "albatross";
@@ -117,16 +424,16 @@ void testDiatom() {
   birds_2["C"]["2"] = "chaffinch";
   std::vector<std::string> birds_out1;
   std::vector<std::string> birds_out2;
-  birds_2.recurse([&](std::string name, Diatom d) {
+  birds_2.recurse([&](std::string_view name, Diatom &d) {
     if (d.is_table()) {
-      birds_out1.push_back(name + " -- table");
+      birds_out1.push_back(std::string(name) + " -- table");
     }
     else {
-      birds_out1.push_back(name + std::string(":") + d.string_value);
+      birds_out1.push_back(std::string(name) + ":" + std::string(d.string_value));
     }
   });
-  birds_2.recurse([&](std::string name, Diatom d) {
-    birds_out2.push_back(name);
+  birds_2.recurse([&](std::string_view name, Diatom &) {
+    birds_out2.push_back(std::string(name));
   }, true);
   std::vector<std::string> birds_exp1 = {
     "A:albatross",
@@ -141,76 +448,56 @@ void testDiatom() {
   p_assert(birds_out1 == birds_exp1);
   p_assert(birds_out2 == birds_exp2);
 
-
-  p_file_header("DiatomSerialization.h");
-  p_header("float_format");
-  auto str1 = _DiatomSerialization::float_format(11235);
-  auto str2 = _DiatomSerialization::float_format(2983763.25);
-  auto str3 = _DiatomSerialization::float_format(2.4);
-  p_assert(str1 == "11235");
-  p_assert(str2 == "2983763.25");
-  p_assert(str3 == "2.39999999999999991");
-
-
-  p_header("indent");
-  std::string indent1 = _DiatomSerialization::indent(1);
-  std::string indent2 = _DiatomSerialization::indent(2);
-  p_assert(indent1 == "  ");
-  p_assert(indent2 == "    ");
-
-  p_header("filter");
-  std::vector<std::string> filter_strings = {
-    "hello",
-    "there",
-    "world",
-  };
-  auto filter_strings_result = _DiatomSerialization::filter(filter_strings, [](std::string s) {
-    return s.find('o') != std::string::npos;
+  // Arrays are descended into, and their items have empty names
+  birds_2["D"].push_back(Diatom(1.));
+  birds_2["E"].push_back(Diatom("dunnock"));
+  birds_2["E"].push_back(Diatom());
+  birds_2["E"].array_items().back()["F"] = true;
+  std::vector<std::string> birds_out3;
+  birds_2.recurse([&](std::string_view name, Diatom &d) {
+    birds_out3.push_back(std::string(name) + ":" + d.type_string());
   });
-  std::vector<std::string> filter_strings_exp = {
-    "hello",
-    "world",
+  std::vector<std::string> birds_exp3 = {
+    "A:String", "B:String", "C:Table", "1:String", "2:String",
+    "D:Array", "E:Array", ":String", ":Table", "F:Bool",
   };
-  p_assert(filter_strings_result == filter_strings_exp);
-
+  p_assert(birds_out3 == birds_exp3);
 
-  p_header("map_property");
-  std::vector<Token> mp_tokens = {
-    { Token::Name },
-    { Token::Property__String },
-  };
-  auto mp_types = _DiatomSerialization::map<Token, Token::Type>(mp_tokens, [](Token t) {
-    return t.type;
+  // The const versions leave a snapshot shared, and cached text clean
+  birds_2.forget_references();
+  Diatom birds_3 = birds_2;
+  diatom__serialize_cached(birds_3);
+  std::vector<std::string> birds_out4;
+  std::as_const(birds_3).recurse([&](std::string_view name, const Diatom &d) {
+    birds_out4.push_back(std::string(name) + ":" + d.type_string());
   });
-  std::vector<Token::Type> mp_types_exp{ Token::Name, Token::Property__String };
-  p_assert(mp_types == mp_types_exp);
-
+  size_t birds_n_each = 0;
+  std::as_const(birds_3).each([&](std::string_view, const Diatom &) {
+    birds_n_each += 1;
+  });
+  p_assert(birds_out4 == birds_exp3 && birds_n_each == 5);
+  p_assert(birds_3.is_shared() && !birds_3.table()->text_cache->dirty);
+  birds_3.recurse([&](std::string_view, Diatom &) { });
+  p_assert(!birds_3.is_shared() && !birds_3.table()->text_cache);
 
-  p_header("contains");
-  std::vector<std::string> contains_strings = {
-    "monkeys",
-    "lemurs",
-    "penguins",
-  };
-  bool has_penguins = _DiatomSerialization::contains(contains_strings, "penguins");
-  bool has_batman   = _DiatomSerialization::contains(contains_strings, "batman");
-  p_assert(has_penguins == true);
-  p_assert(has_batman == false);
-
-
-  p_header("split");
-  auto split_result        = _DiatomSerialization::split("hello there everyone.", ' ');
-  auto split_result_empty  = _DiatomSerialization::split("", ' ');
-  auto split_result_consec = _DiatomSerialization::split("   ", ' ');
-  auto split_result_none   = _DiatomSerialization::split("hello", ' ');
-  std::vector<std::string> split_result_exp{ "hello", "there", "everyone." };
-  std::vector<std::string> split_result_consec_exp{ "", "", "" };
-  std::vector<std::string> split_result_none_exp{ "hello" };
-  p_assert(split_result == split_result_exp);
-  p_assert(split_result_empty.size() == 0);
-  p_assert(split_result_consec == split_result_consec_exp);
-  p_assert(split_result_none == split_result_none_exp);
 
+  p_file_header("DiatomSerialization.h");
+  p_header("float_format");
+  char fbuf1[_DiatomSerialization::float_format_max_length];
+  char fbuf2[_DiatomSerialization::float_format_max_length];
+  char fbuf3[_DiatomSerialization::float_format_max_length];
+  char fbuf4[_DiatomSerialization::float_format_max_length];
+  char fbuf5[_DiatomSerialization::float_format_max_length];
+  auto str1 = _DiatomSerialization::float_format(11235, fbuf1);
+  auto str2 = _DiatomSerialization::float_format(2983763.25, fbuf2);
+  auto str3 = _DiatomSerialization::float_format(2.4, fbuf3);
+  auto str4 = _DiatomSerialization::float_format(-1e21, fbuf4);
+  auto str5 = _DiatomSerialization::float_format(0.1 + 0.2, fbuf5);
+  p_assert(str1 == "11235");
+  p_assert(str2 == "2983763.25");
+  p_assert(str3 == "2.4");
+  p_assert(str4 == "-1e+21");
+  p_assert(str5 == "0.30000000000000004");
 
   p_header("diatom__serialize()");
   Diatom dsz1;
@@ -237,15 +524,72 @@ void testDiatom() {
   p_assert(s__dsz2 == exp__dsz2);
 
 
+  p_header("diatom__serialize_to()");
+  std::ostringstream sz_stream;
+  std::vector<std::string> sz_chunks;
+  char sz_buffer[8];
+  DiatomCallbackSink sz_callback_sink(sz_buffer, sizeof(sz_buffer), [&](const char *p, size_t n) {
+    sz_chunks.push_back(std::string(p, n));
+    return true;
+  });
+  DiatomCallbackSink sz_failing_sink(sz_buffer, sizeof(sz_buffer), [&](const char *, size_t) {
+    return false;
+  });
+  FILE *sz_file = tmpfile();
+  bool sz_file_ok = diatom__serialize_to(dsz1, sz_file);
+  std::string sz_file_contents(strlen(exp__dsz1), '\0');
+  rewind(sz_file);
+  sz_file_contents.resize(fread(&sz_file_contents[0], 1, sz_file_contents.size(), sz_file));
+  int sz_pipe[2];
+  p_assert(pipe(sz_pipe) == 0);
+  bool sz_fd_ok = diatom__serialize_to(dsz1, sz_pipe[1]);
+  close(sz_pipe[1]);
+  std::string sz_fd_contents(256, '\0');
+  sz_fd_contents.resize(read(sz_pipe[0], &sz_fd_contents[0], sz_fd_contents.size()));
+  close(sz_pipe[0]);
+  fclose(sz_file);
+  p_assert(diatom__serialize_to(dsz1, sz_stream) && sz_stream.str() == exp__dsz1);
+  p_assert(diatom__serialize_to(dsz1, sz_callback_sink));
+  p_assert(sz_chunks.size() > 1 && sz_chunks[0].size() == sizeof(sz_buffer));
+  p_assert(std::accumulate(sz_chunks.begin(), sz_chunks.end(), std::string()) == exp__dsz1);
+  p_assert(!diatom__serialize_to(dsz1, sz_failing_sink));
+  p_assert(sz_file_ok && sz_file_contents == exp__dsz1);
+  p_assert(sz_fd_ok && sz_fd_contents == exp__dsz1);
+
+
+  p_header("number round trip");
+  std::mt19937_64 rt_random(2012);
+  Diatom rt_numbers;
+  for (int i=0; i < 2000; ++i) {
+    uint64_t bits = rt_random();
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    if (std::isfinite(x)) {
+      rt_numbers[std::string("n") + std::to_string(i)] = x;
+    }
+  }
+  rt_numbers["small"] = 5e-324;
+  rt_numbers["large"] = 1.7976931348623157e308;
+  rt_numbers["point_one"] = 0.1;
+  auto rt_result = diatom__unserialize(diatom__serialize(rt_numbers));
+  bool rt_exact = rt_result.success && rt_result.d.table_entries().size() == rt_numbers.table_entries().size();
+  for (size_t i=0; rt_exact && i < rt_numbers.table_entries().size(); ++i) {
+    double x = rt_numbers.table_entries()[i].item.number_value;
+    double y = rt_result.d.table_entries()[i].item.number_value;
+    rt_exact = memcmp(&x, &y, sizeof(x)) == 0;
+  }
+  p_assert(rt_exact);
+
+
   p_header("token getters");
   auto texp_invalid = Token{ Token::Invalid };
 
   std::string tok_name = "a100_7F:";
   std::string tok_notname = "7b";
   std::string tok_booly = "true";
-  auto t_name    = _DiatomSerialization::token__name(tok_name.begin(), tok_name);
-  auto t_notname = _DiatomSerialization::token__name(tok_notname.begin(), tok_notname);
-  auto t_booly   = _DiatomSerialization::token__name(tok_booly.begin(), tok_booly);
+  auto t_name    = _DiatomSerialization::token__name(tok_name);
+  auto t_notname = _DiatomSerialization::token__name(tok_notname);
+  auto t_booly   = _DiatomSerialization::token__name(tok_booly);
   auto texp_name = Token{ Token::Name, 0, "a100_7F" };
   p_assert(t_name == texp_name);
   p_assert(t_notname == texp_invalid);
@@ -253,33 +597,44 @@ void testDiatom() {
 
   std::string tok_string = "\"well here's a \\\"string\\\"\"";
   std::string tok_stringnl = "\"well here's a...\nstring\"";
+  std::string tok_stringunterminated = "\"well here's a...";
   std::string tok_notstring = "29384";
-  auto t_string    = _DiatomSerialization::token__str_property(tok_string.begin(), tok_string);
-  auto t_stringnl  = _DiatomSerialization::token__str_property(tok_stringnl.begin(), tok_stringnl);
-  auto t_notstring = _DiatomSerialization::token__str_property(tok_notstring.begin(), tok_notstring);
+  auto t_string    = _DiatomSerialization::token__str_property(tok_string);
+  auto t_stringnl  = _DiatomSerialization::token__str_property(tok_stringnl);
+  auto t_stringunterminated = _DiatomSerialization::token__str_property(tok_stringunterminated);
+  auto t_notstring = _DiatomSerialization::token__str_property(tok_notstring);
   auto texp_string = Token{ Token::Property__String, 0, "\"well here's a \\\"string\\\"\"" };
   p_assert(t_string == texp_string);
   p_assert(t_stringnl.type == Token::Error);
+  p_assert(t_stringunterminated.type == Token::Error);
   p_assert(t_notstring == texp_invalid);
 
   std::string tok_number = "13.245";
   std::string tok_notnumber = "f39284";
   std::string tok_negnumber = "-37.6";
-  auto t_number    = _DiatomSerialization::token__number_property(tok_number.begin(), tok_number);
-  auto t_notnumber = _DiatomSerialization::token__number_property(tok_notnumber.begin(), tok_notnumber);
-  auto t_negnumber = _DiatomSerialization::token__number_property(tok_negnumber.begin(), tok_negnumber);
+  std::string tok_expnumber = "1.5e3x";
+  std::string tok_notexpnumber = "15ex";
+  auto t_number    = _DiatomSerialization::token__number_property(tok_number);
+  auto t_notnumber = _DiatomSerialization::token__number_property(tok_notnumber);
+  auto t_negnumber = _DiatomSerialization::token__number_property(tok_negnumber);
+  auto t_expnumber = _DiatomSerialization::token__number_property(tok_expnumber);
+  auto t_notexpnumber = _DiatomSerialization::token__number_property(tok_notexpnumber);
   auto texp_number    = Token{ Token::Property__Number, 13.245, "13.245" };
   auto texp_negnumber = Token{ Token::Property__Number, -37.6, "-37.6" };
+  auto texp_expnumber = Token{ Token::Property__Number, 1500, "1.5e3" };
+  auto texp_notexpnumber = Token{ Token::Property__Number, 15, "15" };
   p_assert(t_number == texp_number);
   p_assert(t_notnumber == texp_invalid);
   p_assert(t_negnumber == texp_negnumber);
+  p_assert(t_expnumber == texp_expnumber);
+  p_assert(t_notexpnumber == texp_notexpnumber);
 
   std::string tok_bool1 = "truexyz";
   std::string tok_bool2 = "falsexyz";
   std::string tok_bool3 = "xyztruefalse";
-  auto t_bool1 = _DiatomSerialization::token__bool_property(tok_bool1.begin(), tok_bool1);
-  auto t_bool2 = _DiatomSerialization::token__bool_property(tok_bool2.begin(), tok_bool2);
-  auto t_bool3 = _DiatomSerialization::token__bool_property(tok_bool3.begin(), tok_bool3);
+  auto t_bool1 = _DiatomSerialization::token__bool_property(tok_bool1);
+  auto t_bool2 = _DiatomSerialization::token__bool_property(tok_bool2);
+  auto t_bool3 = _DiatomSerialization::token__bool_property(tok_bool3);
   auto texp_bool1 = Token{ Token::Property__Bool, 0, "true" };
   auto texp_bool2 = Token{ Token::Property__Bool, 0, "false" };
   p_assert(t_bool1 == texp_bool1);
@@ -287,15 +642,15 @@ void testDiatom() {
   p_assert(t_bool3 == texp_invalid);
 
   std::string tok_spaces  = "    x";
-  std::string tok_tabs    = "    y";
+  std::string tok_tabs    = "\t\ty";
   std::string tok_neither = "x  ";
   std::string tok_mixed   = "\t  z";
-  auto t_spaces  = _DiatomSerialization::token__whitespace(tok_spaces.begin(), tok_spaces);
-  auto t_tabs    = _DiatomSerialization::token__whitespace(tok_tabs.begin(), tok_tabs);
-  auto t_neither = _DiatomSerialization::token__whitespace(tok_neither.begin(), tok_neither);
-  auto t_mixed   = _DiatomSerialization::token__whitespace(tok_mixed.begin(), tok_mixed);
+  auto t_spaces  = _DiatomSerialization::token__whitespace(tok_spaces);
+  auto t_tabs    = _DiatomSerialization::token__whitespace(tok_tabs);
+  auto t_neither = _DiatomSerialization::token__whitespace(tok_neither);
+  auto t_mixed   = _DiatomSerialization::token__whitespace(tok_mixed);
   auto texp_spaces = Token{ Token::Whitespace, 0, "    " };
-  auto texp_tabs   = Token{ Token::Whitespace, 0, "    " };
+  auto texp_tabs   = Token{ Token::Whitespace, 0, "\t\t" };
   p_assert(t_spaces == texp_spaces);
   p_assert(t_tabs == texp_tabs);
   p_assert(t_neither == texp_invalid);
@@ -303,178 +658,154 @@ void testDiatom() {
 
   std::string tok_colon = ":";
   std::string tok_notcolon = "@";
-  auto t_colon = _DiatomSerialization::token__colon(tok_colon.begin());
-  auto t_notcolon = _DiatomSerialization::token__colon(tok_notcolon.begin());
+  auto t_colon = _DiatomSerialization::token__colon(tok_colon);
+  auto t_notcolon = _DiatomSerialization::token__colon(tok_notcolon);
   auto texp_colon = Token{ Token::Colon, 0, ":" };
   p_assert(t_colon == texp_colon);
   p_assert(t_notcolon == Token{ Token::Invalid });
 
 
-  p_header("matching_tokens()");
-  std::string input_name       = "hello there";
-  std::string input_string     = "\"a string\"0.187";
-  std::string input_number     = "39485.95\n";
-  std::string input_bool       = "true\n";
-  std::string input_whitespace = "   muffins";
-  std::string input_colon      = ":\n";
-  auto ts_name       = _DiatomSerialization::matching_tokens(input_name.begin(),       input_name);
-  auto ts_string     = _DiatomSerialization::matching_tokens(input_string.begin(),     input_string);
-  auto ts_number     = _DiatomSerialization::matching_tokens(input_number.begin(),     input_number);
-  auto ts_bool       = _DiatomSerialization::matching_tokens(input_bool.begin(),       input_bool);
-  auto ts_whitespace = _DiatomSerialization::matching_tokens(input_whitespace.begin(), input_whitespace);
-  auto ts_colon      = _DiatomSerialization::matching_tokens(input_colon.begin(),      input_colon);
-  auto ts_name_strings       = get_type_list(ts_name);
-  auto ts_string_strings     = get_type_list(ts_string);
-  auto ts_number_strings     = get_type_list(ts_number);
-  auto ts_bool_strings       = get_type_list(ts_bool);
-  auto ts_whitespace_strings = get_type_list(ts_whitespace);
-  auto ts_colon_strings      = get_type_list(ts_colon);
-  auto ts_name_exp       = std::vector<std::string>{ "Name" };
-  auto ts_string_exp     = std::vector<std::string>{ "Property__String" };
-  auto ts_number_exp     = std::vector<std::string>{ "Property__Number" };
-  auto ts_bool_exp       = std::vector<std::string>{ "Property__Bool" };
-  auto ts_whitespace_exp = std::vector<std::string>{ "Whitespace" };
-  auto ts_colon_exp      = std::vector<std::string>{ "Colon" };
-  p_assert(ts_name_strings       == ts_name_exp);
-  p_assert(ts_string_strings     == ts_string_exp);
-  p_assert(ts_number_strings     == ts_number_exp);
-  p_assert(ts_bool_strings       == ts_bool_exp);
-  p_assert(ts_whitespace_strings == ts_whitespace_exp);
-  p_assert(ts_colon_strings      == ts_colon_exp);
-
-
-  p_header("strip_nonleading_whitespace");
-  auto stripws_result = _DiatomSerialization::strip_nonleading_whitespace(std::vector<Token>{
-    { Token::Type::Whitespace },
-    { Token::Type::Property__Bool },
-    { Token::Type::Whitespace },
-    { Token::Type::Colon },
-    { Token::Type::Whitespace},
-  });
-  std::vector<Token> stripws_exp = {
-    { Token::Type::Whitespace },
-    { Token::Type::Property__Bool },
-    { Token::Type::Colon },
-  };
-  p_assert(stripws_result == stripws_exp);
+  p_header("scanning");
+  std::mt19937 scan_random(17);
+  const char scan_chars[] = "aZz_09 \t\"\n\r:\\.-@`{\x80\xff";
+  std::uniform_int_distribution<size_t> scan_char(0, sizeof(scan_chars) - 2);
+  std::uniform_int_distribution<size_t> scan_run(0, 80);
+  auto scanners = _DiatomSerialization::available_scanners();
+  auto &scalar = _DiatomSerialization::scalar_scanner();
+  bool scanners_match = true;
+  for (int i = 0; i < 2000; ++i) {
+    // A run of one class of character, so that scans reach the SIMD blocks
+    std::string s(scan_run(scan_random), "a \"x"[i % 4]);
+    s += std::string(scan_run(scan_random) / 8, scan_chars[scan_char(scan_random)]);
+    s += scan_chars[scan_char(scan_random)];
+    for (auto *scan : scanners) {
+      for (size_t start : { size_t(0), size_t(1) }) {
+        const char *p = s.data() + std::min(start, s.size());
+        size_t n = s.size() - std::min(start, s.size());
+        scanners_match = scanners_match &&
+          scan->name_end(p, n)       == scalar.name_end(p, n) &&
+          scan->whitespace_end(p, n) == scalar.whitespace_end(p, n) &&
+          scan->string_stop(p, n)    == scalar.string_stop(p, n);
+      }
+    }
+  }
+  p_assert(scanners_match);
+  p_assert(_DiatomSerialization::scanner().name_end("abc_DEF_123:", 12) == 11);
+  p_assert(_DiatomSerialization::scanner().string_stop("0123456789abcdef0123456789abcdef\"", 33) == 32);
 
 
-  p_header("find_inconsistent_whitespace");
-  std::vector<std::vector<Token>> ws_consistent_sp = {
-    {{ Token::Name, 0, "n" }},
-    {{ Token::Whitespace, 0, "  " }},
-  };
-  std::vector<std::vector<Token>> ws_first_line = {
-    {{ Token::Whitespace, 0, "  " }},
-    {{ Token::Name, 0, "n" }},
-  };
-  std::vector<std::vector<Token>> ws_inconsistent_sameline = {
-    {{ Token::Name, 0, "n" }},
-    {{ Token::Whitespace, 0, "  \t" }},
-    {{ Token::Name, 0, "n" }},
-    {{ Token::Whitespace, 0, "  " }},
-  };
-  std::vector<std::vector<Token>> ws_inconsistent_across_lines = {
-    {{ Token::Name, 0, "n" }},
-    {{ Token::Whitespace, 0, "\t" }},
-    {{ Token::Whitespace, 0, "  " }},
-  };
-  std::vector<std::vector<Token>> ws_odd_space_indent = {
-    {{ Token::Name, 0, "n" }},
-    {{ Token::Whitespace, 0, "   " }},
-  };
-  std::vector<std::vector<Token>> ws_inappropriate_indent1 = {
-    {{ Token::Name, 0, "n" }, { Token::Colon, 0, ":" }, { Token::Property__Number, 3, "3" }},
-    {{ Token::Whitespace, 0, "  " }},
-  }; // An indent is inappropriate where it increases following a nontable property line
-  std::vector<std::vector<Token>> ws_inappropriate_indent2 = {
-    {{ Token::Name, 0, "n" }},
-    {{ Token::Whitespace, 0, "\t\t" }},
-  }; // ...or when it increases following a table line by more than 1.
-  size_t ws_consistent_sp_result             = _DiatomSerialization::find_inconsistent_whitespace(ws_consistent_sp);
-  size_t ws_first_line_result                = _DiatomSerialization::find_inconsistent_whitespace(ws_first_line);
-  size_t ws_inconsistent_sameline_result     = _DiatomSerialization::find_inconsistent_whitespace(ws_inconsistent_sameline);
-  size_t ws_inconsistent_across_lines_result = _DiatomSerialization::find_inconsistent_whitespace(ws_inconsistent_across_lines);
-  size_t ws_odd_space_indent_result          = _DiatomSerialization::find_inconsistent_whitespace(ws_odd_space_indent);
-  size_t ws_inappropriate_indent1_result     = _DiatomSerialization::find_inconsistent_whitespace(ws_inappropriate_indent1);
-  size_t ws_inappropriate_indent2_result     = _DiatomSerialization::find_inconsistent_whitespace(ws_inappropriate_indent2);
-  p_assert(ws_consistent_sp_result == -1);
-  p_assert(ws_first_line_result == 0);
-  p_assert(ws_inconsistent_sameline_result == 1);
-  p_assert(ws_inconsistent_across_lines_result == 2);
-  p_assert(ws_odd_space_indent_result == 1);
-  p_assert(ws_inappropriate_indent1_result == 1);
-  p_assert(ws_inappropriate_indent2_result == 1);
-
-
-  p_header("line_is_valid()");
-  std::vector<Token> line_withprop = {
-    { Token::Name },
-    { Token::Colon },
-    { Token::Property__Bool },
-  };
-  bool result__line_withprop = _DiatomSerialization::line_is_valid(line_withprop);
-  p_assert(result__line_withprop == true);
+  p_header("next_token()");
+  auto nt_name       = _DiatomSerialization::next_token("hello there");
+  auto nt_string     = _DiatomSerialization::next_token("\"a string\"0.187");
+  auto nt_number     = _DiatomSerialization::next_token("39485.95\n");
+  auto nt_bool       = _DiatomSerialization::next_token("true\n");
+  auto nt_boolname   = _DiatomSerialization::next_token("true_ish");
+  auto nt_whitespace = _DiatomSerialization::next_token("   muffins");
+  auto nt_colon      = _DiatomSerialization::next_token(":\n");
+  auto nt_end        = _DiatomSerialization::next_token("");
+  auto nt_garbage    = _DiatomSerialization::next_token("@x");
+  p_assert(nt_name.type_string()       == "Name");
+  p_assert(nt_string.type_string()     == "Property__String");
+  p_assert(nt_number.type_string()     == "Property__Number");
+  p_assert(nt_bool.type_string()       == "Property__Bool");
+  p_assert(nt_boolname.type_string()   == "Name");
+  p_assert(nt_whitespace.type_string() == "Whitespace");
+  p_assert(nt_colon.type_string()      == "Colon");
+  p_assert(nt_end.type_string()        == "EndOfString");
+  p_assert(nt_garbage.type_string()    == "Error");
+  p_assert(nt_string.s == "\"a string\"");
 
-  std::vector<Token> line_withoutprop = {
-    { Token::Name },
-    { Token::Colon },
-  };
-  bool result__line_withoutprop = _DiatomSerialization::line_is_valid(line_withoutprop);
-  p_assert(result__line_withoutprop == true);
-
-  std::vector<Token> line_withprop_extra = {
-    { Token::Name },
-    { Token::Colon },
-    { Token::Property__Bool },
-    { Token::Colon },
-  };
-  bool result__line_withprop_extra = _DiatomSerialization::line_is_valid(line_withprop_extra);
-  p_assert(result__line_withprop_extra == false);
-
-  std::vector<Token> line_garbage = {
-    { Token::Colon },
-    { Token::Whitespace },
-    { Token::Name },
-    { Token::Property__String },
-  };
-  bool result__line_garbage = _DiatomSerialization::line_is_valid(line_garbage);
-  p_assert(result__line_garbage == false);
-
-
-  p_header("tokenize()");
-  std::string tkz_input = "    a_prop: 7.413";
-  auto tkz_result = _DiatomSerialization::tokenize(tkz_input);
-  std::vector<Token>tkz_exp{
-    { Token::Whitespace,       0, "    "   },
-    { Token::Name,             0, "a_prop" },
-    { Token::Colon,            0, ":"      },
-    { Token::Whitespace,       0, " "      },
-    { Token::Property__Number, 7.413, "7.413"  },
-  };
-  p_assert(tkz_result == tkz_exp);
-  std::string tkz_input_fail = "   my@prop: 6";
 
-  auto tkz_result_fail = _DiatomSerialization::tokenize(tkz_input_fail);
-  p_assert(tkz_result_fail.size() == 1);
-  p_assert(tkz_result_fail[0].type == Token::Error);
+  p_header("array tokens");
+  auto at_numbers = _DiatomSerialization::next_token("[1, 2.5, -3]\n");
+  auto at_mixed   = _DiatomSerialization::next_token("[\"a, b\", true, [1, []]]");
+  auto at_empty   = _DiatomSerialization::next_token("[ ]");
+  auto at_open    = _DiatomSerialization::next_token("[1, 2");
+  auto at_comma   = _DiatomSerialization::next_token("[1,, 2]");
+  auto at_name    = _DiatomSerialization::next_token("[a]");
+  auto at_table   = _DiatomSerialization::next_token("[{a: 1, b_2 : [true, {}]}, {}]");
+  auto at_badkey  = _DiatomSerialization::next_token("[{1: 2}]");
+  auto at_nocolon = _DiatomSerialization::next_token("[{a 1}]");
+  auto at_novalue = _DiatomSerialization::next_token("[{a: }]");
+  auto at_bare    = _DiatomSerialization::next_token("{a: 1}");
+  p_assert(at_numbers.type_string() == "Property__Array");
+  p_assert(at_numbers.s == "[1, 2.5, -3]" && at_numbers.n == 3);
+  p_assert(at_mixed.type_string() == "Property__Array" && at_mixed.n == 3);
+  p_assert(at_empty.type_string() == "Property__Array" && at_empty.n == 0);
+  p_assert(at_open.type_string()  == "Error");
+  p_assert(at_comma.type_string() == "Error");
+  p_assert(at_name.type_string()  == "Error");
+  p_assert(at_table.type_string() == "Property__Array" && at_table.n == 2);
+  p_assert(at_badkey.type_string()  == "Error");
+  p_assert(at_nocolon.type_string() == "Error");
+  p_assert(at_novalue.type_string() == "Error");
+  p_assert(at_bare.type_string()    == "Error");
+  p_assert(_DiatomSerialization::next_token(std::string(63, '[') + "{a: 1}" + std::string(63, ']')).type_string() == "Property__Array");
+  p_assert(_DiatomSerialization::next_token(std::string(64, '[') + "{a: 1}" + std::string(64, ']')).type_string() == "Error");
+  p_assert(_DiatomSerialization::next_token(std::string(65, '[') + std::string(65, ']')).type_string() == "Error");
+  p_assert(_DiatomSerialization::next_token(std::string(64, '[') + std::string(64, ']')).type_string() == "Property__Array");
 
 
-  p_header("tokens_to_line()");
-  auto ttl_result = _DiatomSerialization::tokens_to_line({
-    { Token::Whitespace, 0, "  " },
-    { Token::Name, 0, "my_prop" },
-    { Token::Colon, 0, ":" },
-    { Token::Property__String, 0, "\"my_val\"" },
-  });
-  _DiatomSerialization::Line ttl_exp{
-    1,
-    {Token::Name, 0, "my_prop"},
-    {Token::Property__String, 0, "\"my_val\""},
-    {Token::Invalid},
-    {Token::Invalid},
-  };
-  p_assert(ttl_result == ttl_exp);
+  p_header("parse_line()");
+  using LineStatus = _DiatomSerialization::LineStatus;
+  _DiatomSerialization::Line pl;
+  auto pl_withprop       = _DiatomSerialization::parse_line("a: true", pl);
+  auto pl_withoutprop    = _DiatomSerialization::parse_line("a :", pl);
+  auto pl_withprop_extra = _DiatomSerialization::parse_line("a: true:", pl);
+  auto pl_garbage        = _DiatomSerialization::parse_line(": a \"b\"", pl);
+  auto pl_whitespace     = _DiatomSerialization::parse_line("   ", pl);
+  auto pl_empty          = _DiatomSerialization::parse_line("", pl);
+  auto pl_fail           = _DiatomSerialization::parse_line("   my@prop: 6", pl);
+  p_assert(pl_withprop       == LineStatus::Valid);
+  p_assert(pl_withoutprop    == LineStatus::Valid);
+  p_assert(pl_withprop_extra == LineStatus::InvalidStructure);
+  p_assert(pl_garbage        == LineStatus::InvalidStructure);
+  p_assert(pl_whitespace     == LineStatus::InvalidStructure);
+  p_assert(pl_empty          == LineStatus::InvalidStructure);
+  p_assert(pl_fail           == LineStatus::UnexpectedInput);
+
+  auto pl_number = _DiatomSerialization::parse_line("    a_prop: 7.413 ", pl);
+  p_assert(pl_number == LineStatus::Valid);
+  p_assert(pl.indent == 2);
+  p_assert(pl.name == (Token{ Token::Name, 0, "a_prop" }));
+  p_assert(pl.prop == (Token{ Token::Property__Number, 7.413, "7.413" }));
+
+  auto pl_string = _DiatomSerialization::parse_line("  my_prop: \"my_val\"", pl);
+  p_assert(pl_string == LineStatus::Valid);
+  p_assert(pl.indent == 1);
+  p_assert(pl.name == (Token{ Token::Name, 0, "my_prop" }));
+  p_assert(pl.prop == (Token{ Token::Property__String, 0, "\"my_val\"" }));
+
+  auto pl_table = _DiatomSerialization::parse_line("\t\tmy_table:", pl);
+  p_assert(pl_table == LineStatus::Valid);
+  p_assert(pl.indent == 2);
+  p_assert(pl.is_table());
+
+
+  p_header("whitespace consistency");
+  auto ws_consistent_sp             = diatom__unserialize("n:\n  m: 1\n");
+  auto ws_first_line                = diatom__unserialize("  n: 1\nm: 2\n");
+  auto ws_inconsistent_sameline     = diatom__unserialize("n:\n  \tm: 1\n");
+  auto ws_inconsistent_across_lines = diatom__unserialize("n:\n\tm: 1\n  o: 1\n");
+  auto ws_odd_space_indent          = diatom__unserialize("n:\n   m: 1\n");
+  auto ws_inappropriate_indent1     = diatom__unserialize("n: 3\n  m: 1\n");
+  auto ws_inappropriate_indent2     = diatom__unserialize("n:\n\t\tm: 1\n");
+  p_assert(ws_consistent_sp.success);
+  p_assert(ws_first_line.error_string == "Inconsistent whitespace found at line 1");
+  p_assert(ws_inconsistent_sameline.error_string == "Unexpected input at line 2");
+  p_assert(ws_inconsistent_across_lines.error_string == "Inconsistent whitespace found at line 3");
+  p_assert(ws_odd_space_indent.error_string == "Inconsistent whitespace found at line 2");
+  p_assert(ws_inappropriate_indent1.error_string == "Inconsistent whitespace found at line 2");
+  p_assert(ws_inappropriate_indent2.error_string == "Inconsistent whitespace found at line 2");
+
+
+  p_header("error precedence");
+  auto prec_input     = diatom__unserialize("a:\n   b: 1\nc d: 1\ne: @\n");
+  auto prec_structure = diatom__unserialize("a:\n   b: 1\nc d: 1\ne: 1\n");
+  auto prec_blankline = diatom__unserialize("a: 1\n\nb: 1\n");
+  p_assert(prec_input.error_string == "Unexpected input at line 4");
+  p_assert(prec_structure.error_string == "Invalid line structure at line 3");
+  p_assert(prec_blankline.error_string == "Invalid line structure at line 2");
 
 
   p_header("unserialize()");
@@ -494,11 +825,11 @@ void testDiatom() {
   auto unsz_leading_newlines_result = diatom__unserialize(std::string("\n\n") + animals);
   Diatom d = unsz_result.d;
   p_assert(unsz_result.success);
-  p_assert(d.table_entries.size() == 2);
+  p_assert(d.table_entries().size() == 2);
   p_assert(d["lemurs"].is_number());
   p_assert(d["lemurs"].number_value == 5);
   p_assert(d["birds"].is_table());
-  p_assert(d["birds"].table_entries.size() == 3);
+  p_assert(d["birds"].table_entries().size() == 3);
   p_assert(d["birds"]["blue_tits"].is_string());
   p_assert(d["birds"]["blue_tits"].string_value == "14");
   p_assert(d["birds"]["crows"].is_bool());
@@ -508,14 +839,675 @@ void testDiatom() {
   p_assert(d["birds"]["aquatic"]["penguins"].number_value == 10);
   p_assert(unsz_fail_result == unsz_fail_result_exp);
   p_assert(unsz_leading_newlines_result.success);
-  p_assert(d["birds"].table_entries[0].name == "blue_tits");
-  p_assert(d["birds"].table_entries[1].name == "aquatic");
-  p_assert(d["birds"].table_entries[2].name == "crows");
+  p_assert(d["birds"].table_entries()[0].name == "blue_tits");
+  p_assert(d["birds"].table_entries()[1].name == "aquatic");
+  p_assert(d["birds"].table_entries()[2].name == "crows");
+
+  auto unsz_nested = diatom__unserialize("a:\n  b:\n    c: 1\n  d: 2\ne: 3\nf:\n");
+  Diatom dn = unsz_nested.d;
+  p_assert(dn["a"]["b"]["c"].number_value == 1);
+  p_assert(dn["a"]["d"].number_value == 2);
+  p_assert(dn["e"].number_value == 3);
+  p_assert(dn["f"].is_table());
+  p_assert(dn.table_entries().size() == 3);
+
+  auto unsz_duplicates = diatom__unserialize("a: 1\nb: 2\na: 3\n");
+  p_assert(unsz_duplicates.d.table_entries().size() == 2);
+  p_assert(unsz_duplicates.d.table_entries()[0].name == "a");
+  p_assert(unsz_duplicates.d["a"].number_value == 3);
+
+
+  p_header("diatom__unserialize_parallel()");
+  std::string par_text;
+  for (int i=0; i < 20000; ++i) {
+    std::string n = std::to_string(i);
+    par_text += "section_" + n + ":\n";
+    par_text += "  id: " + n + "\n";
+    par_text += "  name: \"Section number " + n + "\"\n";
+    par_text += "  nested:\n    flag: true\n    x: " + n + ".5\n";
+  }
+  par_text += "section_7: \"duplicate\"\n";
+  auto par_seq = diatom__unserialize(par_text);
+  auto par_result = diatom__unserialize_parallel(par_text, 4);
+  p_assert(par_result.success);
+  p_assert(par_result.d.table_entries().size() == 20000);
+  p_assert(par_result.d["section_7"].string_value == "duplicate");
+  p_assert(diatom__serialize(par_result.d) == diatom__serialize(par_seq.d));
+
+  // Errors are reported at the same lines as when parsing sequentially
+  std::vector<std::string> par_error_texts;
+  auto par_with = [&](size_t at, std::string_view replace_with) {
+    std::string t = par_text;
+    size_t i = t.find("  id: ", at);
+    t.replace(i, 2, replace_with);
+    par_error_texts.push_back(t);
+  };
+  par_with(par_text.size() / 2, "@ ");
+  par_with(par_text.size() / 2, "   ");
+  par_with(par_text.size() * 3 / 4, "\t");
+  par_with(par_text.size() * 3 / 4, "");
+  par_error_texts.push_back(par_error_texts[2] + "late: @\n");
+  par_error_texts.push_back(std::string(par_error_texts[3]).replace(par_text.size() / 4, 0, "bad line\n"));
+  std::string par_tabs = par_text.substr(par_text.size() / 2);
+  for (size_t i = 0; (i = par_tabs.find("  ", i)) != std::string::npos; ) {
+    par_tabs.replace(i, 2, "\t");
+  }
+  par_error_texts.push_back(par_text.substr(0, par_text.size() / 2) + par_tabs);
+  bool par_errors_match = true;
+  for (auto &t : par_error_texts) {
+    auto seq = diatom__unserialize(t);
+    auto par = diatom__unserialize_parallel(t, 4);
+    par_errors_match = par_errors_match && !seq.success && seq == par;
+  }
+  p_assert(par_errors_match);
+
+
+  p_header("diatom__serialize_parallel()");
+  std::string par_serialized = diatom__serialize(par_result.d);
+  std::string par_serialized_to;
+  DiatomStringSink par_sink(par_serialized_to);
+  par_result.d["section_3"] = Diatom(Diatom::Type::Empty);
+  par_result.d["section_4"] = Diatom();
+  std::string par_with_empties = diatom__serialize(par_result.d);
+  p_assert(diatom__serialize_parallel(par_seq.d, 4) == par_serialized);
+  p_assert(diatom__serialize_parallel_to(par_seq.d, par_sink, 3) && par_serialized_to == par_serialized);
+  p_assert(diatom__serialize_parallel(par_result.d, 4) == par_with_empties);
+  p_assert(diatom__serialize_parallel(dsz1, 8) == exp__dsz1);
+  p_assert(diatom__serialize_parallel(dsz2, 8) == exp__dsz2);
+
+  // Small tables are serialized on the calling thread
+  p_assert(_DiatomSerialization::parallel_runs(dsz1, 8) == 1);
+  p_assert(_DiatomSerialization::parallel_runs(par_seq.d, 1) == 1);
+  p_assert(_DiatomSerialization::parallel_runs(par_seq.d, 4) > 1);
+  p_assert(_DiatomSerialization::parallel_runs(par_seq.d, 4) <= 16);
+
+
+  p_header("diatom__unserialize_lazy()");
+  auto lazy_result = diatom__unserialize_lazy(animals);
+  Diatom &lazy = lazy_result.d;
+  p_assert(lazy_result.success && lazy.is_lazy());
+  p_assert(lazy["lemurs"].number_value == 5);
+  p_assert(!lazy.is_lazy() && lazy.table_entries().size() == 2);
+  p_assert(lazy.table_entries()[1].item.is_lazy());
+  Diatom lazy_copy = lazy;
+  p_assert(lazy_copy["birds"].is_lazy());
+  p_assert(DiatomPath("birds.aquatic.penguins").find(lazy)->number_value == 10);
+  p_assert(!lazy["birds"].is_lazy() && !lazy["birds"]["aquatic"].is_lazy());
+  p_assert(lazy["birds"]["blue_tits"].string_value == "14");
+  p_assert(diatom__serialize(lazy) == diatom__serialize(unsz_result.d));
+  p_assert(diatom__serialize(lazy_copy) == diatom__serialize(unsz_result.d));
+  auto lazy_par = diatom__unserialize_lazy(par_text);
+  lazy_par.d.materialize_all();
+  p_assert(diatom__serialize(lazy_par.d) == diatom__serialize(par_seq.d));
+  // Copies share the tables above lazy ones, which may then be built by
+  // reads on several threads at once
+  auto lazy_shared = diatom__unserialize_lazy(par_text);
+  p_assert(lazy_shared.d.table() && std::as_const(lazy_shared.d).table_entries()[0].item.is_lazy());
+  std::vector<std::string> lazy_texts(4);
+  std::vector<std::thread> lazy_threads;
+  for (size_t i=0; i < 4; ++i) {
+    lazy_threads.emplace_back([&lazy_shared, &lazy_texts, i]() {
+      Diatom mine = lazy_shared.d;
+      lazy_texts[i] = diatom__serialize(mine);
+    });
+  }
+  for (auto &t : lazy_threads) {
+    t.join();
+  }
+  std::string lazy_seq_text = diatom__serialize(par_seq.d);
+  p_assert(std::all_of(lazy_texts.begin(), lazy_texts.end(), [&](const std::string &t) { return t == lazy_seq_text; }));
+  // Validation checks structure only. Other errors are found as tables are
+  // built, and reported by diatom__lazy_status as diatom__unserialize would
+  auto lazy_error = [](const std::string &t, bool validate) {
+    auto r = diatom__unserialize_lazy(t, validate);
+    if (!r.success) {
+      return r.error_string;
+    }
+    r.d.materialize_all();
+    return diatom__lazy_status(r.d).error_string;
+  };
+  bool lazy_errors_match = true;
+  for (auto &t : par_error_texts) {
+    auto seq = diatom__unserialize(t);
+    lazy_errors_match = lazy_errors_match && lazy_error(t, true) == seq.error_string;
+  }
+  p_assert(lazy_errors_match);
+  std::string lazy_bad_text = "\n\na: 1\nb:\n  c: 2\n  k@@: 1\n";
+  auto lazy_bad = diatom__unserialize_lazy(lazy_bad_text);
+  p_assert(lazy_bad.success && diatom__lazy_status(lazy_bad.d).success);
+  p_assert(lazy_bad.d["b"]["c"].number_value == 2);
+  p_assert(diatom__lazy_status(lazy_bad.d).error_string == "Unexpected input at line 4");
+  p_assert(diatom__unserialize(lazy_bad_text).error_string == "Unexpected input at line 4");
+  p_assert(lazy_error("a: 1\nb:\n  c d: 2\n  k@@: 1\n", true) == "Unexpected input at line 4");
+  p_assert(lazy_error("a: 1\nb:\n  c d: 2\n", true) == "Invalid line structure at line 3");
+  p_assert(lazy_error("a: 1\n\nb: 2\n", true) == "Invalid line structure at line 2");
+  p_assert(lazy_error("a: 1\n    b: 2\n", true) == "Inconsistent whitespace found at line 2");
+  p_assert(lazy_error("a:\n  b: 1\n\t c: 2\n", true) == "Unexpected input at line 3");
+  p_assert(lazy_error("a:   \n  b: \"x:\"  \n  c: [1]\n", true) == "");
+  auto lazy_unvalidated = diatom__unserialize_lazy("a: 1\nb: @\nc:\n  d: 2\n", false);
+  p_assert(lazy_unvalidated.success);
+  p_assert(diatom__serialize(lazy_unvalidated.d) == "a: 1\nc:\n  d: 2\n");
+  p_assert(diatom__lazy_status(lazy_unvalidated.d).error_string == "Unexpected input at line 2");
+  Diatom lazy_unvalidated_copy = lazy_unvalidated.d;
+  lazy_unvalidated_copy["e"] = 1.;
+  p_assert(diatom__lazy_status(lazy_unvalidated_copy).error_string == "Unexpected input at line 2");
+  p_assert(diatom__unserialize_lazy("\n\n").d.table_entries().size() == 0);
+
+
+  p_header("diatom__serialize_cached()");
+  Diatom cached = par_seq.d;
+  std::string cached_first = diatom__serialize_cached(cached);
+  std::string cached_second = diatom__serialize_cached(cached);
+  auto cache_is_clean = [](Diatom &t) { return t.table()->text_cache && !t.table()->text_cache->dirty; };
+  p_assert(cached_first == diatom__serialize(par_seq.d));
+  p_assert(cached_second == cached_first);
+  p_assert(cache_is_clean(cached) && cache_is_clean(cached.table()->entries[5].item));
+  cached["section_5"]["nested"]["x"] = 0.25;
+  p_assert(!cache_is_clean(cached) && cache_is_clean(cached.table()->entries[6].item));
+  cached.remove_child("section_0");
+  cached["section_9"] = Diatom();
+  cached["section_9"]["replaced"] = true;
+  Diatom cached_section = std::move(cached["section_8"]);
+  cached["moved"]["deeper"] = std::move(cached_section);
+  std::string cached_changed = diatom__serialize_cached(cached);
+  std::string cached_changed_to;
+  DiatomStringSink cached_sink(cached_changed_to);
+  p_assert(cached_changed == diatom__serialize(cached));
+  p_assert(diatom__serialize_cached_to(cached, cached_sink) && cached_changed_to == cached_changed);
+  p_assert(cached_changed.find("section_5:\n  id: 5\n  name: \"Section number 5\"\n  nested:\n    flag: true\n    x: 0.25\n") != std::string::npos);
+  p_assert(cached_changed.find("moved:\n  deeper:\n    id: 8\n") != std::string::npos);
+  p_assert(diatom__serialize_cached(dsz2) == exp__dsz2);
+
+  // Changes made through held references are seen
+  Diatom held;
+  held["unit"]["hp"] = 1.;
+  held["unit"]["pos"].push_back(Diatom(1.));
+  Diatom::TableEntryVector &held_entries = held["unit"].table_entries();
+  held_entries.reserve(4);
+  Diatom &held_hp = held["unit"]["hp"];
+  Diatom &held_pos = held["unit"]["pos"];
+  p_assert(diatom__serialize_cached(held) == "unit:\n  hp: 1\n  pos: [1]\n");
+  held_hp = 5.;
+  p_assert(diatom__serialize_cached(held) == "unit:\n  hp: 5\n  pos: [1]\n");
+  held_pos.push_back(Diatom(2.));
+  p_assert(diatom__serialize_cached(held) == "unit:\n  hp: 5\n  pos: [1, 2]\n");
+  held_entries.emplace_back(DiatomKey("name"), Diatom("Ulric"));
+  p_assert(diatom__serialize_cached(held) == "unit:\n  hp: 5\n  pos: [1, 2]\n  name: \"Ulric\"\n");
+  held_entries[0].item = true;
+  p_assert(diatom__serialize_cached(held) == diatom__serialize(held));
+
+
+  p_header("diatom__parse()");
+  EventRecorder events;
+  auto events_status = diatom__parse(animals, events);
+  std::vector<std::string> events_exp = {
+    "lemurs=5", "birds{", "blue_tits=\"14\"", "aquatic{", "penguins=10", "}", "crows=false", "}",
+  };
+  EventRecorder events_stopped;
+  events_stopped.stop_after = 3;
+  auto events_stopped_status = diatom__parse(animals, events_stopped);
+  EventRecorder events_invalid;
+  auto events_invalid_status = diatom__parse("a:\n  b: 1\nc: 2\n d: 3\ne: 4\n", events_invalid);
+  std::vector<std::string> events_invalid_exp = { "a{", "b=1", "}", "c=2" };
+  p_assert(events_status.success);
+  p_assert(events.events == events_exp);
+  p_assert(events_stopped_status.success && events_stopped.events.size() == 3);
+  p_assert(!events_invalid_status.success);
+  p_assert(events_invalid_status.error_string == "Inconsistent whitespace found at line 4");
+  p_assert(events_invalid.events == events_invalid_exp);
+
+
+  p_header("array syntax");
+  std::string arrays_text =
+    "path: [0, 1.5, 3]\n"
+    "mixed: [\"a\", true, [1, 2], []]\n"
+    "units: [{hp: 10, pos: [1, 2], tags: {boss: true}}, {}]\n"
+    "empty: []\n"
+    "t:\n"
+    "  nested: [[]]\n";
+  auto arrays = diatom__unserialize(arrays_text);
+  auto arrays_lazy = diatom__unserialize_lazy(arrays_text);
+  EventRecorder array_events;
+  diatom__parse("a: [1, [\"x\"], {b: 2}]\n", array_events);
+  std::vector<std::string> array_events_exp = { "a[", "=1", "[", "=\"x\"", "]", "{", "b=2", "}", "]" };
+  Diatom with_table(Diatom::Type::Array);
+  with_table.push_back(Diatom(1.));
+  with_table.push_back(Diatom());
+  with_table.array_items()[1]["x"] = 2.;
+  with_table.array_items()[1]["nothing"];
+  Diatom holds_table;
+  holds_table["a"] = with_table;
+  Diatom holds_empty = holds_table;
+  holds_empty["a"].array_items().push_back(Diatom(Diatom::Type::Empty));
+  std::string holds_empty_to;
+  DiatomStringSink holds_empty_sink(holds_empty_to);
+  Diatom too_deep(Diatom::Type::Array);
+  Diatom *too_deep_inner = &too_deep;
+  for (int i=0; i < 64; ++i) {
+    too_deep_inner->push_back(Diatom());
+    too_deep_inner = &too_deep_inner->array_items().back();
+  }
+  Diatom holds_too_deep;
+  holds_too_deep["a"] = too_deep;
+  p_assert(arrays.success);
+  p_assert(arrays.d["path"].is_packed() && arrays.d["path"].number_at(1) == 1.5);
+  p_assert(!arrays.d["mixed"].is_packed() && arrays.d["mixed"].array_size() == 4);
+  p_assert(arrays.d["mixed"].array_items()[2].is_packed());
+  p_assert(arrays.d["mixed"].array_items()[3].is_array());
+  p_assert(arrays.d["empty"].is_array() && arrays.d["empty"].array_size() == 0);
+  p_assert(diatom__serialize(arrays.d) == arrays_text);
+  p_assert(arrays_lazy.success && diatom__serialize(arrays_lazy.d) == arrays_text);
+  p_assert(array_events.events == array_events_exp);
+  p_assert(diatom__serialize(holds_table) == "a: [1, {x: 2}]\n");
+  p_assert(diatom__serialize(holds_empty) == "");
+  p_assert(diatom__serialize_to(holds_empty, holds_empty_sink) == false);
+  p_assert(diatom__serialize_cached(holds_empty) == "");
+  p_assert(diatom__serialize(holds_too_deep) == "");
+  p_assert(arrays.d["units"].array_items()[0]["pos"].number_at(1) == 2);
+  p_assert(arrays.d["units"].array_items()[0]["tags"]["boss"].bool_value);
+  p_assert(arrays_lazy.d["units"].array_items()[0]["hp"].number_value == 10);
+  p_assert(diatom__unserialize("a: [1, 2\n").error_string == "Unexpected input at line 1");
+  p_assert(diatom__unserialize("a: [1] 2\n").error_string == "Invalid line structure at line 1");
+
+
+  p_header("binary round trip");
+  std::vector<std::string> bin_fixtures = {
+    animals,
+    exp__dsz1,
+    "a:\n  b:\n    c: 1\n  d: 2\ne: 3\nf:\n",
+    "very_long_key_name_for_the_dictionary: \"and a string long enough to allocate\"\n",
+    arrays_text,
+  };
+  bool bin_fixtures_match = true;
+  for (auto &text : bin_fixtures) {
+    auto parsed = diatom__unserialize(text);
+    auto binary = diatom__serialize_binary(parsed.d);
+    auto bin_result = diatom__unserialize_binary(binary);
+    bin_fixtures_match = bin_fixtures_match &&
+      parsed.success &&
+      bin_result.success &&
+      diatom__serialize(bin_result.d) == diatom__serialize(parsed.d);
+  }
+  auto bin_numbers = diatom__unserialize_binary(diatom__serialize_binary(rt_numbers));
+  auto bin_leaf = diatom__unserialize_binary(diatom__serialize_binary(dsz2));
+  Diatom bin_empties;
+  bin_empties["nothing"];
+  bin_empties["table"] = Diatom();
+  auto bin_empties_result = diatom__unserialize_binary(diatom__serialize_binary(bin_empties));
+  p_assert(bin_fixtures_match);
+  p_assert(bin_numbers.success);
+  p_assert(diatom__serialize(bin_numbers.d) == diatom__serialize(rt_numbers));
+  p_assert(bin_leaf.success && bin_leaf.d.string_value == "Muffins");
+  p_assert(bin_empties_result.d["nothing"].is_empty());
+  p_assert(bin_empties_result.d["table"].is_table());
+  auto bin_arrays = diatom__unserialize_binary(diatom__serialize_binary(arrays.d));
+  p_assert(bin_arrays.d["path"].is_packed() && bin_arrays.d["path"].array_size() == 3);
+  p_assert(bin_arrays.d["mixed"].array_items()[1].bool_value);
+
+  std::string bin_animals = diatom__serialize_binary(unsz_result.d);
+  std::string bin_truncated = bin_animals.substr(0, bin_animals.size() - 3);
+  std::string bin_trailing = bin_animals + "x";
+  std::string bin_badtag = bin_animals;
+  bin_badtag.back() = 9;
+  p_assert(diatom__unserialize_binary("DTMX").error_string == "Invalid binary header");
+  p_assert(diatom__unserialize_binary(bin_truncated).error_string == "Invalid binary table length");
+  p_assert(diatom__unserialize_binary(bin_trailing).error_string == "Unexpected data after binary value");
+  p_assert(diatom__unserialize_binary(bin_badtag).error_string == "Invalid binary type tag");
+
+  // Nesting is limited, so deep input cannot overflow the stack
+  auto bin_nested = [](size_t depth) {
+    // depth arrays of one item each, around an Empty
+    std::string s = std::string("DTMB") + char(1) + char(0);
+    for (size_t i = depth; i > 0; --i) {
+      s += { char(6), char(1), 0, 0, 0, 0 };
+      _DiatomSerialization::binary__write_u32(s, s.size() - 4, uint32_t((i - 1) * 6 + 1));
+    }
+    return s + char(0);
+  };
+  p_assert(diatom__unserialize_binary(bin_nested(1024)).success);
+  p_assert(diatom__unserialize_binary(bin_nested(1025)).error_string == "Binary data nested too deeply");
+  p_assert(diatom__unserialize_binary(bin_nested(100000)).error_string == "Binary data nested too deeply");
+
+
+  p_header("allocators");
+  CountingResource counting;
+  auto counted = diatom__unserialize(animals, &counting);
+  size_t counted_allocations = counting.n_allocations;
+  p_assert(counted.success);
+  p_assert(counted_allocations > 0);
+  p_assert(counted.d.get_allocator().resource() == &counting);
+  p_assert(counted.d["birds"]["aquatic"].get_allocator().resource() == &counting);
+  p_assert(diatom__serialize(counted.d) == diatom__serialize(unsz_result.d));
+  Diatom counted_copy = counted.d;
+  p_assert(counting.n_allocations == counted_allocations);
+  p_assert(counted_copy.get_allocator().resource() == std::pmr::get_default_resource());
+  auto counted_bin = diatom__unserialize_binary(bin_animals, &counting);
+  p_assert(counted_bin.success && counting.n_allocations > counted_allocations);
+  p_assert(counted_bin.d["birds"].get_allocator().resource() == &counting);
+
+  DiatomArena arena(1024);
+  Diatom &arena_table = arena.make();
+  for (int i=0; i < 100; ++i) {
+    arena_table[std::string("key_") + std::to_string(i)] = double(i);
+  }
+  Diatom &arena_parsed = arena.make(std::move(diatom__unserialize(animals, arena.resource()).d));
+  p_assert(arena_table.get_allocator().resource() == arena.resource());
+  p_assert(arena_table["key_50"].number_value == 50);
+  p_assert(arena_parsed["birds"]["blue_tits"].string_value == "14");
+  p_assert(arena_parsed["birds"].get_allocator().resource() == arena.resource());
+
+
+  p_header("moves");
+  // Each long string and table is allocated once: values are moved, not
+  // copied, into their parents
+  std::string moves_str(40, 'm');
+  size_t moves_str_size = sizeof(DiatomString::Block) + moves_str.size();
+  std::string moves_text;
+  for (int i=0; i < 4; ++i) {
+    moves_text += "t" + std::to_string(i) + ":\n";
+    moves_text += "  s: \"" + moves_str + "\"\n";
+    moves_text += "  u:\n    s: \"" + moves_str + "\"\n";
+  }
+  CountingResource moves_counting;
+  auto moves_result = diatom__unserialize(moves_text, &moves_counting);
+  p_assert(moves_result.success);
+  p_assert(moves_counting.n_allocations_of_size[moves_str_size] == 8);
+  p_assert(moves_counting.n_allocations_of_size[sizeof(Diatom::Table)] == 9);
+
+  CountingResource moves_counting_bin;
+  std::string moves_bin = diatom__serialize_binary(moves_result.d);
+  auto moves_bin_result = diatom__unserialize_binary(moves_bin, &moves_counting_bin);
+  p_assert(moves_counting_bin.n_allocations_of_size[moves_str_size] == 8);
+  p_assert(moves_counting_bin.n_allocations_of_size[sizeof(Diatom::Table)] == 9);
+
+  size_t moves_n_allocations = moves_counting.n_allocations;
+  Diatom moved = moves_result.take();
+  p_assert(moves_counting.n_allocations == moves_n_allocations);
+  p_assert(moved["t3"]["u"]["s"].string_value == moves_str);
+  p_assert(moves_result.d.is_empty());
+
+  CountingResource set_counting;
+  Diatom set_table{Diatom::allocator_type(&set_counting)};
+  set_table.set("a", Diatom(moves_str, &set_counting));
+  set_table.emplace("b", moves_str);
+  set_table.emplace("c", 7.);
+  set_table.set("a", Diatom(moves_str, &set_counting));
+  p_assert(set_counting.n_allocations_of_size[moves_str_size] == 3);
+  p_assert(set_table["b"].string_value == moves_str);
+  p_assert(set_table["c"].number_value == 7);
+  p_assert(set_table.table_entries().size() == 3);
+}
+
+
+void testDiatomView() {
+  p_file_header("DiatomView.h");
+
+  std::string animals =
+    "lemurs: 5\n"
+    "birds:\n"
+    "  blue_tits: \"14\"\n"
+    "  aquatic:\n"
+    "    penguins: 10\n"
+    "    puffins:\n"
+    "  crows: false\n"
+    "cats: true\n";
+  Diatom d = diatom__unserialize(animals).d;
+  std::string binary = diatom__serialize_binary(d);
+
+  p_header("DiatomBinaryDocument");
+  DiatomBinaryDocument doc(binary);
+  DiatomBinaryDocument doc_bad("DTMX");
+  DiatomView v = doc.root();
+  p_assert(doc.success);
+  p_assert(doc_bad.success == false);
+  p_assert(doc_bad.root().is_empty());
+
+  p_header("lookup");
+  p_assert(v.is_table());
+  p_assert(v.size() == 3);
+  p_assert(v["lemurs"].is_number());
+  p_assert(v["lemurs"].number_value() == 5);
+  p_assert(v["birds"]["blue_tits"].is_string());
+  p_assert(v["birds"]["blue_tits"].string_value() == "14");
+  p_assert(v["birds"]["crows"].is_bool());
+  p_assert(v["birds"]["crows"].bool_value() == false);
+  p_assert(v["cats"].bool_value() == true);
+  p_assert(v["birds"]["aquatic"]["penguins"].number_value() == 10);
+  p_assert(v["birds"]["aquatic"]["puffins"].is_table());
+  p_assert(v["birds"]["aquatic"]["puffins"].size() == 0);
+  p_assert(v["birds"]["ostriches"].is_empty());
+  p_assert(v["lemurs"]["tails"].is_empty());
+  p_assert(v.has("cats"));
+  p_assert(!v.has("dogs"));
+
+  p_header("each and recurse");
+  std::vector<std::string> view_names;
+  std::vector<std::string> diatom_names;
+  v["birds"].each([&](std::string_view name, DiatomView) {
+    view_names.push_back(std::string(name));
+  });
+  p_assert(view_names == (std::vector<std::string>{ "blue_tits", "aquatic", "crows" }));
+  view_names.clear();
+  v.recurse([&](std::string_view name, DiatomView item) {
+    view_names.push_back(std::string(name) + ":" + item.type_string());
+  }, true);
+  d.recurse([&](std::string_view name, Diatom &item) {
+    diatom_names.push_back(std::string(name) + ":" + item.type_string());
+  }, true);
+  p_assert(view_names == diatom_names);
+
+  p_header("to_diatom");
+  Diatom from_view = v.to_diatom();
+  p_assert(diatom__serialize(from_view) == diatom__serialize(d));
+
+  p_header("DiatomMappedFile");
+  const char *path = "_view_test.diatomb";
+  FILE *f = fopen(path, "wb");
+  fwrite(binary.data(), 1, binary.size(), f);
+  fclose(f);
+  {
+    DiatomMappedFile file(path);
+    p_assert(file.success);
+    p_assert(file.root()["birds"]["aquatic"]["penguins"].number_value() == 10);
+    Diatom from_file = file.root().to_diatom();
+    p_assert(diatom__serialize(from_file) == diatom__serialize(d));
+  }
+  remove(path);
+  DiatomMappedFile missing("_no_such_file.diatomb");
+  p_assert(missing.success == false);
+  p_assert(missing.root().is_empty());
+
+  p_header("arrays");
+  Diatom arrays = diatom__unserialize("path: [0, 1.5, 3]\nmixed: [\"a\", [true], 7]\n").d;
+  std::string arrays_binary = diatom__serialize_binary(arrays);
+  DiatomBinaryDocument arrays_doc(arrays_binary);
+  DiatomView va = arrays_doc.root();
+  std::vector<std::string> item_types;
+  for (size_t i=0; i < va["mixed"].size(); ++i) {
+    item_types.push_back(va["mixed"].at(i).type_string());
+  }
+  p_assert(va["path"].is_array() && va["path"].is_packed());
+  p_assert(va["path"].size() == 3 && va["path"].number_at(1) == 1.5);
+  p_assert(va["path"].at(2).is_number() && va["path"].at(3).is_empty());
+  p_assert(va["mixed"].is_array() && !va["mixed"].is_packed());
+  p_assert(va["mixed"].at(0).string_value() == "a");
+  p_assert(va["mixed"].at(1).at(0).bool_value() == true);
+  p_assert(va["mixed"].number_at(2) == 7);
+  p_assert(item_types == (std::vector<std::string>{ "String", "Array", "Number" }));
+  Diatom arrays_from_view = va.to_diatom();
+  p_assert(diatom__serialize(arrays_from_view) == diatom__serialize(arrays));
+
+  p_header("lookup by key index");
+  p_assert(v["birds"]["aquatic"]["penguins"].number_value() == 10);
+  p_assert(v["penguins"].is_empty() && v["no_such_key"].is_empty());
+  p_assert(v["birds"]["aquatic"]["penguins"]["birds"].is_empty());
+
+  p_header("depth limit");
+  Diatom view_deep;
+  Diatom *view_deep_at = &view_deep;
+  for (size_t i=0; i < 1100; ++i) {
+    view_deep_at = &(*view_deep_at)["n"];
+  }
+  (*view_deep_at)["leaf"] = 1.;
+  std::string view_deep_binary = diatom__serialize_binary(view_deep);
+  DiatomBinaryDocument view_deep_doc(view_deep_binary);
+  size_t view_deep_visited = 0;
+  view_deep_doc.root().recurse([&](std::string_view, DiatomView) {
+    view_deep_visited += 1;
+  });
+  Diatom view_deep_decoded = view_deep_doc.root().to_diatom();
+  size_t view_deep_tables = 0;
+  for (Diatom *t = &view_deep_decoded; t->is_table(); t = &(*t)["n"]) {
+    view_deep_tables += 1;
+  }
+  p_assert(view_deep_visited == _DiatomSerialization::Binary::max_depth);
+  p_assert(view_deep_tables == _DiatomSerialization::Binary::max_depth);
+
+  p_header("malformed data");
+  std::string truncated = binary.substr(0, binary.size() - 4);
+  DiatomBinaryDocument doc_truncated(truncated);
+  p_assert(doc_truncated.success);
+  p_assert(doc_truncated.root()["lemurs"].is_empty());
+  p_assert(doc_truncated.root().to_diatom().table_entries().size() == 0);
+}
+
+
+void testDiatomDiff() {
+  p_file_header("DiatomDiff.h");
+
+  std::string before_text =
+    "world:\n"
+    "  name: \"Benchmark\"\n"
+    "  tick: 100\n"
+    "  paused: false\n"
+    "units:\n"
+    "  unit_1:\n"
+    "    hp: 10\n"
+    "    pos:\n"
+    "      x: 1\n"
+    "  unit_2:\n"
+    "    hp: 20\n"
+    "  unit_3:\n"
+    "    hp: 30\n"
+    "flags:\n"
+    "  fog: true\n";
+  std::string after_text =
+    "world:\n"
+    "  name: \"Benchmark\"\n"
+    "  tick: 101\n"
+    "  paused: \"soon\"\n"
+    "units:\n"
+    "  unit_1:\n"
+    "    hp: 10\n"
+    "    pos:\n"
+    "      x: 2\n"
+    "      y: 1\n"
+    "  unit_3:\n"
+    "    hp: 30\n"
+    "  unit_4:\n"
+    "    hp: 40\n"
+    "    inventory:\n"
+    "flags: 7\n";
+  Diatom before = diatom__unserialize(before_text).d;
+  Diatom after = diatom__unserialize(after_text).d;
+
+  p_header("diatom__diff()");
+  Diatom patch = diatom__diff(before, after);
+  std::string patch_exp =
+    "added:\n"
+    "  units:\n"
+    "    unit_1:\n"
+    "      pos:\n"
+    "        y: 1\n"
+    "    unit_4:\n"
+    "      hp: 40\n"
+    "      inventory:\n"
+    "changed:\n"
+    "  world:\n"
+    "    tick: 101\n"
+    "    paused: \"soon\"\n"
+    "  units:\n"
+    "    unit_1:\n"
+    "      pos:\n"
+    "        x: 2\n"
+    "  flags: 7\n"
+    "removed:\n"
+    "  units:\n"
+    "    unit_2: true\n";
+  Diatom same = diatom__diff(before, before);
+  Diatom leaf = 5.;
+  Diatom replaced = diatom__diff(before, leaf);
+  p_assert(diatom__serialize(patch) == patch_exp);
+  p_assert(same.is_table() && same.table_entries().size() == 0);
+  p_assert(replaced["replaced"].number_value == 5);
+
+  p_header("diatom__apply()");
+  Diatom patched = before;
+  diatom__apply(patched, patch);
+  Diatom patched_from_text = before;
+  Diatom patch_from_text = diatom__unserialize(diatom__serialize(patch)).d;
+  diatom__apply(patched_from_text, patch_from_text);
+  Diatom leaf_patched = before;
+  diatom__apply(leaf_patched, replaced);
+  p_assert(diatom__serialize(patched) == after_text);
+  p_assert(diatom__serialize(patched_from_text) == after_text);
+  p_assert(leaf_patched.is_number() && leaf_patched.number_value == 5);
+
+  Diatom wide_a, wide_b;
+  for (int i=0; i < 2000; ++i) {
+    std::string key = "item_" + std::to_string(i);
+    wide_a[key] = double(i);
+    if (i % 100 != 0) {
+      wide_b[key] = double(i % 300 == 1 ? -i : i);
+    }
+  }
+  Diatom wide_patch = diatom__diff(wide_a, wide_b);
+  diatom__apply(wide_a, wide_patch);
+  p_assert(wide_patch["removed"].table_entries().size() == 20);
+  p_assert(wide_patch["changed"].table_entries().size() == 7);
+  p_assert(diatom__serialize(wide_a) == diatom__serialize(wide_b));
+
+  // Removing many entries from a wide table is one pass, with no index
+  // rebuilt per entry
+  CountingResource wide_counting;
+  Diatom wide_c(Diatom::allocator_type{ &wide_counting });
+  Diatom wide_d;
+  for (int i=0; i < 40000; ++i) {
+    std::string key = "item_" + std::to_string(i);
+    wide_c[key] = double(i);
+    if (i % 2 == 0) {
+      wide_d[key] = double(i);
+    }
+  }
+  Diatom wide_removals = diatom__diff(wide_c, wide_d);
+  size_t wide_allocations = wide_counting.n_allocations;
+  diatom__apply(wide_c, wide_removals);
+  p_assert(wide_removals["removed"].table_entries().size() == 20000);
+  p_assert(wide_counting.n_allocations - wide_allocations < 5);
+  p_assert(wide_c.table_entries().size() == 20000 && wide_c["item_39998"].number_value == 39998);
+  p_assert(diatom__serialize(wide_c) == diatom__serialize(wide_d));
+
+  p_header("arrays");
+  Diatom arr_a = diatom__unserialize("path: [1, 2, 3]\nnames: [\"a\"]\n").d;
+  Diatom arr_b = arr_a;
+  Diatom arr_unpacked = arr_a;
+  arr_unpacked["path"].array_items();
+  arr_b["path"].array_numbers()[1] = 5;
+  Diatom arr_patch = diatom__diff(arr_a, arr_b);
+  diatom__apply(arr_a, arr_patch);
+  p_assert(diatom__serialize(arr_patch) == "changed:\n  path: [1, 5, 3]\n");
+  p_assert(diatom__serialize(arr_a) == diatom__serialize(arr_b));
+  p_assert(diatom__diff(arr_a, arr_unpacked)["changed"].has("path"));
+  p_assert(diatom__diff(arr_b, arr_unpacked)["changed"].has("path"));
+  arr_unpacked["path"].array_items()[1] = 5.;
+  p_assert(diatom__diff(arr_b, arr_unpacked).table_entries().size() == 0);
 }
 
 
 int main() {
   testDiatom();
+  testDiatomView();
+  testDiatomDiff();
   return 0;
 }
 